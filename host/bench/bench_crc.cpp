@@ -0,0 +1,148 @@
+/**
+ * @file bench_crc.cpp
+ * @brief
+ * The four CRC16 backends of ETT_ModbusRTU.h side by side.
+ *
+ *  - bit-identical check: every backend against the bitwise reference on
+ *    random data, all lengths 0..MAX_BUFFER and every split point of a
+ *    running CRC; any difference fails the test
+ *  - cost per byte on 8..256 byte frames, as host nanoseconds and, on x86,
+ *    TSC cycles
+ *
+ * Host figures only rank the backends. On the ESP32 the table backends also
+ * pay flash or RAM wait states that a desktop cache hides.
+ */
+
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "check.h"
+
+uint16_t crcBitwise(const uint8_t *au8data, uint16_t u16length);
+uint16_t crcTable(const uint8_t *au8data, uint16_t u16length);
+uint16_t crcSlice4(const uint8_t *au8data, uint16_t u16length);
+uint16_t crcSlice8(const uint8_t *au8data, uint16_t u16length);
+
+typedef uint16_t (*crc_fn_t)(const uint8_t *au8data, uint16_t u16length);
+
+struct backend_t
+{
+  const char *name;
+  crc_fn_t crc;
+};
+
+static const backend_t backends[] =
+{
+  { "bitwise", crcBitwise },
+  { "table",   crcTable },
+  { "slice4",  crcSlice4 },
+  { "slice8",  crcSlice8 },
+};
+
+#define BACKENDS                (sizeof(backends) / sizeof(backends[ 0 ]))
+#define FRAME_MAX               256
+
+/**
+ * @brief
+ * Reference CRC16, written out bit by bit, independent of the header.
+ */
+static uint16_t referenceCRC16(const uint8_t *au8data, size_t size)
+{
+  uint16_t u16crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++)
+  {
+    u16crc ^= au8data[ i ];
+    for (uint8_t j = 0; j < 8; j++) u16crc = (u16crc & 1) ? (u16crc >> 1) ^ 0xA001 : (u16crc >> 1);
+  }
+  return u16crc;
+}
+
+static double nowNs()
+{
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t nowCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void checkIdentical()
+{
+  std::vector<uint8_t> au8data(FRAME_MAX);
+  uint32_t u32seed = 12345;
+  for (uint32_t round = 0; round < 64; round++)
+  {
+    for (uint8_t &u8byte : au8data)
+    {
+      u32seed = u32seed * 1103515245UL + 12345;
+      u8byte = (uint8_t)(u32seed >> 16);
+    }
+    for (uint16_t u16length = 0; u16length <= FRAME_MAX; u16length++)
+    {
+      uint16_t u16expected = referenceCRC16(au8data.data(), u16length);
+      for (const backend_t &b : backends)
+      {
+        uint16_t u16crc = b.crc(au8data.data(), u16length);
+        if (u16crc != u16expected)
+        {
+          printf("  %s: %u bytes, round %u: 0x%04X, expected 0x%04X\n",
+                 b.name, u16length, round, u16crc, u16expected);
+        }
+        CHECK_EQ(u16crc, u16expected);
+      }
+    }
+  }
+  // a valid frame with its CRC appended checks to zero
+  std::vector<uint8_t> frame(au8data.begin(), au8data.begin() + 30);
+  uint16_t u16crc = referenceCRC16(frame.data(), frame.size());
+  frame.push_back(lowByte(u16crc));
+  frame.push_back(highByte(u16crc));
+  for (const backend_t &b : backends) CHECK_EQ(b.crc(frame.data(), (uint16_t)frame.size()), 0);
+}
+
+static void benchCost()
+{
+  static const uint16_t au16sizes[] = { 8, 16, 32, 64, 128, 256 };
+  uint8_t au8frame[ FRAME_MAX ];
+  for (uint16_t i = 0; i < FRAME_MAX; i++) au8frame[ i ] = (uint8_t)(i * 37 + 11);
+  volatile uint16_t u16sink = 0;
+
+  printf("  %-8s", "bytes");
+  for (uint16_t u16size : au16sizes) printf(" %16u", u16size);
+  printf("\n");
+  for (const backend_t &b : backends)
+  {
+    printf("  %-8s", b.name);
+    for (uint16_t u16size : au16sizes)
+    {
+      const uint32_t u32rounds = 2000000 / u16size;
+      b.crc(au8frame, u16size);                 // slice tables are built on first use
+      double dNs = nowNs();
+      uint64_t u64cycles = nowCycles();
+      for (uint32_t i = 0; i < u32rounds; i++) u16sink = u16sink ^ b.crc(au8frame, u16size);
+      u64cycles = nowCycles() - u64cycles;
+      dNs = nowNs() - dNs;
+      double dBytes = (double)u32rounds * u16size;
+      printf("  %5.2f ns %4.1f c", dNs / dBytes, u64cycles / dBytes);
+    }
+    printf("\n");
+  }
+  printf("  (per byte; c = TSC cycles, 0 where there is no TSC)\n");
+}
+
+int main()
+{
+  checkIdentical();
+  printf("CRC16 backends, cost per byte (host CPU):\n");
+  benchCost();
+  return checkResult("bench_crc");
+}
@@ -0,0 +1,158 @@
+/**
+ * @file bench_modbus.cpp
+ * @brief
+ * Throughput and latency of the Modbus master on the host.
+ *
+ *  - transactions per second and mean transaction time on the simulated
+ *    bus, at 9600 and 115200 baud (bus time, independent of the host CPU)
+ *  - CPU cost of one poll() call: idle, waiting for an answer, and the call
+ *    that receives and parses a complete answer
+ *  - CPU cost of modbusCRC16() per byte with the selected backend
+ *
+ * CPU figures are host nanoseconds: compare them between two builds on the
+ * same machine, not with an ESP32. Every timed transaction must end without
+ * error, so a figure never comes from a refused query or a broken answer.
+ */
+
+#include <Arduino.h>
+#include <chrono>
+#include "ETT_ModbusRTU.h"
+#include "MockSlave.h"
+#include "check.h"
+
+static double nowNs()
+{
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static modbus_t readTelegram(uint16_t u16count, uint16_t *au16reg)
+{
+  modbus_t t;
+  memset(&t, 0, sizeof(t));
+  t.u8id = 20;
+  t.u8fct = MB_FC_READ_REGISTERS;
+  t.u16RegAdd = 0;
+  t.u16CoilsNo = u16count;
+  t.au16reg = au16reg;
+  return t;
+}
+
+/**
+ * @brief
+ * Back-to-back reads, polled every 100 us of bus time.
+ */
+static void benchThroughput(uint32_t u32baud, uint16_t u16count)
+{
+  MockStream line(u32baud);
+  MockBus bus(line);
+  MockSlave slave(20);
+  slave.u32latency = 1000;
+  bus.add(slave);
+  Modbus master(0, line);
+  master.begin(line, u32baud);
+  uint16_t au16reg[ MAX_READ_REGS ];
+
+  const uint32_t u32transactions = 200;
+  uint32_t u32failed = 0;
+  uint64_t u64start = hostMicros();
+  double dCpu = nowNs();
+  for (uint32_t i = 0; i < u32transactions; i++)
+  {
+    if (master.query(readTelegram(u16count, au16reg)) != 0) u32failed++;
+    while (master.getState() != COM_IDLE)
+    {
+      hostAdvance(100);
+      master.poll();
+    }
+    if (master.getLastError() != 0) u32failed++;
+  }
+  dCpu = nowNs() - dCpu;
+  CHECK_EQ(u32failed, 0);
+  double dBusS = (double)(hostMicros() - u64start) / 1e6;
+  printf("  %6u baud %3u regs: %7.1f transactions/s  %6.2f ms each  (%.0f ns CPU each)\n",
+         u32baud, u16count, u32transactions / dBusS, 1000.0 * dBusS / u32transactions, dCpu / u32transactions);
+}
+
+static void benchPoll()
+{
+  MockStream line(115200);
+  MockBus bus(line);
+  MockSlave slave(20);
+  slave.u32latency = 0;
+  bus.add(slave);
+  Modbus master(0, line);
+  master.begin(line, 115200);
+  master.setTimeOut(60000);
+  uint16_t au16reg[ MAX_READ_REGS ];
+  const uint32_t u32calls = 200000;
+
+  double dNs = nowNs();
+  for (uint32_t i = 0; i < u32calls; i++) master.poll();
+  printf("  poll() idle:                %6.1f ns/call\n", (nowNs() - dNs) / u32calls);
+
+  slave.bMute = true;
+  master.query(readTelegram(3, au16reg));
+  dNs = nowNs();
+  for (uint32_t i = 0; i < u32calls; i++) master.poll();
+  printf("  poll() waiting, no data:    %6.1f ns/call\n", (nowNs() - dNs) / u32calls);
+  slave.bMute = false;
+  while (master.getState() != COM_IDLE)
+  {
+    hostAdvance(1000000);
+    master.poll();
+  }
+
+  // the answer is already in the buffer: the poll() calls that take it in, check and parse it
+  for (uint16_t u16count : { 3, 32, 125 })
+  {
+    const uint32_t u32frames = 20000;
+    uint32_t u32failed = 0;
+    double dTotal = 0;
+    for (uint32_t i = 0; i < u32frames; i++)
+    {
+      if (master.query(readTelegram(u16count, au16reg)) != 0) u32failed++;
+      hostAdvance(30000);
+      while (master.getState() != COM_IDLE)
+      {
+        dNs = nowNs();
+        master.poll();
+        dTotal += nowNs() - dNs;
+        hostAdvance(5000);                    // frame end by silence, if the master waits for it
+      }
+      if (master.getLastError() != 0) u32failed++;
+    }
+    CHECK_EQ(u32failed, 0);
+    printf("  poll() parsing %3u regs:    %6.1f ns/frame (%u bytes)\n", u16count, dTotal / u32frames, 5 + 2 * u16count);
+  }
+}
+
+static void benchCRC()
+{
+  uint8_t au8frame[ 256 ];
+  for (uint16_t i = 0; i < sizeof(au8frame); i++) au8frame[ i ] = (uint8_t)(i * 37 + 11);
+
+  for (uint16_t u16size : { 8, 64, 256 })
+  {
+    const uint32_t u32rounds = 2000000 / u16size;
+    volatile uint16_t u16sink = 0;
+    double dNs = nowNs();
+    for (uint32_t i = 0; i < u32rounds; i++) u16sink = u16sink ^ modbusCRC16(au8frame, u16size);
+    dNs = nowNs() - dNs;
+    printf("  modbusCRC16 %3u bytes:      %6.2f ns/byte\n", u16size, dNs / u32rounds / u16size);
+  }
+}
+
+int main()
+{
+  printf("bus throughput (simulated time):\n");
+  benchThroughput(9600, 3);
+  benchThroughput(9600, 125);
+  benchThroughput(115200, 3);
+  benchThroughput(115200, 125);
+  printf("poll() cost (host CPU):\n");
+  benchPoll();
+  printf("CRC cost (host CPU, backend %d):\n", MODBUS_CRC_BACKEND);
+  benchCRC();
+  return checkResult("bench_modbus");
+}
@@ -0,0 +1,121 @@
+/**
+ * @file bench_planner.cpp
+ * @brief
+ * Bus time of one polling round: every point read on its own, against
+ * ModbusPlanner's coalesced reads with gap 0 (the default) and gap 10.
+ *
+ * The point table is a typical sensor map: eight 2-register values in one
+ * contiguous run, then four single registers 4 apart. Times are simulated
+ * bus time, so they do not depend on the host CPU. Each configuration also
+ * checks that every point got its own registers, and that coalescing never
+ * takes longer than reading each point.
+ */
+
+#include <Arduino.h>
+#include "ModbusPlanner.h"
+#include "MockSlave.h"
+#include "check.h"
+
+#define POINTS                  12
+#define SLAVE_ID                20
+#define PERIOD_ONCE             0x40000000UL  //!< ms, long enough that each task runs once
+
+struct round_t
+{
+  uint8_t u8transactions;
+  uint32_t u32us;
+};
+
+static void buildPoints(modbus_point_t *points, uint16_t (*au16dest)[ 2 ])
+{
+  for (uint8_t i = 0; i < POINTS; i++)
+  {
+    boolean bRun = (i < 8);
+    points[ i ].u8id = SLAVE_ID;
+    points[ i ].u8fct = MB_FC_READ_REGISTERS;
+    points[ i ].u16address = bRun ? 100 + 2 * i : 200 + 4 * (i - 8);
+    points[ i ].u16count = bRun ? 2 : 1;
+    points[ i ].au16dest = au16dest[ i ];
+    points[ i ].u32period = PERIOD_ONCE;
+  }
+}
+
+/**
+ * @brief
+ * One round of all points.
+ *
+ * @param i16gap  planner gap, -1 to schedule one task per point
+ */
+static round_t runRound(uint32_t u32baud, int16_t i16gap)
+{
+  MockStream line(u32baud);
+  MockBus bus(line);
+  MockSlave slave(SLAVE_ID);
+  bus.add(slave);
+  Modbus master(0, line);
+  master.begin(line, u32baud);
+  modbus_task_t tasks[ POINTS ];
+  ModbusScheduler scheduler(master, tasks, POINTS);
+  ModbusPlanner planner(scheduler);
+  modbus_point_t points[ POINTS ];
+  uint16_t au16dest[ POINTS ][ 2 ];
+  memset(au16dest, 0, sizeof(au16dest));
+  buildPoints(points, au16dest);
+
+  if (i16gap < 0)
+  {
+    for (uint8_t i = 0; i < POINTS; i++)
+    {
+      scheduler.add(SLAVE_ID, MB_FC_READ_REGISTERS, points[ i ].u16address, points[ i ].u16count,
+                    points[ i ].au16dest, PERIOD_ONCE, 0);
+    }
+  }
+  else
+  {
+    planner.setGap((uint16_t)i16gap);
+    planner.plan(points, POINTS, 0);
+  }
+
+  round_t round = { scheduler.getCount(), 0 };
+  uint8_t u8done = 0;
+  uint64_t u64start = hostMicros();
+  while ((u8done < round.u8transactions) && (hostMicros() - u64start < 10000000ULL))
+  {
+    hostAdvance(100);
+    int8_t i8task = scheduler.poll();
+    if (i8task == SCHED_NONE) continue;
+    CHECK_EQ(tasks[ i8task ].u8lastError, 0);
+    planner.complete(i8task);
+    u8done++;
+  }
+  round.u32us = (uint32_t)(hostMicros() - u64start);
+
+  CHECK_EQ(slave.u32requests, round.u8transactions);
+  for (uint8_t i = 0; i < POINTS; i++)
+  {
+    for (uint16_t r = 0; r < points[ i ].u16count; r++) CHECK_EQ(au16dest[ i ][ r ], points[ i ].u16address + r);
+  }
+  return round;
+}
+
+static void bench(uint32_t u32baud)
+{
+  round_t single = runRound(u32baud, -1);
+  printf("  %6u baud, per point:  %2u transactions %8.1f ms/round\n",
+         u32baud, single.u8transactions, single.u32us / 1000.0);
+  for (int16_t i16gap : { 0, 10 })
+  {
+    round_t merged = runRound(u32baud, i16gap);
+    CHECK(merged.u32us <= single.u32us);
+    printf("  %6u baud, gap %2d:     %2u transactions %8.1f ms/round (%3.0f%%)\n",
+           u32baud, i16gap, merged.u8transactions, merged.u32us / 1000.0, 100.0 * merged.u32us / single.u32us);
+  }
+}
+
+int main()
+{
+  printf("one round of %u points (simulated bus time):\n", POINTS);
+  bench(9600);
+  bench(115200);
+  return checkResult("bench_planner");
+}
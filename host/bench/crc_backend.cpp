@@ -0,0 +1,30 @@
+/**
+ * @file crc_backend.cpp
+ * @brief
+ * One CRC16 backend of ETT_ModbusRTU.h for bench_crc.
+ *
+ * The header defines modbusCRC16() with external linkage, so an executable
+ * can only hold one copy. CMake compiles this file once per backend with
+ * MODBUS_CRC_BACKEND and CRC_BENCH_NAME set, and each copy of the header
+ * goes into a namespace of its own.
+ */
+
+#include <Arduino.h>
+
+#define CRC_CAT2(a, b)          a##b
+#define CRC_CAT(a, b)           CRC_CAT2(a, b)
+#define CRC_BENCH_NAMESPACE     CRC_CAT(CRC_BENCH_NAME, _impl)
+
+namespace CRC_BENCH_NAMESPACE
+{
+#include "ETT_ModbusRTU.h"
+}
+
+/**
+ * @brief
+ * modbusCRC16() of the backend this object was compiled with.
+ */
+uint16_t CRC_BENCH_NAME(const uint8_t *au8data, uint16_t u16length)
+{
+  return CRC_BENCH_NAMESPACE::modbusCRC16(au8data, u16length);
+}
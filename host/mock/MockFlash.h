@@ -0,0 +1,169 @@
+/**
+ * @file MockFlash.h
+ * @brief
+ * File-backed flash emulator behind the fs::FS API.
+ *
+ * Each MockFlash is a private directory under the system temp directory,
+ * removed with the object. Writes go straight to the host file, unbuffered,
+ * so whatever write() accepted is what the next mount reads, as on LittleFS
+ * after a flush.
+ *
+ * Power loss is scripted with setWriteBudget(): once that many bytes have
+ * been written, the write in progress stops short and every later write
+ * returns 0, as if the supply had dropped mid-append. powerCycle() restores
+ * the supply; the code under test then mounts again by constructing its
+ * objects anew. corrupt() flips bits in a file, to exercise CRC checks.
+ */
+
+#ifndef MOCK_FLASH_H
+#define MOCK_FLASH_H
+
+#include <FS.h>
+#include <filesystem>
+#include <string>
+
+class MockFlash : public fs::FS
+{
+public:
+  MockFlash();
+  ~MockFlash();
+
+  void setWriteBudget(uint32_t u32bytes);     //!<power fails after u32bytes more bytes
+  void powerCycle();                          //!<supply back, unlimited writes
+  boolean isPowered();                        //!<false once the budget has run out
+  boolean corrupt(const char *path, uint32_t u32offset, uint8_t u8mask);   //!<xor one byte
+  uint32_t getBytesWritten();                 //!<since construction
+
+private:
+  class Impl;
+  class FileImpl;
+  Impl *flash;
+};
+
+/* _____Implementation_______________________________________________________ */
+
+class MockFlash::FileImpl : public fs::FileImpl
+{
+public:
+  FileImpl(FILE *f, MockFlash::Impl *flash) : f(f), flash(flash) {}
+  ~FileImpl() { close(); }
+
+  size_t write(const uint8_t *au8buffer, size_t size) override;
+  size_t read(uint8_t *au8buffer, size_t size) override { return f ? fread(au8buffer, 1, size, f) : 0; }
+  void flush() override { if (f) fflush(f); }
+  bool seek(uint32_t u32pos) override { return f && (fseek(f, u32pos, SEEK_SET) == 0); }
+  size_t size() override;
+  void close() override
+  {
+    if (f) fclose(f);
+    f = NULL;
+  }
+
+private:
+  FILE *f;
+  MockFlash::Impl *flash;
+};
+
+class MockFlash::Impl : public fs::FSImpl
+{
+public:
+  std::filesystem::path root;
+  boolean bLimited;
+  uint32_t u32budget;
+  uint32_t u32written;
+
+  Impl()
+  {
+    char acTemplate[] = "/tmp/mockflashXXXXXX";
+    root = mkdtemp(acTemplate);
+    bLimited = false;
+    u32budget = 0;
+    u32written = 0;
+  }
+
+  std::string file(const char *path) { return (root / (path[ 0 ] == '/' ? path + 1 : path)).string(); }
+
+  fs::FileImplPtr open(const char *path, const char *mode) override
+  {
+    FILE *f = fopen(file(path).c_str(), mode);
+    if (f == NULL) return fs::FileImplPtr();
+    setvbuf(f, NULL, _IONBF, 0);              // every accepted byte is on "flash"
+    return std::make_shared<MockFlash::FileImpl>(f, this);
+  }
+
+  bool exists(const char *path) override { return std::filesystem::exists(file(path)); }
+  bool remove(const char *path) override { return ::remove(file(path).c_str()) == 0; }
+
+  /**
+   * @return bytes the supply still allows out of u32size
+   */
+  size_t allow(size_t size)
+  {
+    if (bLimited && (size > u32budget)) size = u32budget;
+    if (bLimited) u32budget -= size;
+    u32written += size;
+    return size;
+  }
+};
+
+inline size_t MockFlash::FileImpl::write(const uint8_t *au8buffer, size_t size)
+{
+  if (f == NULL) return 0;
+  return fwrite(au8buffer, 1, flash->allow(size), f);
+}
+
+inline size_t MockFlash::FileImpl::size()
+{
+  if (f == NULL) return 0;
+  long lPos = ftell(f);
+  fseek(f, 0, SEEK_END);
+  long lSize = ftell(f);
+  fseek(f, lPos, SEEK_SET);
+  return (size_t)lSize;
+}
+
+inline MockFlash::MockFlash()
+  : fs::FS(std::make_shared<Impl>())
+{
+  flash = static_cast<Impl *>(impl.get());
+}
+
+inline MockFlash::~MockFlash()
+{
+  std::error_code error;
+  std::filesystem::remove_all(flash->root, error);
+}
+
+inline void MockFlash::setWriteBudget(uint32_t u32bytes)
+{
+  flash->bLimited = true;
+  flash->u32budget = u32bytes;
+}
+
+inline void MockFlash::powerCycle()
+{
+  flash->bLimited = false;
+}
+
+inline boolean MockFlash::isPowered()
+{
+  return !flash->bLimited || (flash->u32budget > 0);
+}
+
+inline boolean MockFlash::corrupt(const char *path, uint32_t u32offset, uint8_t u8mask)
+{
+  FILE *f = fopen(flash->file(path).c_str(), "r+b");
+  if (f == NULL) return false;
+  boolean bOk = (fseek(f, u32offset, SEEK_SET) == 0);
+  int iByte = bOk ? fgetc(f) : EOF;
+  bOk = (iByte != EOF) && (fseek(f, u32offset, SEEK_SET) == 0) && (fputc(iByte ^ u8mask, f) != EOF);
+  fclose(f);
+  return bOk;
+}
+
+inline uint32_t MockFlash::getBytesWritten()
+{
+  return flash->u32written;
+}
+
+#endif // MOCK_FLASH_H
@@ -0,0 +1,278 @@
+/**
+ * @file MockSlave.h
+ * @brief
+ * Scriptable Modbus RTU slaves behind a MockStream.
+ *
+ * MockBus decodes every frame the master writes and passes it to the
+ * MockSlave with that id, or to all of them for a broadcast. A MockSlave
+ * serves FC1..6, 15, 16 and 23 from its own tables, independently of the
+ * Modbus class, and can be scripted per test:
+ *  - u16first/u32count: implemented registers, others answer exception 02
+ *  - u32latency: us the answer comes after the T3.5 silence that ends the request
+ *  - bMute: never answers
+ *  - u8exception: answers everything with this exception code
+ *  - u16corrupt: the next answers go out with a broken CRC
+ *  - u16silent: the next requests get no answer
+ *  - script: replaces the answer of any request
+ *
+ * The answer leaves after the request's own time on the wire, the T3.5
+ * silence every slave must respect and the latency, one character at a
+ * time (see MockStream::deliver()).
+ */
+
+#ifndef MOCK_SLAVE_H
+#define MOCK_SLAVE_H
+
+#include <vector>
+#include "MockStream.h"
+
+#define MOCK_REGS               0x10000       //!< size of each register and coil table
+
+/**
+ * @brief
+ * Reference CRC16 for the mocks: bitwise, independent of modbusCRC16().
+ */
+inline uint16_t mockCRC16(const uint8_t *au8data, size_t size)
+{
+  uint16_t u16crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++)
+  {
+    u16crc ^= au8data[ i ];
+    for (uint8_t j = 0; j < 8; j++) u16crc = (u16crc & 1) ? (u16crc >> 1) ^ 0xA001 : (u16crc >> 1);
+  }
+  return u16crc;
+}
+
+/**
+ * @brief
+ * Appends the CRC, low byte first.
+ */
+inline void mockAppendCRC(std::vector<uint8_t> &frame)
+{
+  uint16_t u16crc = mockCRC16(frame.data(), frame.size());
+  frame.push_back(lowByte(u16crc));
+  frame.push_back(highByte(u16crc));
+}
+
+class MockSlave
+{
+public:
+  typedef std::function<bool(const std::vector<uint8_t> &request, std::vector<uint8_t> &answer)> script_t;
+
+  uint8_t u8id;
+  std::vector<uint16_t> au16holding;          //!< FC3, FC6, FC16, FC23
+  std::vector<uint16_t> au16input;            //!< FC4
+  std::vector<uint8_t> au8coils;              //!< FC1, FC2, FC5, FC15, one byte per coil
+  uint16_t u16first;
+  uint32_t u32count;
+  uint32_t u32latency;
+  boolean bMute;
+  uint8_t u8exception;
+  uint16_t u16corrupt;
+  uint16_t u16silent;
+  script_t script;                            //!< return true to send answer (empty = no answer)
+  uint32_t u32requests;                       //!< requests addressed to this slave, broadcasts included
+
+  explicit MockSlave(uint8_t u8id);
+  boolean handle(const std::vector<uint8_t> &request, std::vector<uint8_t> &answer);
+
+private:
+  boolean inRange(uint16_t u16address, uint16_t u16quantity);
+  void exception(const std::vector<uint8_t> &request, uint8_t u8code, std::vector<uint8_t> &answer);
+};
+
+class MockBus
+{
+public:
+  uint32_t u32badFrames;                      //!< requests with a wrong CRC or too short
+
+  explicit MockBus(MockStream &line);
+  void add(MockSlave &slave);
+
+private:
+  MockStream *line;
+  std::vector<MockSlave *> slaves;
+
+  void onFrame(const uint8_t *au8frame, size_t size);
+};
+
+/* _____MockSlave_____________________________________________________________ */
+
+inline MockSlave::MockSlave(uint8_t u8id)
+  : au16holding(MOCK_REGS), au16input(MOCK_REGS), au8coils(MOCK_REGS)
+{
+  this->u8id = u8id;
+  u16first = 0;
+  u32count = MOCK_REGS;
+  u32latency = 1000;
+  bMute = false;
+  u8exception = 0;
+  u16corrupt = 0;
+  u16silent = 0;
+  u32requests = 0;
+  for (uint32_t i = 0; i < MOCK_REGS; i++)
+  {
+    au16holding[ i ] = (uint16_t)i;
+    au16input[ i ] = (uint16_t)(0x8000 | i);
+  }
+}
+
+/**
+ * @brief
+ * Builds the answer to a request with a valid CRC.
+ *
+ * @return false if the slave stays silent
+ */
+inline boolean MockSlave::handle(const std::vector<uint8_t> &request, std::vector<uint8_t> &answer)
+{
+  u32requests++;
+  answer.clear();
+  if (script) return script(request, answer) && !answer.empty();
+  if (bMute) return false;
+  if (u16silent > 0)
+  {
+    u16silent--;
+    return false;
+  }
+  if (u8exception != 0)
+  {
+    exception(request, u8exception, answer);
+    return true;
+  }
+
+  uint8_t u8fct = request[ 1 ];
+  uint16_t u16address = word(request[ 2 ], request[ 3 ]);
+  uint16_t u16quantity = word(request[ 4 ], request[ 5 ]);
+  answer.push_back(request[ 0 ]);
+  answer.push_back(u8fct);
+
+  switch (u8fct)
+  {
+    case 1:
+    case 2:
+      if ((u16quantity == 0) || (u16quantity > 2000)) { exception(request, 3, answer); break; }
+      if (!inRange(u16address, u16quantity)) { exception(request, 2, answer); break; }
+      answer.push_back((u16quantity + 7) / 8);
+      for (uint16_t i = 0; i < u16quantity; i += 8)
+      {
+        uint8_t u8bits = 0;
+        for (uint16_t b = 0; (b < 8) && (i + b < u16quantity); b++)
+        {
+          if (au8coils[ u16address + i + b ]) u8bits |= 1 << b;
+        }
+        answer.push_back(u8bits);
+      }
+      break;
+
+    case 3:
+    case 4:
+      if ((u16quantity == 0) || (u16quantity > 125)) { exception(request, 3, answer); break; }
+      if (!inRange(u16address, u16quantity)) { exception(request, 2, answer); break; }
+      answer.push_back(u16quantity * 2);
+      for (uint16_t i = 0; i < u16quantity; i++)
+      {
+        uint16_t u16value = (u8fct == 3) ? au16holding[ u16address + i ] : au16input[ u16address + i ];
+        answer.push_back(highByte(u16value));
+        answer.push_back(lowByte(u16value));
+      }
+      break;
+
+    case 5:
+    case 6:
+      if (!inRange(u16address, 1)) { exception(request, 2, answer); break; }
+      if (u8fct == 5) au8coils[ u16address ] = (request[ 4 ] == 0xFF);
+      else au16holding[ u16address ] = u16quantity;
+      answer.assign(request.begin(), request.begin() + 6);
+      break;
+
+    case 15:
+    case 16:
+      if (!inRange(u16address, u16quantity)) { exception(request, 2, answer); break; }
+      for (uint16_t i = 0; i < u16quantity; i++)
+      {
+        if (u8fct == 15) au8coils[ u16address + i ] = (request[ 7 + i / 8 ] >> (i % 8)) & 1;
+        else au16holding[ u16address + i ] = word(request[ 7 + 2 * i ], request[ 8 + 2 * i ]);
+      }
+      answer.assign(request.begin(), request.begin() + 6);
+      break;
+
+    case 23:
+    {
+      uint16_t u16writeAddress = word(request[ 6 ], request[ 7 ]);
+      uint16_t u16writeQuantity = word(request[ 8 ], request[ 9 ]);
+      if (!inRange(u16address, u16quantity) || !inRange(u16writeAddress, u16writeQuantity))
+      {
+        exception(request, 2, answer);
+        break;
+      }
+      for (uint16_t i = 0; i < u16writeQuantity; i++)
+      {
+        au16holding[ u16writeAddress + i ] = word(request[ 11 + 2 * i ], request[ 12 + 2 * i ]);
+      }
+      answer.push_back(u16quantity * 2);
+      for (uint16_t i = 0; i < u16quantity; i++)
+      {
+        answer.push_back(highByte(au16holding[ u16address + i ]));
+        answer.push_back(lowByte(au16holding[ u16address + i ]));
+      }
+      break;
+    }
+
+    default:
+      exception(request, 1, answer);
+      break;
+  }
+  return true;
+}
+
+inline boolean MockSlave::inRange(uint16_t u16address, uint16_t u16quantity)
+{
+  return (u16address >= u16first) && ((uint32_t)u16address + u16quantity <= u16first + u32count);
+}
+
+inline void MockSlave::exception(const std::vector<uint8_t> &request, uint8_t u8code, std::vector<uint8_t> &answer)
+{
+  answer.assign({ request[ 0 ], (uint8_t)(request[ 1 ] | 0x80), u8code });
+}
+
+/* _____MockBus_______________________________________________________________ */
+
+inline MockBus::MockBus(MockStream &line)
+{
+  this->line = &line;
+  u32badFrames = 0;
+  line.setPeer([this](const uint8_t *au8frame, size_t size) { onFrame(au8frame, size); });
+}
+
+inline void MockBus::add(MockSlave &slave)
+{
+  slaves.push_back(&slave);
+}
+
+inline void MockBus::onFrame(const uint8_t *au8frame, size_t size)
+{
+  if ((size < 4) || (mockCRC16(au8frame, size) != 0))
+  {
+    u32badFrames++;
+    return;
+  }
+  std::vector<uint8_t> request(au8frame, au8frame + size - 2);
+  uint32_t u32onWire = (uint32_t)size * line->getCharTime();
+
+  for (MockSlave *slave : slaves)
+  {
+    if ((request[ 0 ] != 0) && (request[ 0 ] != slave->u8id)) continue;
+    std::vector<uint8_t> answer;
+    if (!slave->handle(request, answer) || (request[ 0 ] == 0)) continue;   // broadcasts get no answer
+
+    mockAppendCRC(answer);
+    if (slave->u16corrupt > 0)
+    {
+      answer.back() ^= 0x5A;
+      slave->u16corrupt--;
+    }
+    line->deliver(answer.data(), answer.size(), u32onWire + line->getT35() + slave->u32latency);
+  }
+}
+
+#endif // MOCK_SLAVE_H
@@ -0,0 +1,147 @@
+/**
+ * @file MockStream.h
+ * @brief
+ * In-memory RS485 line for the host build.
+ *
+ * The code under test sees an ordinary Stream. Each write() call is one
+ * frame (the Modbus class writes a whole ADU at once) and is handed to the
+ * far end through the callback set with setPeer(). The far end answers with
+ * deliver(): the bytes then arrive one character time apart on the
+ * simulated clock, so available() grows as a test advances time, like a
+ * UART receiving at the line's baud rate.
+ */
+
+#ifndef MOCK_STREAM_H
+#define MOCK_STREAM_H
+
+#include <Arduino.h>
+#include <deque>
+#include <functional>
+
+class MockStream : public Stream
+{
+public:
+  typedef std::function<void(const uint8_t *au8frame, size_t size)> peer_t;
+
+  explicit MockStream(uint32_t u32baud = 9600);
+
+  void setPeer(peer_t peer);                  //!<far end, gets every frame written
+  uint32_t getCharTime();                     //!<us per 11-bit character
+  uint32_t getT35();                          //!<inter-frame silence in us
+  void deliver(const uint8_t *au8data, size_t size, uint32_t u32delay); //!<send to the code under test after u32delay us
+  size_t getPending();                        //!<bytes delivered but not arrived yet
+  void clear();                               //!<drops everything in flight
+  uint32_t getFrames();                       //!<frames written so far
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t u8byte) override;
+  size_t write(const uint8_t *au8buffer, size_t size) override;
+
+private:
+  struct rx_byte_t
+  {
+    uint64_t u64arrival;
+    uint8_t u8value;
+  };
+  std::deque<rx_byte_t> rx;
+  peer_t peer;
+  uint32_t u32baud;
+  uint32_t u32charTime;
+  uint32_t u32frames;
+};
+
+inline MockStream::MockStream(uint32_t u32baud)
+{
+  this->u32baud = u32baud;
+  u32charTime = 11000000UL / u32baud;
+  u32frames = 0;
+}
+
+inline void MockStream::setPeer(peer_t peer)
+{
+  this->peer = peer;
+}
+
+inline uint32_t MockStream::getCharTime()
+{
+  return u32charTime;
+}
+
+/**
+ * @brief
+ * @return 3.5 characters, fixed at 1750 us above 19200 baud
+ */
+inline uint32_t MockStream::getT35()
+{
+  return (u32baud > 19200) ? 1750 : (u32charTime * 7) / 2;
+}
+
+/**
+ * @brief
+ * Queues bytes for the code under test. The first one arrives u32delay us
+ * from now, each next one a character time later, after anything still
+ * in flight.
+ */
+inline void MockStream::deliver(const uint8_t *au8data, size_t size, uint32_t u32delay)
+{
+  uint64_t u64arrival = hostMicros() + u32delay;
+  if (!rx.empty()) u64arrival = std::max(u64arrival, rx.back().u64arrival + u32charTime);
+  for (size_t i = 0; i < size; i++)
+  {
+    rx.push_back({ u64arrival, au8data[ i ] });
+    u64arrival += u32charTime;
+  }
+}
+
+inline size_t MockStream::getPending()
+{
+  return rx.size() - available();
+}
+
+inline void MockStream::clear()
+{
+  rx.clear();
+}
+
+inline uint32_t MockStream::getFrames()
+{
+  return u32frames;
+}
+
+inline int MockStream::available()
+{
+  // arrival times are sorted: binary search keeps the cost out of the benchmarks
+  auto arrived = std::upper_bound(rx.begin(), rx.end(), hostMicros(),
+                                  [](uint64_t u64now, const rx_byte_t &b) { return u64now < b.u64arrival; });
+  return (int)(arrived - rx.begin());
+}
+
+inline int MockStream::read()
+{
+  if (rx.empty() || (rx.front().u64arrival > hostMicros())) return -1;
+  uint8_t u8value = rx.front().u8value;
+  rx.pop_front();
+  return u8value;
+}
+
+inline int MockStream::peek()
+{
+  if (rx.empty() || (rx.front().u64arrival > hostMicros())) return -1;
+  return rx.front().u8value;
+}
+
+inline size_t MockStream::write(uint8_t u8byte)
+{
+  return write(&u8byte, 1);
+}
+
+inline size_t MockStream::write(const uint8_t *au8buffer, size_t size)
+{
+  u32frames++;
+  if (peer) peer(au8buffer, size);
+  return size;
+}
+
+#endif // MOCK_STREAM_H
@@ -0,0 +1,122 @@
+/**
+ * @file SocketClient.h
+ * @brief
+ * Loopback TCP for the host build: a listening socket, a client dialing
+ * it, and SocketClient, the CLIENT that ModbusTcpServer<> expects in place
+ * of the ESP32's WiFiClient.
+ *
+ * All sockets are non-blocking, so a test steps the server and the bus in
+ * one thread while the real kernel carries the TCP traffic.
+ */
+
+#ifndef SOCKET_CLIENT_H
+#define SOCKET_CLIENT_H
+
+#include <Arduino.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+class SocketClient
+{
+public:
+  int fd;
+
+  SocketClient(int fd = -1) : fd(fd) {}
+
+  uint8_t connected();
+  int available();
+  int read(uint8_t *au8buffer, size_t size);
+  size_t write(const uint8_t *au8buffer, size_t size);
+  void stop();
+};
+
+/**
+ * @brief
+ * @return false once the peer has closed its end
+ */
+inline uint8_t SocketClient::connected()
+{
+  if (fd < 0) return false;
+  char c;
+  ssize_t r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return (r > 0) || ((r < 0) && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+inline int SocketClient::available()
+{
+  uint8_t au8peek[ 1024 ];
+  ssize_t r = recv(fd, au8peek, sizeof(au8peek), MSG_PEEK | MSG_DONTWAIT);
+  return (r > 0) ? (int)r : 0;
+}
+
+inline int SocketClient::read(uint8_t *au8buffer, size_t size)
+{
+  ssize_t r = recv(fd, au8buffer, size, MSG_DONTWAIT);
+  return (r > 0) ? (int)r : -1;
+}
+
+inline size_t SocketClient::write(const uint8_t *au8buffer, size_t size)
+{
+  ssize_t r = send(fd, au8buffer, size, MSG_NOSIGNAL);
+  return (r > 0) ? (size_t)r : 0;
+}
+
+inline void SocketClient::stop()
+{
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+}
+
+/**
+ * @brief
+ * Non-blocking listener on 127.0.0.1, on a port picked by the kernel.
+ *
+ * @return socket, -1 on error
+ */
+inline int socketListen()
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((bind(fd, (sockaddr *)&address, sizeof(address)) != 0) || (listen(fd, 8) != 0))
+  {
+    ::close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * @brief
+ * Connects to a socketListen() listener, Nagle off so every request
+ * leaves as one segment.
+ *
+ * @return non-blocking socket, -1 on error
+ */
+inline int socketDial(int listener)
+{
+  sockaddr_in address = {};
+  socklen_t length = sizeof(address);
+  getsockname(listener, (sockaddr *)&address, &length);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+  {
+    ::close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+#endif // SOCKET_CLIENT_H
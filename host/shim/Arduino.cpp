@@ -0,0 +1,67 @@
+/**
+ * @file Arduino.cpp
+ * @brief
+ * Host build: simulated clock and pins behind the Arduino API.
+ */
+
+#include <Arduino.h>
+
+static uint64_t u64hostMicros = 0;
+static uint8_t au8pinLevel[ 256 ];
+
+unsigned long millis()
+{
+  return (uint32_t)(u64hostMicros / 1000);
+}
+
+unsigned long micros()
+{
+  return (uint32_t)u64hostMicros;
+}
+
+void delay(uint32_t u32ms)
+{
+  u64hostMicros += (uint64_t)u32ms * 1000;
+}
+
+void delayMicroseconds(uint32_t u32us)
+{
+  u64hostMicros += u32us;
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t u8pin, uint8_t u8mode)
+{
+  (void)u8pin;
+  (void)u8mode;
+}
+
+void digitalWrite(uint8_t u8pin, uint8_t u8level)
+{
+  au8pinLevel[ u8pin ] = u8level;
+}
+
+int digitalRead(uint8_t u8pin)
+{
+  return au8pinLevel[ u8pin ];
+}
+
+void hostAdvance(uint32_t u32us)
+{
+  u64hostMicros += u32us;
+}
+
+uint64_t hostMicros()
+{
+  return u64hostMicros;
+}
+
+size_t Print::write(const uint8_t *au8buffer, size_t size)
+{
+  size_t n = 0;
+  while ((n < size) && (write(au8buffer[ n ]) == 1)) n++;
+  return n;
+}
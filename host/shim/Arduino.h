@@ -0,0 +1,67 @@
+/**
+ * @file Arduino.h
+ * @brief
+ * Minimal Arduino core for the host build.
+ *
+ * Provides what the library headers in smart_fram/ use, with the same
+ * semantics as the ESP32 core (std::min/std::max, 32-bit millis()).
+ *
+ * Time is simulated: millis() and micros() only move when a test calls
+ * hostAdvance(), or when the code under test calls delay() or
+ * delayMicroseconds(). A busy-wait therefore costs simulated time, not
+ * host time. Pins keep the last level written, so digitalRead() of an
+ * output returns it, as on the ESP32.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH                    0x1
+#define LOW                     0x0
+#define INPUT                   0x01
+#define OUTPUT                  0x03
+
+#define lowByte(w)              ((uint8_t)((w) & 0xff))
+#define highByte(w)             ((uint8_t)((w) >> 8))
+#define bitRead(value, bit)     (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit)      ((value) |= (1UL << (bit)))
+#define bitClear(value, bit)    ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+using std::min;
+using std::max;
+
+inline uint16_t word(uint8_t u8high, uint8_t u8low)
+{
+  return (uint16_t)((u8high << 8) | u8low);
+}
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t u32ms);
+void delayMicroseconds(uint32_t u32us);
+void yield();
+void pinMode(uint8_t u8pin, uint8_t u8mode);
+void digitalWrite(uint8_t u8pin, uint8_t u8level);
+int digitalRead(uint8_t u8pin);
+
+/* host build only */
+void hostAdvance(uint32_t u32us);             //!< moves the simulated clock forward
+uint64_t hostMicros();                        //!< simulated clock in us, does not wrap
+
+#include "Stream.h"
+
+#endif // HOST_ARDUINO_H
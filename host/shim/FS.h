@@ -0,0 +1,84 @@
+/**
+ * @file FS.h
+ * @brief
+ * Host build: the subset of the ESP32 fs::FS / fs::File API that
+ * TelemetryStore uses.
+ *
+ * As in the ESP32 core, FS and File are thin handles over an FSImpl and a
+ * FileImpl. The host implementation lives in mock/MockFlash.h.
+ */
+
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include <Arduino.h>
+#include <memory>
+
+namespace fs
+{
+
+class FileImpl
+{
+public:
+  virtual ~FileImpl() {}
+  virtual size_t write(const uint8_t *au8buffer, size_t size) = 0;
+  virtual size_t read(uint8_t *au8buffer, size_t size) = 0;
+  virtual void flush() = 0;
+  virtual bool seek(uint32_t u32pos) = 0;
+  virtual size_t size() = 0;
+  virtual void close() = 0;
+};
+
+typedef std::shared_ptr<FileImpl> FileImplPtr;
+
+class File
+{
+public:
+  File(FileImplPtr impl = FileImplPtr()) : impl(impl) {}
+
+  explicit operator bool() const { return impl != nullptr; }
+  size_t write(const uint8_t *au8buffer, size_t size) { return impl ? impl->write(au8buffer, size) : 0; }
+  size_t read(uint8_t *au8buffer, size_t size) { return impl ? impl->read(au8buffer, size) : 0; }
+  void flush() { if (impl) impl->flush(); }
+  bool seek(uint32_t u32pos) { return impl ? impl->seek(u32pos) : false; }
+  size_t size() { return impl ? impl->size() : 0; }
+  void close()
+  {
+    if (impl) impl->close();
+    impl = nullptr;
+  }
+
+private:
+  FileImplPtr impl;
+};
+
+class FSImpl
+{
+public:
+  virtual ~FSImpl() {}
+  virtual FileImplPtr open(const char *path, const char *mode) = 0;
+  virtual bool exists(const char *path) = 0;
+  virtual bool remove(const char *path) = 0;
+};
+
+typedef std::shared_ptr<FSImpl> FSImplPtr;
+
+class FS
+{
+public:
+  FS(FSImplPtr impl) : impl(impl) {}
+
+  File open(const char *path, const char *mode = "r") { return File(impl->open(path, mode)); }
+  bool exists(const char *path) { return impl->exists(path); }
+  bool remove(const char *path) { return impl->remove(path); }
+
+protected:
+  FSImplPtr impl;
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+
+#endif // HOST_FS_H
@@ -0,0 +1,22 @@
+/**
+ * @file Print.h
+ * @brief
+ * Host build: output half of the Arduino Stream interface.
+ */
+
+#ifndef HOST_PRINT_H
+#define HOST_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t u8byte) = 0;
+  virtual size_t write(const uint8_t *au8buffer, size_t size);
+  virtual void flush() {}                     //!<waits until the output has been sent
+};
+
+#endif // HOST_PRINT_H
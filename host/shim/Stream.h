@@ -0,0 +1,20 @@
+/**
+ * @file Stream.h
+ * @brief
+ * Host build: the Arduino Stream interface the Modbus class talks to.
+ */
+
+#ifndef HOST_STREAM_H
+#define HOST_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;                //!<bytes that can be read now
+  virtual int read() = 0;                     //!<next byte, -1 if none
+  virtual int peek() = 0;
+};
+
+#endif // HOST_STREAM_H
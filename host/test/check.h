@@ -0,0 +1,43 @@
+/**
+ * @file check.h
+ * @brief
+ * Assertions for the host tests.
+ *
+ * A failed CHECK() prints where and what, and the test goes on so one run
+ * shows every failure. main() returns checkResult(), which ctest reads as
+ * pass (0) or fail.
+ */
+
+#ifndef HOST_CHECK_H
+#define HOST_CHECK_H
+
+#include <stdio.h>
+
+static int iCheckFailures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      iCheckFailures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) \
+  do { \
+    long long llActual = (long long)(actual), llExpected = (long long)(expected); \
+    if (llActual != llExpected) { \
+      fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+              __FILE__, __LINE__, #actual, #expected, llActual, llExpected); \
+      iCheckFailures++; \
+    } \
+  } while (0)
+
+inline int checkResult(const char *name)
+{
+  if (iCheckFailures == 0) printf("%s: OK\n", name);
+  else printf("%s: %d check(s) failed\n", name, iCheckFailures);
+  return (iCheckFailures == 0) ? 0 : 1;
+}
+
+#endif // HOST_CHECK_H
@@ -0,0 +1,189 @@
+/**
+ * @file test_discovery.cpp
+ * @brief
+ * ModbusDiscovery on the simulated bus: fingerprints, known slaves kept
+ * across missed scans, the retry pass, early stop, and a late answer that
+ * must not create a phantom device.
+ */
+
+#include <Arduino.h>
+#include "ModbusDiscovery.h"
+#include "MockSlave.h"
+#include "check.h"
+
+static const discovery_probe_t probes[] =
+{
+  { MB_FC_READ_REGISTERS, 30, 3 },            // type 0: NPK
+  { MB_FC_READ_INPUT_REGISTER, 0, 2 },        // type 1
+};
+
+class Rig
+{
+public:
+  MockStream line;
+  MockBus bus;
+  MockSlave a, npk, b, odd;
+  Modbus master;
+  ModbusDiscovery discovery;
+
+  Rig()
+    : bus(line), a(5), npk(20), b(33), odd(40), master(0, line), discovery(master, probes, 2)
+  {
+    a.u16first = npk.u16first = 30;           // implements the NPK block only
+    a.u32count = npk.u32count = 3;
+    b.u16first = 0;                           // only the type 1 block
+    b.u32count = 2;
+    odd.u8exception = EXC_ADDR_RANGE;         // answers, but nothing it says fits a type
+    bus.add(a);
+    bus.add(npk);
+    bus.add(b);
+    bus.add(odd);
+    master.begin(line, 9600);
+    master.setTimeOut(500);
+  }
+
+  const discovery_map_t &scan(const discovery_map_t *known)
+  {
+    discovery.start(known);
+    for (uint32_t i = 0; (i < 200000) && (discovery.getState() == DISC_SCANNING); i++)
+    {
+      hostAdvance(500);
+      discovery.poll();
+    }
+    CHECK_EQ(discovery.getState(), DISC_DONE);
+    return discovery.getMap();
+  }
+};
+
+static const discovery_device_t *device(const discovery_map_t &map, uint8_t u8id)
+{
+  for (uint8_t i = 0; i < map.u8count; i++)
+  {
+    if (map.aDevices[ i ].u8id == u8id) return &map.aDevices[ i ];
+  }
+  return NULL;
+}
+
+static void testScan()
+{
+  Rig rig;
+  discovery_map_t map = rig.scan(NULL);
+  CHECK_EQ(map.u8count, 4);
+  CHECK_EQ(map.aDevices[ 0 ].u8id, 5);
+  CHECK_EQ(map.aDevices[ 0 ].u8type, 0);
+  CHECK_EQ(map.aDevices[ 1 ].u8id, 20);
+  CHECK_EQ(map.aDevices[ 2 ].u8id, 33);
+  CHECK_EQ(map.aDevices[ 2 ].u8type, 1);
+  CHECK_EQ(map.aDevices[ 3 ].u8id, 40);
+  CHECK_EQ(map.aDevices[ 3 ].u8type, DISCOVERY_UNKNOWN);
+  for (uint8_t i = 0; i < map.u8count; i++) CHECK_EQ(map.aDevices[ i ].u8missed, 0);
+  CHECK_EQ(rig.discovery.getProbed(), DISCOVERY_ID_MAX);
+  CHECK_EQ(rig.master.getTimeOut(), 500);     // restored after the short probes
+  CHECK_EQ(discoveryFind(map, 1), 33);
+}
+
+/**
+ * @brief
+ * A known slave that stops answering is kept, and polled, until it has
+ * missed DISCOVERY_MISSES_MAX scans in a row.
+ */
+static void testRetention()
+{
+  Rig rig;
+  discovery_map_t map = rig.scan(NULL);
+
+  rig.npk.bMute = true;
+  for (uint8_t u8scan = 1; u8scan < DISCOVERY_MISSES_MAX; u8scan++)
+  {
+    uint32_t u32requests = rig.npk.u32requests;
+    map = rig.scan(&map);
+    CHECK_EQ(rig.npk.u32requests - u32requests, 2);   // known pass and retry pass
+    const discovery_device_t *npk = device(map, 20);
+    CHECK(npk != NULL);
+    if (npk == NULL) return;
+    CHECK_EQ(npk->u8missed, u8scan);
+    CHECK_EQ(npk->u8type, 0);
+    CHECK_EQ(map.u8count, 4);
+  }
+
+  // answering again clears the count
+  rig.npk.bMute = false;
+  map = rig.scan(&map);
+  CHECK(device(map, 20) != NULL);
+  if (device(map, 20) != NULL) CHECK_EQ(device(map, 20)->u8missed, 0);
+
+  rig.npk.bMute = true;
+  for (uint8_t u8scan = 0; u8scan < DISCOVERY_MISSES_MAX; u8scan++) map = rig.scan(&map);
+  CHECK(device(map, 20) == NULL);
+  CHECK_EQ(map.u8count, 3);
+  CHECK_EQ(map.aDevices[ 1 ].u8id, 33);       // still sorted
+}
+
+/**
+ * @brief
+ * One lost answer is caught up by the retry pass at the end of the scan.
+ */
+static void testRetry()
+{
+  Rig rig;
+  discovery_map_t map = rig.scan(NULL);
+  rig.npk.u16silent = 1;
+  map = rig.scan(&map);
+  CHECK(device(map, 20) != NULL);
+  if (device(map, 20) != NULL) CHECK_EQ(device(map, 20)->u8missed, 0);
+}
+
+/**
+ * @brief
+ * With setExpected() the scan may end before every known id was probed:
+ * those keep their entry and their count.
+ */
+static void testEarlyStop()
+{
+  Rig rig;
+  discovery_map_t map = rig.scan(NULL);
+  map.aDevices[ 3 ].u8missed = 1;             // 40 missed one scan before
+  rig.discovery.setExpected(2);
+  uint32_t u32requests = rig.b.u32requests + rig.odd.u32requests;
+  map = rig.scan(&map);
+  CHECK_EQ(rig.b.u32requests + rig.odd.u32requests, u32requests);
+  CHECK_EQ(map.u8count, 4);
+  CHECK(device(map, 40) != NULL);
+  if (device(map, 40) != NULL) CHECK_EQ(device(map, 40)->u8missed, 1);
+}
+
+/**
+ * @brief
+ * A slave slower than the probe time-out answers while the next id is
+ * probed: that answer must not be taken for the next id's.
+ */
+static void testLateAnswer()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave slow(20);
+  slow.u32latency = 150000;                   // beyond DISCOVERY_TIMEOUT_MAX
+  bus.add(slow);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  ModbusDiscovery discovery(master, probes, 2);
+  discovery.start(NULL);
+  for (uint32_t i = 0; (i < 200000) && (discovery.getState() == DISC_SCANNING); i++)
+  {
+    hostAdvance(500);
+    discovery.poll();
+  }
+  CHECK_EQ(discovery.getState(), DISC_DONE);
+  CHECK(device(discovery.getMap(), 21) == NULL);
+  CHECK_EQ(discovery.getMap().u8count, 0);
+}
+
+int main()
+{
+  testScan();
+  testRetention();
+  testRetry();
+  testEarlyStop();
+  testLateAnswer();
+  return checkResult("test_discovery");
+}
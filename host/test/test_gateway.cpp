@@ -0,0 +1,281 @@
+/**
+ * @file test_gateway.cpp
+ * @brief
+ * Loopback test of the Modbus TCP gateway: MBAP clients on real Linux
+ * sockets, ModbusTcpServer and ModbusGateway in front of a master on the
+ * simulated RS485 line, MockSlaves behind it, and a scheduler task sharing
+ * the bus.
+ */
+
+#include <Arduino.h>
+#include <vector>
+#include "ModbusScheduler.h"
+#include "ModbusGateway.h"
+#include "MockSlave.h"
+#include "SocketClient.h"
+#include "check.h"
+
+typedef std::vector<uint8_t> bytes_t;
+
+/**
+ * @brief
+ * Both sides of the gateway, stepped together in one thread.
+ */
+class Rig
+{
+public:
+  MockStream line;
+  MockBus bus;
+  MockSlave npk, other;
+  Modbus master;
+  modbus_task_t tasks[ 1 ];
+  ModbusScheduler scheduler;
+  ModbusGateway gateway;
+  ModbusTcpServer<SocketClient> server;
+  int listener;
+  uint16_t au16npk[ 3 ];
+
+  Rig()
+    : bus(line), npk(20), other(21), master(0, line), scheduler(master, tasks, 1),
+      gateway(master), server(gateway)
+  {
+    bus.add(npk);
+    bus.add(other);
+    master.begin(line, 9600);
+    master.setTimeOut(200);
+    listener = socketListen();
+  }
+
+  ~Rig()
+  {
+    close(listener);
+  }
+
+  /**
+   * @brief
+   * One round of both tasks, then 500 us of simulated time.
+   */
+  void step()
+  {
+    int fd = accept(listener, NULL, NULL);
+    if (fd >= 0)
+    {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      SocketClient client(fd);
+      if (!server.attach(client)) client.stop();
+    }
+    server.poll();
+    scheduler.poll();
+    gateway.poll();
+    hostAdvance(500);
+  }
+
+  int dial()
+  {
+    int fd = socketDial(listener);
+    for (int i = 0; i < 10; i++) step();
+    return fd;
+  }
+
+  /**
+   * @brief
+   * Steps until a whole MBAP frame has come back on fd.
+   *
+   * @return the frame, empty if none within u32steps
+   */
+  bytes_t answer(int fd, uint32_t u32steps = 2000)
+  {
+    for (uint32_t i = 0; i < u32steps; i++)
+    {
+      uint8_t au8header[ 6 ];
+      if (recv(fd, au8header, sizeof(au8header), MSG_PEEK | MSG_DONTWAIT) == (ssize_t)sizeof(au8header))
+      {
+        bytes_t frame(6 + word(au8header[ 4 ], au8header[ 5 ]));
+        if (recv(fd, frame.data(), frame.size(), MSG_PEEK | MSG_DONTWAIT) == (ssize_t)frame.size())
+        {
+          recv(fd, frame.data(), frame.size(), MSG_DONTWAIT);
+          return frame;
+        }
+      }
+      step();
+    }
+    return bytes_t();
+  }
+};
+
+static void request(int fd, uint16_t u16transaction, uint8_t u8unit, const bytes_t &pdu)
+{
+  bytes_t frame = { highByte(u16transaction), lowByte(u16transaction), 0, 0,
+                    0, (uint8_t)(pdu.size() + 1), u8unit };
+  frame.insert(frame.end(), pdu.begin(), pdu.end());
+  send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+}
+
+static bytes_t readPdu(uint16_t u16address, uint16_t u16count)
+{
+  return { MB_FC_READ_REGISTERS, highByte(u16address), lowByte(u16address), highByte(u16count), lowByte(u16count) };
+}
+
+/**
+ * @return register i of an FC3 answer
+ */
+static uint16_t value(const bytes_t &frame, uint8_t i)
+{
+  return word(frame[ 9 + 2 * i ], frame[ 10 + 2 * i ]);
+}
+
+/**
+ * @return exception code of an answer, 0 if it is not an exception
+ */
+static uint8_t exception(const bytes_t &frame)
+{
+  return ((frame.size() == 9) && (frame[ 7 ] & 0x80)) ? frame[ 8 ] : 0;
+}
+
+static void testRead()
+{
+  Rig rig;
+  int fd = rig.dial();
+  CHECK_EQ(rig.server.getClientCount(), 1);
+
+  request(fd, 0x1234, 20, readPdu(30, 3));
+  bytes_t frame = rig.answer(fd);
+  CHECK_EQ(frame.size(), 7 + 2 + 6);
+  if (frame.size() != 15) return;
+  CHECK_EQ(word(frame[ 0 ], frame[ 1 ]), 0x1234);   // transaction echoed
+  CHECK_EQ(word(frame[ 2 ], frame[ 3 ]), 0);
+  CHECK_EQ(word(frame[ 4 ], frame[ 5 ]), 9);
+  CHECK_EQ(frame[ 6 ], 20);
+  CHECK_EQ(frame[ 7 ], MB_FC_READ_REGISTERS);
+  CHECK_EQ(frame[ 8 ], 6);
+  CHECK_EQ(value(frame, 0), 30);
+  CHECK_EQ(value(frame, 2), 32);
+
+  // a request split over two TCP segments
+  uint8_t au8split[] = { 0, 77, 0, 0, 0, 6, 21, MB_FC_READ_REGISTERS, 0, 1, 0, 2 };
+  send(fd, au8split, 5, MSG_NOSIGNAL);
+  for (int i = 0; i < 5; i++) rig.step();
+  send(fd, au8split + 5, sizeof(au8split) - 5, MSG_NOSIGNAL);
+  frame = rig.answer(fd);
+  CHECK_EQ(frame.size(), 7 + 2 + 4);
+  if (frame.size() == 13) CHECK_EQ(value(frame, 1), 2);
+  close(fd);
+}
+
+static void testCoalesceAndCache()
+{
+  Rig rig;
+  int aFd[ 3 ] = { rig.dial(), rig.dial(), rig.dial() };
+  CHECK_EQ(rig.server.getClientCount(), 3);
+
+  // three HMIs, overlapping reads: one bus transaction
+  uint32_t u32requests = rig.npk.u32requests;
+  request(aFd[ 0 ], 1, 20, readPdu(30, 3));
+  request(aFd[ 1 ], 2, 20, readPdu(31, 2));
+  request(aFd[ 2 ], 3, 20, readPdu(29, 2));
+  bytes_t a = rig.answer(aFd[ 0 ]), b = rig.answer(aFd[ 1 ]), c = rig.answer(aFd[ 2 ]);
+  CHECK_EQ(rig.npk.u32requests - u32requests, 1);
+  CHECK_EQ(rig.gateway.getCoalesced(), 2);
+  if ((a.size() == 15) && (b.size() == 13) && (c.size() == 13))
+  {
+    CHECK_EQ(value(a, 0), 30);
+    CHECK_EQ(value(b, 1), 32);
+    CHECK_EQ(value(c, 0), 29);
+  }
+  else CHECK(false);
+
+  // within the TTL the cache answers
+  request(aFd[ 0 ], 4, 20, readPdu(30, 1));
+  a = rig.answer(aFd[ 0 ]);
+  CHECK_EQ(rig.npk.u32requests - u32requests, 1);
+  CHECK_EQ(rig.gateway.getCacheHits(), 1);
+
+  // a write drops the unit's cache
+  request(aFd[ 1 ], 5, 20, { MB_FC_WRITE_MULTIPLE_REGISTERS, 0, 30, 0, 2, 4, 0x12, 0x34, 0x56, 0x78 });
+  b = rig.answer(aFd[ 1 ]);
+  CHECK_EQ(b.size(), 12);
+  CHECK_EQ(rig.npk.au16holding[ 31 ], 0x5678);
+  request(aFd[ 0 ], 6, 20, readPdu(30, 1));
+  a = rig.answer(aFd[ 0 ]);
+  CHECK_EQ(rig.npk.u32requests - u32requests, 3);
+  if (a.size() == 11) CHECK_EQ(value(a, 0), 0x1234);
+
+  request(aFd[ 2 ], 7, 21, { MB_FC_WRITE_REGISTER, 0, 5, 0xAB, 0xCD });
+  c = rig.answer(aFd[ 2 ]);
+  CHECK_EQ(c.size(), 12);
+  CHECK_EQ(rig.other.au16holding[ 5 ], 0xABCD);
+  for (int fd : aFd) close(fd);
+}
+
+static void testErrors()
+{
+  Rig rig;
+  int fd = rig.dial();
+
+  request(fd, 1, 20, { MB_FC_READ_COILS, 0, 0, 0, 1 });
+  CHECK_EQ(exception(rig.answer(fd)), EXC_FUNC_CODE);
+  request(fd, 2, 0, readPdu(0, 1));
+  CHECK_EQ(exception(rig.answer(fd)), EXC_GATEWAY_PATH);
+  request(fd, 3, 20, readPdu(0, 126));
+  CHECK_EQ(exception(rig.answer(fd)), EXC_REGS_QUANT);
+
+  rig.npk.u8exception = EXC_ADDR_RANGE;       // RTU exception passed through
+  request(fd, 4, 20, readPdu(1000, 1));
+  CHECK_EQ(exception(rig.answer(fd)), EXC_ADDR_RANGE);
+  rig.npk.u8exception = 0;
+
+  rig.npk.bMute = true;
+  request(fd, 5, 20, readPdu(2000, 1));
+  CHECK_EQ(exception(rig.answer(fd)), EXC_GATEWAY_TARGET);
+  rig.npk.bMute = false;
+
+  rig.npk.u16corrupt = 1;
+  request(fd, 6, 20, readPdu(3000, 1));
+  CHECK_EQ(exception(rig.answer(fd)), EXC_GATEWAY_TARGET);
+
+  request(fd, 7, 20, readPdu(3000, 1));       // the connection still works
+  bytes_t frame = rig.answer(fd);
+  CHECK_EQ(frame.size(), 11);
+  close(fd);
+}
+
+/**
+ * @brief
+ * Periodic telegrams and gateway requests share the bus, and a client
+ * that leaves with a request in flight does not disturb the others.
+ */
+static void testSharedBus()
+{
+  Rig rig;
+  rig.scheduler.add(20, MB_FC_READ_REGISTERS, 30, 3, rig.au16npk, 100, 0);
+  rig.gateway.setCacheTtl(0);
+  int fd = rig.dial();
+  int leaver = rig.dial();
+
+  request(leaver, 1, 21, readPdu(0, 1));
+  rig.step();
+  close(leaver);
+
+  uint16_t u16answers = 0;
+  for (uint16_t i = 0; i < 20; i++)
+  {
+    request(fd, 100 + i, 21, readPdu(i, 1));
+    bytes_t frame = rig.answer(fd);
+    if ((frame.size() == 11) && (word(frame[ 0 ], frame[ 1 ]) == 100 + i) && (value(frame, 0) == i)) u16answers++;
+  }
+  CHECK_EQ(u16answers, 20);
+  CHECK_EQ(rig.server.getClientCount(), 1);
+  CHECK(rig.tasks[ 0 ].u16okCnt > 0);
+  CHECK_EQ(rig.tasks[ 0 ].u16errCnt, 0);
+  CHECK_EQ(rig.au16npk[ 2 ], 32);
+  close(fd);
+}
+
+int main()
+{
+  testRead();
+  testCoalesceAndCache();
+  testErrors();
+  testSharedBus();
+  return checkResult("test_gateway");
+}
@@ -0,0 +1,596 @@
+/**
+ * @file test_modbus.cpp
+ * @brief
+ * Modbus master against MockSlave, and master against the library's own
+ * slave: every function code, errors, time-outs, frame end, broadcast,
+ * RX_EVENT and TX_ASYNC.
+ */
+
+#include <Arduino.h>
+#include "ETT_ModbusRTU.h"
+#include "MockSlave.h"
+#include "check.h"
+
+#define TXEN_PIN                25
+
+/**
+ * @brief
+ * Runs one transaction to its end in 100 us steps.
+ *
+ * @return last non-zero poll() result, or the query() error
+ */
+static int16_t transact(Modbus &master, modbus_t telegram, MockStream *event = NULL)
+{
+  int8_t i8error = master.query(telegram);
+  if (i8error != 0) return i8error;
+  int16_t i16result = 0;
+  for (uint32_t i = 0; i < 100000; i++)
+  {
+    hostAdvance(100);
+    if ((event != NULL) && (event->available() > 0)) master.rxEvent();
+    int16_t i16poll = master.poll();
+    if (i16poll != 0) i16result = i16poll;
+    if (master.getState() == COM_IDLE) break;
+  }
+  return i16result;
+}
+
+static modbus_t telegram(uint8_t u8id, uint8_t u8fct, uint16_t u16address, uint16_t u16count, uint16_t *au16reg)
+{
+  modbus_t t;
+  memset(&t, 0, sizeof(t));
+  t.u8id = u8id;
+  t.u8fct = u8fct;
+  t.u16RegAdd = u16address;
+  t.u16CoilsNo = u16count;
+  t.au16reg = au16reg;
+  return t;
+}
+
+static void testFunctionCodes()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+
+  uint16_t au16reg[ 16 ] = { 0 };
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 3 + 6 + 2);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 30);
+  CHECK_EQ(au16reg[ 2 ], 32);
+
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_INPUT_REGISTER, 5, 2, au16reg)), 3 + 4 + 2);
+  CHECK_EQ(au16reg[ 1 ], 0x8006);
+
+  au16reg[ 0 ] = 0xBEEF;
+  transact(master, telegram(20, MB_FC_WRITE_REGISTER, 100, 1, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(npk.au16holding[ 100 ], 0xBEEF);
+
+  for (uint16_t i = 0; i < 10; i++) au16reg[ i ] = 1000 + i;
+  transact(master, telegram(20, MB_FC_WRITE_MULTIPLE_REGISTERS, 200, 10, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(npk.au16holding[ 209 ], 1009);
+
+  // 17 coils: 3 bytes on the wire, first coil in bit 0 of the low byte
+  au16reg[ 0 ] = 0xA55A;
+  au16reg[ 1 ] = 0x0001;
+  transact(master, telegram(20, MB_FC_WRITE_MULTIPLE_COILS, 0, 17, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(npk.au8coils[ 1 ], 1);
+  CHECK_EQ(npk.au8coils[ 8 ], 1);
+  CHECK_EQ(npk.au8coils[ 16 ], 1);
+  CHECK_EQ(npk.au8coils[ 17 ], 0);
+  memset(au16reg, 0, sizeof(au16reg));
+  transact(master, telegram(20, MB_FC_READ_COILS, 0, 17, au16reg));
+  CHECK_EQ(au16reg[ 0 ], 0xA55A);
+  CHECK_EQ(au16reg[ 1 ], 0x0001);
+
+  au16reg[ 0 ] = 1;
+  transact(master, telegram(20, MB_FC_WRITE_COIL, 40, 1, au16reg));
+  CHECK_EQ(npk.au8coils[ 40 ], 1);
+
+  uint16_t au16write[ 2 ] = { 0x1111, 0x2222 };
+  modbus_t rw = telegram(20, MB_FC_READ_WRITE_REGISTERS, 300, 3, au16reg);
+  rw.u16WriteAdd = 301;
+  rw.u16WriteNo = 2;
+  rw.au16write = au16write;
+  transact(master, rw);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 300);
+  CHECK_EQ(au16reg[ 1 ], 0x1111);
+  CHECK_EQ(au16reg[ 2 ], 0x2222);
+
+  CHECK_EQ(master.query(telegram(248, MB_FC_READ_REGISTERS, 0, 1, au16reg)), -3);
+}
+
+/**
+ * @brief
+ * Largest frames of each function code, and the quantities query() refuses.
+ */
+static void testLimits()
+{
+  MockStream line(115200);
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 115200);
+
+  // FC3 answer of 255 bytes, FC16 request of 255 bytes
+  uint16_t au16reg[ MAX_READ_REGS ] = { 0 };
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_REGISTERS, 1000, MAX_READ_REGS, au16reg)), 3 + MAX_READ_REGS * 2 + 2);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 1000);
+  CHECK_EQ(au16reg[ MAX_READ_REGS - 1 ], 1000 + MAX_READ_REGS - 1);
+
+  for (uint16_t i = 0; i < MAX_WRITE_REGS; i++) au16reg[ i ] = 0x4000 + i;
+  transact(master, telegram(20, MB_FC_WRITE_MULTIPLE_REGISTERS, 3000, MAX_WRITE_REGS, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(npk.au16holding[ 3000 ], 0x4000);
+  CHECK_EQ(npk.au16holding[ 3000 + MAX_WRITE_REGS - 1 ], 0x4000 + MAX_WRITE_REGS - 1);
+  CHECK_EQ(npk.au16holding[ 3000 + MAX_WRITE_REGS ], 3000 + MAX_WRITE_REGS);
+
+  // 2000 coils: 250 data bytes
+  for (uint16_t i = 0; i < MAX_READ_BITS; i++) npk.au8coils[ i ] = (i % 3) == 0;
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_COILS, 0, MAX_READ_BITS, au16reg)), 3 + MAX_READ_BITS / 8 + 2);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 0x9249);
+  CHECK_EQ((au16reg[ (MAX_READ_BITS - 1) / 16 ] >> ((MAX_READ_BITS - 1) % 16)) & 1, ((MAX_READ_BITS - 1) % 3) == 0);
+
+  // FC23 at both limits
+  uint16_t au16write[ MAX_RW_WRITE_REGS + 1 ];
+  for (uint16_t i = 0; i <= MAX_RW_WRITE_REGS; i++) au16write[ i ] = 0x6000 + i;
+  modbus_t rw = telegram(20, MB_FC_READ_WRITE_REGISTERS, 5000, MAX_READ_REGS, au16reg);
+  rw.u16WriteAdd = 5000;
+  rw.u16WriteNo = MAX_RW_WRITE_REGS;
+  rw.au16write = au16write;
+  CHECK_EQ(transact(master, rw), 3 + MAX_READ_REGS * 2 + 2);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ MAX_RW_WRITE_REGS - 1 ], 0x6000 + MAX_RW_WRITE_REGS - 1);
+  CHECK_EQ(au16reg[ MAX_RW_WRITE_REGS ], 5000 + MAX_RW_WRITE_REGS);
+
+  // above the protocol limits, or nothing at all: refused, nothing sent
+  uint32_t u32frames = line.getFrames();
+  rw.u16WriteNo = MAX_RW_WRITE_REGS + 1;
+  CHECK_EQ(master.query(rw), ERR_BUFF_OVERFLOW);
+  rw.u16WriteNo = 1;
+  rw.u16CoilsNo = MAX_READ_REGS + 1;
+  CHECK_EQ(master.query(rw), ERR_BUFF_OVERFLOW);
+  rw.u16CoilsNo = 0;
+  CHECK_EQ(master.query(rw), ERR_BUFF_OVERFLOW);
+  rw.u16CoilsNo = 1;
+  rw.u16WriteNo = 0;
+  CHECK_EQ(master.query(rw), ERR_BUFF_OVERFLOW);
+  rw.u16WriteNo = 1;
+  rw.au16write = NULL;
+  CHECK_EQ(master.query(rw), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 0, MAX_READ_REGS + 1, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_WRITE_MULTIPLE_REGISTERS, 0, MAX_WRITE_REGS + 1, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_COILS, 0, MAX_READ_BITS + 1, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_DISCRETE_INPUT, 0, MAX_READ_BITS + 1, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_WRITE_MULTIPLE_COILS, 0, MAX_WRITE_BITS + 1, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 0, 0, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_COILS, 0, 0, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_WRITE_REGISTER, 0, 0, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_WRITE_MULTIPLE_REGISTERS, 0, 0, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(master.query(telegram(20, MB_FC_WRITE_MULTIPLE_COILS, 0, 0, au16reg)), ERR_BUFF_OVERFLOW);
+  CHECK_EQ(line.getFrames(), u32frames);
+  CHECK_EQ(master.getState(), COM_IDLE);
+}
+
+static void testErrors()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  npk.u16first = 30;
+  npk.u32count = 3;
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  master.setTimeOut(500);
+  uint16_t au16reg[ 8 ];
+
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 29, 4, au16reg));
+  CHECK_EQ(master.getLastError(), (uint8_t)ERR_EXCEPTION);
+  CHECK_EQ(master.getLastException(), EXC_ADDR_RANGE);
+
+  // no answer: NO_REPLY once the time-out has run out, not before
+  npk.bMute = true;
+  uint64_t u64start = hostMicros();
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  CHECK_EQ(master.getLastError(), NO_REPLY);
+  CHECK((hostMicros() - u64start) >= 500000);
+  CHECK((hostMicros() - u64start) < 510000);
+  npk.bMute = false;
+
+  // broken CRC: a frame came in but it is not an answer
+  uint16_t u16in = master.getInCnt();
+  uint16_t u16err = master.getErrCnt();
+  npk.u16corrupt = 1;
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  CHECK_EQ(master.getLastError(), NO_REPLY);
+  CHECK_EQ(master.getInCnt(), u16in + 1);
+  CHECK_EQ(master.getErrCnt(), u16err + 1);
+
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 1 ], 31);
+}
+
+/**
+ * @brief
+ * A known-length answer is taken in as its last byte arrives, one of
+ * unknown length a T3.5 later, timed at the line's baud rate.
+ */
+static void testFrameEnd()
+{
+  MockStream line(115200);
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 115200);
+  uint16_t au16reg[ 3 ];
+
+  uint64_t u64start = hostMicros();
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 3 + 6 + 2);
+  uint64_t u64lastByte = u64start + 8 * line.getCharTime() + line.getT35() + npk.u32latency + 10 * line.getCharTime();
+  CHECK(hostMicros() >= u64lastByte);
+  CHECK(hostMicros() < u64lastByte + 100);    // the next poll() step
+
+  // an answer shorter than predicted ends with the silence after it
+  npk.script = [](const std::vector<uint8_t> &request, std::vector<uint8_t> &answer)
+  {
+    answer.assign({ request[ 0 ], request[ 1 ], 4, 0, 1, 0, 2 });
+    return true;
+  };
+  u64start = hostMicros();
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  u64lastByte = u64start + 8 * line.getCharTime() + line.getT35() + npk.u32latency + 8 * line.getCharTime();
+  CHECK(hostMicros() > u64lastByte);
+  CHECK(hostMicros() <= u64lastByte + line.getT35() + 200);
+}
+
+/**
+ * @brief
+ * An answer that comes after the time-out lands in the next transaction:
+ * it must not pass for the answer of another slave.
+ */
+static void testLateAnswer()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave slow(20), absent(21);
+  slow.u32latency = 150000;
+  absent.bMute = true;
+  bus.add(slow);
+  bus.add(absent);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  master.setTimeOut(100);
+  uint16_t au16reg[ 3 ] = { 0 };
+
+  transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  CHECK_EQ(master.getLastError(), NO_REPLY);
+  uint16_t u16err = master.getErrCnt();
+  uint16_t u16in = master.getInCnt();
+  transact(master, telegram(21, MB_FC_READ_REGISTERS, 30, 3, au16reg));
+  CHECK_EQ(master.getLastError(), NO_REPLY);
+  CHECK_EQ(master.getInCnt(), u16in + 1);     // a frame came in, but not from 21
+  CHECK_EQ(master.getErrCnt(), u16err + 1);
+  CHECK_EQ(au16reg[ 0 ], 0);
+}
+
+static void testBroadcast()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave a(1), b(2);
+  bus.add(a);
+  bus.add(b);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+
+  uint16_t u16value = 77;
+  uint64_t u64start = hostMicros();
+  CHECK_EQ(transact(master, telegram(0, MB_FC_WRITE_REGISTER, 10, 1, &u16value)), 0);
+  CHECK_EQ(a.au16holding[ 10 ], 77);
+  CHECK_EQ(b.au16holding[ 10 ], 77);
+  CHECK((hostMicros() - u64start) >= (uint64_t)(TURNAROUND_DEFAULT - 1) * 1000);   // millis() resolution
+  CHECK_EQ(master.query(telegram(0, MB_FC_READ_REGISTERS, 10, 1, &u16value)), -3);
+}
+
+static Modbus *monitored;
+static uint8_t u8stateAtAnswer;
+static uint16_t u16answers;
+static uint32_t u32rttAtAnswer;
+
+static void stateMonitor(uint8_t /* u8id */, uint8_t /* u8fct */, uint8_t u8event, uint32_t u32rtt)
+{
+  if (u8event != MB_EV_RESPONSE) return;
+  u8stateAtAnswer = monitored->getState();
+  u32rttAtAnswer = u32rtt;
+  u16answers++;
+}
+
+static void testRxEvent()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  master.setRxMode(RX_EVENT);
+  uint16_t au16reg[ 3 ];
+
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 0);
+  hostAdvance(50000);                         // whole answer in the UART buffer
+  master.rxEvent();
+  CHECK_EQ(au16reg[ 2 ], 32);
+  CHECK_EQ(master.getState(), COM_WAITING);   // until poll() has reported it
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), -1);
+  CHECK_EQ(master.poll(), 3 + 6 + 2);
+  CHECK_EQ(master.getState(), COM_IDLE);
+  CHECK_EQ(master.getLastError(), 0);
+
+  CHECK_EQ(transact(master, telegram(20, MB_FC_READ_REGISTERS, 30, 2, au16reg), &line), 3 + 4 + 2);
+
+  // the monitor runs in poll(), not in the callback, with the RTT of the
+  // moment the answer was complete
+  monitored = &master;
+  u8stateAtAnswer = COM_IDLE;
+  u16answers = 0;
+  master.setMonitor(stateMonitor);
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 0);
+  hostAdvance(50000);
+  master.rxEvent();
+  CHECK_EQ(u16answers, 0);
+  CHECK_EQ(master.getState(), COM_WAITING);
+  hostAdvance(100000);
+  CHECK_EQ(master.poll(), 3 + 6 + 2);
+  CHECK_EQ(u16answers, 1);
+  CHECK_EQ(u8stateAtAnswer, COM_WAITING);
+  CHECK(u32rttAtAnswer <= 50000);
+  CHECK_EQ(master.getState(), COM_IDLE);
+  master.setMonitor(NULL);
+}
+
+/**
+ * @brief
+ * Line that runs a hook once, on the next read(): stands for the task
+ * that preempts the receive callback in the middle of a frame.
+ */
+class PreemptedStream : public MockStream
+{
+public:
+  std::function<void()> hook;
+
+  int read() override
+  {
+    if (hook)
+    {
+      std::function<void()> run = hook;
+      hook = nullptr;
+      run();
+    }
+    return MockStream::read();
+  }
+};
+
+static void testRxEventTimeout()
+{
+  PreemptedStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  master.setRxMode(RX_EVENT);
+  master.setTimeOut(500);
+  uint16_t au16reg[ 3 ] = { 0 };
+
+  // the time-out runs out while rxEvent() is reading the answer
+  int16_t i16poll = -1;
+  uint8_t u8stateInside = COM_IDLE;
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 0);
+  hostAdvance(50000);
+  line.hook = [&]()
+  {
+    hostAdvance(600000);
+    i16poll = master.poll();
+    u8stateInside = master.getState();
+  };
+  master.rxEvent();
+  CHECK_EQ(i16poll, 0);
+  CHECK_EQ(u8stateInside, COM_RECEIVING);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(master.poll(), 3 + 6 + 2);
+  CHECK_EQ(master.getState(), COM_IDLE);
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 2 ], 32);
+
+  // half a frame, then silence: the transaction is released and times out
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 0);
+  hostAdvance(10 * line.getCharTime() + line.getT35() + npk.u32latency + 100);  // 3 bytes of the answer in
+  master.rxEvent();
+  CHECK_EQ(master.getState(), COM_WAITING);
+  line.clear();
+  hostAdvance(600000);
+  CHECK_EQ(master.poll(), 0);
+  CHECK_EQ(master.getState(), COM_IDLE);
+  CHECK_EQ(master.getLastError(), NO_REPLY);
+}
+
+static void testTxAsync()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line, TXEN_PIN);
+  master.begin(line, 9600);
+  master.setTxMode(TX_ASYNC);
+  uint16_t au16reg[ 3 ];
+
+  uint64_t u64start = hostMicros();
+  CHECK_EQ(master.query(telegram(20, MB_FC_READ_REGISTERS, 30, 3, au16reg)), 0);
+  CHECK_EQ(hostMicros(), u64start);           // no busy-wait inside query()
+  CHECK_EQ(master.getState(), COM_SENDING);
+  CHECK_EQ(digitalRead(TXEN_PIN), HIGH);
+
+  hostAdvance(8 * line.getCharTime());        // still sending the 8-byte request
+  master.poll();
+  CHECK_EQ(digitalRead(TXEN_PIN), HIGH);
+  hostAdvance(2 * line.getCharTime());        // frame and guard character out
+  master.poll();
+  CHECK_EQ(digitalRead(TXEN_PIN), LOW);
+  CHECK_EQ(master.getState(), COM_WAITING);
+
+  for (int i = 0; (i < 1000) && (master.getState() != COM_IDLE); i++)
+  {
+    hostAdvance(100);
+    master.poll();
+  }
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 30);
+}
+
+/**
+ * @brief
+ * Library master and library slave on two crossed lines.
+ */
+static void testLibrarySlave()
+{
+  MockStream toSlave, toMaster;
+  Modbus master(0, toMaster);
+  Modbus slave(7, toSlave);
+  master.begin(toMaster, 19200);
+  slave.begin(toSlave, 19200);
+  toMaster.setPeer([&](const uint8_t *au8frame, size_t size) { toSlave.deliver(au8frame, size, size * toSlave.getCharTime()); });
+  toSlave.setPeer([&](const uint8_t *au8frame, size_t size) { toMaster.deliver(au8frame, size, size * toMaster.getCharTime()); });
+
+  uint16_t au16slave[ 10 ] = { 0, 11, 22, 33, 44, 55, 66, 77, 88, 99 };
+  uint16_t au16reg[ 4 ] = { 0 };
+  CHECK_EQ(master.query(telegram(7, MB_FC_READ_REGISTERS, 2, 4, au16reg)), 0);
+  for (int i = 0; (i < 1000) && (master.getState() != COM_IDLE); i++)
+  {
+    hostAdvance(100);
+    slave.poll(au16slave, 10);
+    master.poll();
+  }
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 22);
+  CHECK_EQ(au16reg[ 3 ], 55);
+}
+
+// register map: 100..104 and 105..106 writable, 107..111 read only,
+// nothing from 112 to 199, 200 writable
+static uint16_t au16mapRw[ 7 ];
+static uint16_t au16mapFar;
+
+static uint16_t mapReadRw(uint16_t u16offset) { return au16mapRw[ u16offset ]; }
+static uint16_t mapReadRwHigh(uint16_t u16offset) { return au16mapRw[ 5 + u16offset ]; }
+static uint16_t mapReadOnly(uint16_t u16offset) { return 1000 + u16offset; }
+static uint16_t mapReadFar(uint16_t /* u16offset */) { return au16mapFar; }
+static boolean mapWriteRw(uint16_t u16offset, uint16_t u16value) { au16mapRw[ u16offset ] = u16value; return true; }
+static boolean mapWriteRwHigh(uint16_t u16offset, uint16_t u16value) { au16mapRw[ 5 + u16offset ] = u16value; return true; }
+static boolean mapWriteFar(uint16_t /* u16offset */, uint16_t u16value) { au16mapFar = u16value; return true; }
+
+static const modbus_register_t registerMap[] =
+{
+  { 100, 5, mapReadRw, mapWriteRw },
+  { 105, 2, mapReadRwHigh, mapWriteRwHigh },
+  { 107, 5, mapReadOnly, NULL },
+  { 200, 1, mapReadFar, mapWriteFar }
+};
+
+/**
+ * @brief
+ * Runs one transaction between the library master and a library slave
+ * that serves registerMap.
+ */
+static void mapTransact(Modbus &master, Modbus &slave, modbus_t telegram)
+{
+  CHECK_EQ(master.query(telegram), 0);
+  for (int i = 0; (i < 1000) && (master.getState() != COM_IDLE); i++)
+  {
+    hostAdvance(100);
+    slave.poll(registerMap, sizeof(registerMap) / sizeof(registerMap[ 0 ]));
+    master.poll();
+  }
+}
+
+static void testRegisterMap()
+{
+  MockStream toSlave, toMaster;
+  Modbus master(0, toMaster);
+  Modbus slave(7, toSlave);
+  master.begin(toMaster, 19200);
+  slave.begin(toSlave, 19200);
+  toMaster.setPeer([&](const uint8_t *au8frame, size_t size) { toSlave.deliver(au8frame, size, size * toSlave.getCharTime()); });
+  toSlave.setPeer([&](const uint8_t *au8frame, size_t size) { toMaster.deliver(au8frame, size, size * toMaster.getCharTime()); });
+  uint16_t au16reg[ 8 ] = { 0 };
+  for (uint16_t i = 0; i < 7; i++) au16mapRw[ i ] = 500 + i;
+
+  // read inside one block
+  mapTransact(master, slave, telegram(7, MB_FC_READ_REGISTERS, 108, 3, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16reg[ 0 ], 1001);
+  CHECK_EQ(au16reg[ 2 ], 1003);
+
+  // read across the hole after 111
+  mapTransact(master, slave, telegram(7, MB_FC_READ_REGISTERS, 110, 4, au16reg));
+  CHECK_EQ(master.getLastError(), (uint8_t)ERR_EXCEPTION);
+  CHECK_EQ(master.getLastException(), EXC_ADDR_RANGE);
+
+  // writes reaching a read-only register: none of the writable ones before it changes
+  au16reg[ 0 ] = 0xDEAD;
+  mapTransact(master, slave, telegram(7, MB_FC_WRITE_REGISTER, 107, 1, au16reg));
+  CHECK_EQ(master.getLastError(), (uint8_t)ERR_EXCEPTION);
+  CHECK_EQ(master.getLastException(), EXC_ADDR_RANGE);
+  for (uint16_t i = 0; i < 5; i++) au16reg[ i ] = 0xDEAD;
+  mapTransact(master, slave, telegram(7, MB_FC_WRITE_MULTIPLE_REGISTERS, 103, 5, au16reg));
+  CHECK_EQ(master.getLastError(), (uint8_t)ERR_EXCEPTION);
+  CHECK_EQ(master.getLastException(), EXC_ADDR_RANGE);
+  for (uint16_t i = 0; i < 7; i++) CHECK_EQ(au16mapRw[ i ], 500 + i);
+
+  // one FC16 over two adjacent blocks
+  for (uint16_t i = 0; i < 5; i++) au16reg[ i ] = 2000 + i;
+  mapTransact(master, slave, telegram(7, MB_FC_WRITE_MULTIPLE_REGISTERS, 102, 5, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16mapRw[ 1 ], 501);
+  CHECK_EQ(au16mapRw[ 2 ], 2000);
+  CHECK_EQ(au16mapRw[ 6 ], 2004);
+
+  // coils are not served by a map
+  mapTransact(master, slave, telegram(7, MB_FC_READ_COILS, 100, 8, au16reg));
+  CHECK_EQ(master.getLastError(), (uint8_t)ERR_EXCEPTION);
+  CHECK_EQ(master.getLastException(), EXC_FUNC_CODE);
+
+  au16reg[ 0 ] = 77;
+  mapTransact(master, slave, telegram(7, MB_FC_WRITE_REGISTER, 200, 1, au16reg));
+  CHECK_EQ(master.getLastError(), 0);
+  CHECK_EQ(au16mapFar, 77);
+}
+
+int main()
+{
+  testFunctionCodes();
+  testLimits();
+  testErrors();
+  testFrameEnd();
+  testLateAnswer();
+  testBroadcast();
+  testRxEvent();
+  testRxEventTimeout();
+  testTxAsync();
+  testLibrarySlave();
+  testRegisterMap();
+  return checkResult("test_modbus");
+}
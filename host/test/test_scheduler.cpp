@@ -0,0 +1,127 @@
+/**
+ * @file test_scheduler.cpp
+ * @brief
+ * ModbusScheduler on the simulated bus: periods, priorities, a telegram
+ * the master refuses and a bus kept busy by another user.
+ */
+
+#include <Arduino.h>
+#include "ModbusScheduler.h"
+#include "MockSlave.h"
+#include "check.h"
+
+/**
+ * @brief
+ * Polls the scheduler for u32ms of simulated time, in 100 us steps.
+ */
+static void run(ModbusScheduler &scheduler, uint32_t u32ms)
+{
+  for (uint32_t i = 0; i < u32ms * 10; i++)
+  {
+    hostAdvance(100);
+    scheduler.poll();
+  }
+}
+
+static void testPeriods()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  modbus_task_t tasks[ 2 ];
+  ModbusScheduler scheduler(master, tasks, 2);
+  uint16_t au16fast[ 3 ], au16slow[ 3 ];
+
+  CHECK_EQ(scheduler.add(20, MB_FC_READ_REGISTERS, 30, 3, au16fast, 100, 0), 0);
+  CHECK_EQ(scheduler.add(20, MB_FC_READ_REGISTERS, 40, 3, au16slow, 1000, 1), 1);
+  run(scheduler, 2000);
+  CHECK(tasks[ 0 ].u16okCnt >= 19);
+  CHECK(tasks[ 0 ].u16okCnt <= 21);
+  CHECK_EQ(tasks[ 1 ].u16okCnt, 2);
+  CHECK_EQ(tasks[ 0 ].u16errCnt + tasks[ 1 ].u16errCnt, 0);
+  CHECK_EQ(au16slow[ 2 ], 42);
+}
+
+/**
+ * @brief
+ * A telegram query() always rejects must not keep the others off the bus.
+ */
+static void testRefused()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  modbus_task_t tasks[ 3 ];
+  ModbusScheduler scheduler(master, tasks, 3);
+  uint16_t au16reg[ 130 ];
+
+  scheduler.add(248, MB_FC_READ_REGISTERS, 0, 1, au16reg, 500, 0);         // bad id
+  scheduler.add(20, MB_FC_READ_REGISTERS, 0, 126, au16reg, 500, 0);        // over MAX_BUFFER
+  scheduler.add(20, MB_FC_READ_REGISTERS, 30, 3, au16reg, 100, 1);
+
+  CHECK_EQ(scheduler.poll(), 0);              // finishes at once, with its error
+  CHECK_EQ(tasks[ 0 ].u8lastError, (uint8_t)-3);
+  CHECK_EQ(scheduler.poll(), 1);
+  CHECK_EQ(tasks[ 1 ].u8lastError, (uint8_t)ERR_BUFF_OVERFLOW);
+
+  run(scheduler, 1900);
+  CHECK(tasks[ 2 ].u16okCnt >= 18);
+  CHECK_EQ(tasks[ 0 ].u16errCnt, 4);          // once per period (0, 500, 1000, 1500 ms), not per poll()
+  CHECK_EQ(tasks[ 1 ].u16errCnt, 4);
+  CHECK_EQ(tasks[ 2 ].u16errCnt, 0);
+  CHECK(npk.u32requests - tasks[ 2 ].u16okCnt <= 1);   // the last one may still be in flight
+}
+
+/**
+ * @brief
+ * While another user holds the master, a due telegram waits and goes out
+ * as soon as the bus is free, without losing its turn.
+ */
+static void testBusy()
+{
+  MockStream line;
+  MockBus bus(line);
+  MockSlave npk(20);
+  bus.add(npk);
+  Modbus master(0, line);
+  master.begin(line, 9600);
+  modbus_task_t tasks[ 1 ];
+  ModbusScheduler scheduler(master, tasks, 1);
+  uint16_t au16reg[ 3 ];
+  scheduler.add(20, MB_FC_READ_REGISTERS, 30, 3, au16reg, 1000, 0);
+
+  modbus_t other;
+  memset(&other, 0, sizeof(other));
+  other.u8id = 20;
+  other.u8fct = MB_FC_READ_REGISTERS;
+  other.u16CoilsNo = 1;
+  other.au16reg = au16reg;
+  CHECK_EQ(master.query(other), 0);
+  uint32_t u32due = tasks[ 0 ].u32due;
+  CHECK_EQ(scheduler.poll(), SCHED_NONE);
+  CHECK_EQ(tasks[ 0 ].u32due, u32due);
+  CHECK_EQ(tasks[ 0 ].u16errCnt, 0);
+
+  while (master.getState() != COM_IDLE)
+  {
+    hostAdvance(100);
+    master.poll();
+  }
+  run(scheduler, 100);
+  CHECK_EQ(tasks[ 0 ].u16okCnt, 1);
+  CHECK_EQ(tasks[ 0 ].u16errCnt, 0);
+}
+
+int main()
+{
+  testPeriods();
+  testRefused();
+  testBusy();
+  return checkResult("test_scheduler");
+}
@@ -0,0 +1,219 @@
+/**
+ * @file test_store.cpp
+ * @brief
+ * TelemetryStore on the file-backed flash emulator: wrap-around, the ack
+ * file, CRC rejection and power loss in the middle of an append or commit.
+ *
+ * Every "reboot" destroys the store and mounts a new one on the same flash.
+ */
+
+#include <Arduino.h>
+#include <string>
+#include "TelemetryStore.h"
+#include "MockFlash.h"
+#include "check.h"
+
+#define PATH                    "/telemetry.bin"
+#define CAPACITY                8
+
+static void frame(uint8_t u8value, uint8_t *au8frame)
+{
+  memset(au8frame, u8value, TELEMETRY_BINARY_SIZE);
+}
+
+/**
+ * @brief
+ * Drains everything a freshly mounted store returns, in order.
+ *
+ * @return first byte of each frame
+ */
+static std::string drain(TelemetryStore &store, boolean bCommit = true)
+{
+  std::string values;
+  uint8_t au8frame[ TELEMETRY_BINARY_SIZE ];
+  while (store.peek(au8frame))
+  {
+    values.push_back((char)au8frame[ 0 ]);
+    store.pop();
+  }
+  if (bCommit) store.commit();
+  return values;
+}
+
+static void testWrap()
+{
+  MockFlash flash;
+  uint8_t au8frame[ TELEMETRY_BINARY_SIZE ];
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK_EQ(store.available(), 0);
+    for (uint8_t i = 0; i < 12; i++)
+    {
+      frame('a' + i, au8frame);
+      CHECK(store.append(au8frame));
+    }
+    CHECK_EQ(store.available(), CAPACITY);
+    CHECK_EQ(store.getDropped(), 4);
+  }
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK_EQ(store.available(), CAPACITY);
+    CHECK(drain(store) == "efghijkl");        // oldest four overwritten
+    frame('m', au8frame);
+    CHECK(store.append(au8frame));
+  }
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK(drain(store) == "m");               // sequence carried on across the reboot
+  }
+}
+
+static void testAck()
+{
+  MockFlash flash;
+  uint8_t au8frame[ TELEMETRY_BINARY_SIZE ];
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    for (uint8_t i = 0; i < 5; i++)
+    {
+      frame('a' + i, au8frame);
+      store.append(au8frame);
+    }
+    store.peek(au8frame);
+    store.pop();
+    store.peek(au8frame);
+    store.pop();
+    store.commit();
+    CHECK(flash.exists(PATH ".ack"));
+    store.peek(au8frame);
+    store.pop();                              // sent but not committed
+  }
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK_EQ(store.available(), 3);
+    CHECK(drain(store, false) == "cde");      // uncommitted frame replayed
+  }
+  {
+    // lost ack file: everything still on flash is replayed, nothing is lost
+    flash.remove(PATH ".ack");
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK(drain(store) == "abcde");
+  }
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK_EQ(store.available(), 0);
+  }
+}
+
+static void testCrc()
+{
+  MockFlash flash;
+  uint8_t au8frame[ TELEMETRY_BINARY_SIZE ];
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    for (uint8_t i = 0; i < 4; i++)
+    {
+      frame('a' + i, au8frame);
+      store.append(au8frame);
+    }
+  }
+  // sequence n lives in slot n % CAPACITY, the first record is sequence 1
+  CHECK(flash.corrupt(PATH, 2 * STORE_RECORD_SIZE + STORE_FRAME_OFFSET + 7, 0x01));        // 'b', payload
+  CHECK(flash.corrupt(PATH, 4 * STORE_RECORD_SIZE + 0, 0x80));                              // 'd', sequence
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK(drain(store) == "ac");              // 'd' was the newest: its slot is reused
+    frame('e', au8frame);
+    store.append(au8frame);
+  }
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK(drain(store) == "e");
+  }
+}
+
+static void testPowerLoss()
+{
+  MockFlash flash;
+  uint8_t au8frame[ TELEMETRY_BINARY_SIZE ];
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    for (uint8_t i = 0; i < 5; i++)
+    {
+      frame('a' + i, au8frame);
+      store.append(au8frame);
+    }
+    flash.setWriteBudget(STORE_RECORD_SIZE / 2);
+    frame('f', au8frame);
+    CHECK(!store.append(au8frame));           // torn record
+    CHECK(!flash.isPowered());
+  }
+  flash.powerCycle();
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK_EQ(store.available(), 5);
+    frame('g', au8frame);
+    CHECK(store.append(au8frame));            // takes the torn slot
+    CHECK(drain(store) == "abcdeg");
+  }
+
+  // supply fails while the ack file is rewritten: frames come back, none are lost
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    frame('h', au8frame);
+    store.append(au8frame);
+    frame('i', au8frame);
+    store.append(au8frame);
+    flash.setWriteBudget(2);
+    CHECK(drain(store) == "hi");
+  }
+  flash.powerCycle();
+  {
+    TelemetryStore store(flash, PATH, CAPACITY);
+    CHECK(store.begin());
+    CHECK(drain(store) == "abcdeghi");
+  }
+
+  // torn overwrite of the oldest record of a full ring: only that one is lost
+  {
+    MockFlash full;
+    {
+      TelemetryStore store(full, PATH, 4);
+      CHECK(store.begin());
+      for (uint8_t i = 0; i < 4; i++)
+      {
+        frame('a' + i, au8frame);
+        store.append(au8frame);
+      }
+      full.setWriteBudget(10);
+      frame('e', au8frame);
+      CHECK(!store.append(au8frame));
+    }
+    full.powerCycle();
+    TelemetryStore store(full, PATH, 4);
+    CHECK(store.begin());
+    CHECK(drain(store) == "bcd");
+  }
+}
+
+int main()
+{
+  testWrap();
+  testAck();
+  testCrc();
+  testPowerLoss();
+  return checkResult("test_store");
+}
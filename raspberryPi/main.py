@@ -1,5 +1,6 @@
 import os
 import json
+import struct
 import asyncio
 import sounddevice as sd
 from vosk import Model, KaldiRecognizer
@@ -11,6 +12,10 @@ import paho.mqtt.client as mqtt
 # MQTT
 BROKER = "test.mosquitto.org"  # Broker MQTT
 PORT = 1883  # Port MQTT
+TELEMETRY_TOPIC = "esp32/telemetry"  # ข้อความรวมค่าเซ็นเซอร์จาก ESP32 (smart_fram/Telemetry.h)
+BACKLOG_TOPIC = "esp32/telemetry/backlog"  # ข้อมูลย้อนหลังที่ ESP32 เก็บไว้ขณะ offline
+TELEMETRY_FORMAT = struct.Struct("<BBHIhfHHH")  # version, flags, seq, time, moisture, lux, n, p, k
+TELEMETRY_VERSION = 1
 
 # Speech Recognition and Audio Settings
 MODEL_PATH_THAI = "/home/admin123/Documents/project/vosk-model-th"  # Path ของโมเดลภาษาไทย
@@ -36,6 +41,8 @@ def on_connect(client, userdata, flags, rc):
     print(f"Connected to MQTT Broker with result code {rc}")
     # Subscribe หัวข้อสำหรับเซ็นเซอร์
     topics = [
+        TELEMETRY_TOPIC,
+        BACKLOG_TOPIC,
         "esp32/lux_sensor",
         "esp32/moisture",
         "esp32/n",
@@ -45,11 +52,42 @@ def on_connect(client, userdata, flags, rc):
     for topic in topics:
         client.subscribe(topic)
 
+def decode_telemetry(payload):
+    """แปลงข้อความ Telemetry (binary หรือ JSON) เป็น dict, คืน None ถ้ารูปแบบไม่ถูกต้อง"""
+    if payload[:1] == b"{":
+        try:
+            frame = json.loads(payload)
+        except ValueError:
+            return None
+    else:
+        if len(payload) != TELEMETRY_FORMAT.size:
+            return None
+        v, f, seq, t, m, lux, n_, p_, k_ = TELEMETRY_FORMAT.unpack(payload)
+        frame = {"v": v, "f": f, "seq": seq, "t": t, "m": m, "lux": lux, "n": n_, "p": p_, "k": k_}
+    if frame.get("v") != TELEMETRY_VERSION:
+        return None
+    return frame
+
 def on_message(client, userdata, msg):
     """Callback เมื่อได้รับข้อความจาก MQTT"""
     global moisture, light_intensity, n, p, k
     # เก็บค่าเซ็นเซอร์ลงตัวแปร
-    if msg.topic == "esp32/lux_sensor":
+    if msg.topic == BACKLOG_TOPIC:
+        # ข้อมูลเก่า: บันทึกไว้ ไม่แทนค่าปัจจุบัน
+        frame = decode_telemetry(msg.payload)
+        if frame is not None:
+            print(f"Backlog seq={frame['seq']} t={frame['t']}: {frame}")
+    elif msg.topic == TELEMETRY_TOPIC:
+        frame = decode_telemetry(msg.payload)
+        if frame is None:
+            print("Invalid telemetry frame")
+            return
+        moisture = str(frame["m"])
+        light_intensity = f"{frame['lux']:.2f}"
+        n = str(frame["n"])
+        p = str(frame["p"])
+        k = str(frame["k"])
+    elif msg.topic == "esp32/lux_sensor":
         light_intensity = msg.payload.decode()
     elif msg.topic == "esp32/moisture":
         moisture = msg.payload.decode()
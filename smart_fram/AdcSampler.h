@@ -0,0 +1,326 @@
+/**
+ * @file AdcSampler.h
+ * @brief
+ * Continuous (DMA) ADC1 sampling with median + boxcar decimation and
+ * fixed-point calibration, for the ESP32 on ESP-IDF 5 (Arduino-ESP32 3.x).
+ *
+ * The ADC digital controller converts the configured channels round-robin
+ * at a fixed rate and DMA stores the results in the driver's ring buffer;
+ * no CPU is involved until poll() drains it. Each channel is decimated in
+ * two stages:
+ *   1. median of u8median consecutive samples, which drops single spikes,
+ *   2. mean (boxcar) of u16boxcar medians, which averages the noise down.
+ * One decimated value per channel comes out every
+ * u8median * u16boxcar * channels / sample rate seconds.
+ *
+ * Calibration: at begin() the IDF line-fitting scheme (eFuse two-point
+ * values if burned, eFuse Vref otherwise) is sampled into a 17-point
+ * raw-to-mV table. Conversions then interpolate in integer arithmetic.
+ * Without calibration data a nominal linear curve is used.
+ *
+ * poll() must be called often enough that the driver's store buffer
+ * (ADC_STORE_BYTES) does not overflow: 50 ms at 20 kHz uses 2000 bytes.
+ *
+ * @defgroup adc Continuous ADC
+ */
+
+#ifndef ADC_SAMPLER_H
+#define ADC_SAMPLER_H
+
+#include <Arduino.h>
+#include <esp_adc/adc_continuous.h>
+#include <esp_adc/adc_cali.h>
+#include <esp_adc/adc_cali_scheme.h>
+
+#define ADC_MAX_CHANNELS        4
+#define ADC_MEDIAN_MAX          15            //!< longest median window
+#define ADC_STORE_BYTES         4096          //!< driver ring buffer
+#define ADC_FRAME_BYTES         256           //!< bytes moved per DMA interrupt and per read
+#define ADC_CAL_POINTS          17            //!< calibration table: raw 0, 256, ... 4096
+#define ADC_NOMINAL_FULL_MV     3100          //!< 12 dB attenuation, used without calibration
+
+/**
+ * @struct adc_channel_state_t
+ * @brief
+ * Decimation state and latest output of one channel.
+ */
+typedef struct
+{
+  adc_channel_t channel;
+  uint16_t au16window[ ADC_MEDIAN_MAX ];      /*!< samples of the current median window */
+  uint8_t u8fill;                             /*!< samples in au16window */
+  uint32_t u32sum;                            /*!< sum of the medians of the current boxcar */
+  uint16_t u16medians;                        /*!< medians in u32sum */
+  uint16_t u16raw;                            /*!< latest decimated value, raw counts */
+  uint32_t u32count;                          /*!< decimated values produced so far */
+}
+adc_channel_state_t;
+
+/**
+ * @class AdcSampler
+ * @brief
+ * ADC1 continuous sampler for up to ADC_MAX_CHANNELS channels.
+ */
+class AdcSampler
+{
+private:
+  adc_continuous_handle_t handle;
+  adc_channel_state_t aChannels[ ADC_MAX_CHANNELS ];
+  uint8_t u8channels;
+  uint8_t u8median;
+  uint16_t u16boxcar;
+  uint16_t au16calMv[ ADC_CAL_POINTS ];
+  boolean bCalibrated;
+  boolean bRunning;
+  uint8_t au8frame[ ADC_FRAME_BYTES ];
+
+  void calibrate();
+  void push(adc_channel_state_t *state, uint16_t u16sample);
+  static uint16_t median(uint16_t *au16values, uint8_t u8n);
+
+public:
+  AdcSampler();
+
+  int8_t addChannel(adc_channel_t channel);   //!<before begin(), returns the channel index or -1
+  boolean begin(uint32_t u32sampleRate, uint8_t u8median, uint16_t u16boxcar);
+  void poll();                                //!<drain DMA results, cheap when nothing is waiting
+  boolean isRunning();
+  boolean isCalibrated();                     //!<eFuse calibration in use
+  uint32_t getCount(uint8_t u8index);         //!<decimated values produced, to detect new data
+  uint16_t getRaw(uint8_t u8index);           //!<latest decimated value, 0..4095
+  uint16_t getMilliVolts(uint8_t u8index);    //!<latest decimated value, calibrated
+  uint16_t toMilliVolts(uint16_t u16raw);
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+AdcSampler::AdcSampler()
+{
+  handle = NULL;
+  u8channels = 0;
+  u8median = 1;
+  u16boxcar = 1;
+  bCalibrated = false;
+  bRunning = false;
+  memset(aChannels, 0, sizeof(aChannels));
+}
+
+/**
+ * @brief
+ * Adds an ADC1 channel to the scan pattern, e.g. ADC_CHANNEL_5 for GPIO33.
+ *
+ * @return index to pass to getRaw()/getMilliVolts(), -1 if the table is full
+ * @ingroup adc
+ */
+int8_t AdcSampler::addChannel(adc_channel_t channel)
+{
+  if (bRunning || (u8channels >= ADC_MAX_CHANNELS)) return -1;
+  aChannels[ u8channels ].channel = channel;
+  return u8channels++;
+}
+
+/**
+ * @brief
+ * Configures the DMA driver and starts sampling.
+ *
+ * @param u32sampleRate  conversions per second, all channels together
+ *                       (the ESP32 needs at least 20000)
+ * @param u8median       median window, 1 (off) .. ADC_MEDIAN_MAX
+ * @param u16boxcar      medians averaged per output, >= 1
+ * @return false if the driver could not be started
+ * @ingroup adc
+ */
+boolean AdcSampler::begin(uint32_t u32sampleRate, uint8_t u8median, uint16_t u16boxcar)
+{
+  if (bRunning || (u8channels == 0)) return false;
+  calibrate();                                // also used by toMilliVolts() if the driver fails
+  this->u8median = constrain(u8median, 1, ADC_MEDIAN_MAX);
+  this->u16boxcar = max(u16boxcar, (uint16_t)1);
+
+  adc_continuous_handle_cfg_t handleConfig = {};
+  handleConfig.max_store_buf_size = ADC_STORE_BYTES;
+  handleConfig.conv_frame_size = ADC_FRAME_BYTES;
+  if (adc_continuous_new_handle(&handleConfig, &handle) != ESP_OK) return false;
+
+  adc_digi_pattern_config_t aPattern[ ADC_MAX_CHANNELS ] = {};
+  for (uint8_t i = 0; i < u8channels; i++)
+  {
+    aPattern[ i ].atten = ADC_ATTEN_DB_12;
+    aPattern[ i ].channel = aChannels[ i ].channel;
+    aPattern[ i ].unit = ADC_UNIT_1;
+    aPattern[ i ].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+
+  adc_continuous_config_t config = {};
+  config.pattern_num = u8channels;
+  config.adc_pattern = aPattern;
+  config.sample_freq_hz = u32sampleRate;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if ((adc_continuous_config(handle, &config) != ESP_OK) || (adc_continuous_start(handle) != ESP_OK))
+  {
+    adc_continuous_deinit(handle);
+    handle = NULL;
+    return false;
+  }
+
+  bRunning = true;
+  return true;
+}
+
+/**
+ * @brief
+ * Moves the conversions stored by DMA through the decimators.
+ * Non-blocking: returns as soon as the driver buffer is empty.
+ *
+ * @ingroup adc
+ */
+void AdcSampler::poll()
+{
+  if (!bRunning) return;
+
+  uint32_t u32bytes = 0;
+  while (adc_continuous_read(handle, au8frame, sizeof(au8frame), &u32bytes, 0) == ESP_OK)
+  {
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= u32bytes; i += SOC_ADC_DIGI_RESULT_BYTES)
+    {
+      adc_digi_output_data_t *result = (adc_digi_output_data_t *)&au8frame[ i ];
+      for (uint8_t c = 0; c < u8channels; c++)
+      {
+        if (aChannels[ c ].channel != result->type1.channel) continue;
+        push(&aChannels[ c ], result->type1.data);
+        break;
+      }
+    }
+  }
+}
+
+/**
+ * @brief
+ * @return true once begin() has started the driver
+ * @ingroup adc
+ */
+boolean AdcSampler::isRunning()
+{
+  return bRunning;
+}
+
+/**
+ * @brief
+ * @return true if the eFuse calibration is in use, false for the nominal curve
+ * @ingroup adc
+ */
+boolean AdcSampler::isCalibrated()
+{
+  return bCalibrated;
+}
+
+/**
+ * @brief
+ * @return number of decimated values produced for a channel so far
+ * @ingroup adc
+ */
+uint32_t AdcSampler::getCount(uint8_t u8index)
+{
+  return (u8index < u8channels) ? aChannels[ u8index ].u32count : 0;
+}
+
+/**
+ * @brief
+ * @return latest decimated value of a channel, raw counts 0..4095
+ * @ingroup adc
+ */
+uint16_t AdcSampler::getRaw(uint8_t u8index)
+{
+  return (u8index < u8channels) ? aChannels[ u8index ].u16raw : 0;
+}
+
+/**
+ * @brief
+ * @return latest decimated value of a channel, mV at the pin
+ * @ingroup adc
+ */
+uint16_t AdcSampler::getMilliVolts(uint8_t u8index)
+{
+  return toMilliVolts(getRaw(u8index));
+}
+
+/**
+ * @brief
+ * Converts raw counts to mV by linear interpolation in the calibration table.
+ *
+ * @ingroup adc
+ */
+uint16_t AdcSampler::toMilliVolts(uint16_t u16raw)
+{
+  uint8_t u8i = u16raw >> 8;
+  uint16_t u16frac = u16raw & 0xFF;
+  return au16calMv[ u8i ] + (((uint32_t)(au16calMv[ u8i + 1 ] - au16calMv[ u8i ]) * u16frac) >> 8);
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Samples the IDF calibration curve into au16calMv, or fills it with the
+ * nominal line if the chip has no calibration eFuses.
+ */
+void AdcSampler::calibrate()
+{
+  adc_cali_handle_t cali = NULL;
+  adc_cali_line_fitting_config_t caliConfig = {};
+  caliConfig.unit_id = ADC_UNIT_1;
+  caliConfig.atten = ADC_ATTEN_DB_12;
+  caliConfig.bitwidth = ADC_BITWIDTH_12;
+  bCalibrated = (adc_cali_create_scheme_line_fitting(&caliConfig, &cali) == ESP_OK);
+
+  for (uint8_t i = 0; i < ADC_CAL_POINTS; i++)
+  {
+    uint16_t u16raw = min(i * 256, 4095);
+    int iMv = (uint32_t)u16raw * ADC_NOMINAL_FULL_MV / 4095;
+    if (bCalibrated) adc_cali_raw_to_voltage(cali, u16raw, &iMv);
+    au16calMv[ i ] = iMv;
+  }
+  if (bCalibrated) adc_cali_delete_scheme_line_fitting(cali);
+}
+
+/**
+ * @brief
+ * Feeds one sample through the median and boxcar stages of a channel.
+ */
+void AdcSampler::push(adc_channel_state_t *state, uint16_t u16sample)
+{
+  state->au16window[ state->u8fill++ ] = u16sample;
+  if (state->u8fill < u8median) return;
+
+  state->u32sum += median(state->au16window, u8median);
+  state->u8fill = 0;
+  if (++state->u16medians < u16boxcar) return;
+
+  state->u16raw = state->u32sum / u16boxcar;
+  state->u32sum = 0;
+  state->u16medians = 0;
+  state->u32count++;
+}
+
+/**
+ * @brief
+ * Median of a small window by insertion sort (sorts the window in place).
+ */
+uint16_t AdcSampler::median(uint16_t *au16values, uint8_t u8n)
+{
+  for (uint8_t i = 1; i < u8n; i++)
+  {
+    uint16_t u16v = au16values[ i ];
+    int8_t j = i - 1;
+    while ((j >= 0) && (au16values[ j ] > u16v))
+    {
+      au16values[ j + 1 ] = au16values[ j ];
+      j--;
+    }
+    au16values[ j + 1 ] = u16v;
+  }
+  return au16values[ u8n / 2 ];
+}
+
+#endif // ADC_SAMPLER_H
@@ -0,0 +1,253 @@
+/**
+ * @file Connectivity.h
+ * @brief
+ * Non-blocking WiFi + MQTT connection manager.
+ *
+ * poll() advances a small state machine and returns at once:
+ * it never waits for WiFi to associate and never sleeps between retries.
+ * Failed attempts are retried with exponential backoff plus random jitter,
+ * so a fleet that loses its broker does not reconnect in lockstep.
+ *
+ * The only blocking call left is PubSubClient::connect() itself, made at
+ * most once per backoff period. setSocketTimeout() only bounds its MQTT
+ * reads, i.e. the wait for CONNACK. The DNS lookup and the TCP connect
+ * before that run on the WiFi stack's own timeouts (lwIP DNS retries,
+ * WiFiClient's connect timeout); a broker given by IP address skips DNS.
+ *
+ * @defgroup link Connectivity
+ */
+
+#ifndef CONNECTIVITY_H
+#define CONNECTIVITY_H
+
+#include <WiFi.h>
+#include <PubSubClient.h>
+
+#define LINK_BACKOFF_MIN        1000          //!< ms before the first retry
+#define LINK_BACKOFF_MAX        60000         //!< ms, backoff ceiling
+#define LINK_WIFI_TIMEOUT       15000         //!< ms to wait for association before restarting it
+#define LINK_SOCKET_TIMEOUT     3             //!< s, bound on each MQTT read, CONNACK included (not DNS or TCP connect)
+
+enum LINK_STATES
+{
+  LINK_WIFI_DOWN               = 0,           //!< waiting to (re)start WiFi association
+  LINK_WIFI_JOINING            = 1,           //!< WiFi.begin() issued, not associated yet
+  LINK_MQTT_DOWN               = 2,           //!< WiFi up, broker not connected
+  LINK_ONLINE                  = 3            //!< WiFi and broker connected
+};
+
+/**
+ * @class Connectivity
+ * @brief
+ * Keeps WiFi and the MQTT session up without blocking its caller.
+ */
+class Connectivity
+{
+private:
+  PubSubClient *mqtt;
+  const char *ssid;
+  const char *pass;
+  const char *clientId;
+  void (*onConnect)(void);
+  uint8_t u8state;
+  uint32_t u32since;                          //!< millis() of the last state change or attempt
+  uint32_t u32retryIn;                        //!< ms from u32since to the next attempt
+  uint32_t u32backoff;                        //!< current backoff, doubles on each failure
+  uint16_t u16reconnects;
+
+  void setState(uint8_t u8state);
+  void retryLater();
+  void resetBackoff();
+
+public:
+  Connectivity(PubSubClient &mqtt, const char *ssid, const char *pass, const char *clientId);
+
+  void begin();                               //!<start WiFi association, non-blocking
+  void setOnConnect(void (*onConnect)(void)); //!<called after every MQTT (re)connect, e.g. to subscribe
+  uint8_t poll();                             //!<cyclic call, returns LINK_STATES
+  boolean isWifiUp();
+  boolean isOnline();
+  uint16_t getReconnects();                   //!<number of successful MQTT (re)connects
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param mqtt      MQTT client, server and callback already set
+ * @param ssid      WiFi network
+ * @param pass      WiFi password
+ * @param clientId  MQTT client id
+ * @ingroup link
+ */
+Connectivity::Connectivity(PubSubClient &mqtt, const char *ssid, const char *pass, const char *clientId)
+{
+  this->mqtt = &mqtt;
+  this->ssid = ssid;
+  this->pass = pass;
+  this->clientId = clientId;
+  this->onConnect = NULL;
+  this->u8state = LINK_WIFI_DOWN;
+  this->u32since = 0;
+  this->u32retryIn = 0;
+  this->u16reconnects = 0;
+  resetBackoff();
+}
+
+/**
+ * @brief
+ * Starts WiFi association and returns immediately.
+ *
+ * @ingroup link
+ */
+void Connectivity::begin()
+{
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  mqtt->setSocketTimeout(LINK_SOCKET_TIMEOUT);
+  WiFi.begin(ssid, pass);
+  setState(LINK_WIFI_JOINING);
+}
+
+/**
+ * @brief
+ * Registers the function called after each successful MQTT connect.
+ *
+ * @ingroup link
+ */
+void Connectivity::setOnConnect(void (*onConnect)(void))
+{
+  this->onConnect = onConnect;
+}
+
+/**
+ * @brief
+ * Advances the connection state machine by at most one step.
+ * While online it also services the MQTT session (PubSubClient::loop()).
+ *
+ * @return current LINK_STATES value
+ * @ingroup link
+ */
+uint8_t Connectivity::poll()
+{
+  uint32_t u32elapsed = millis() - u32since;
+
+  if ((WiFi.status() != WL_CONNECTED) && (u8state >= LINK_MQTT_DOWN))
+  {
+    Serial.println("WiFi lost");
+    setState(LINK_WIFI_JOINING);              // auto-reconnect is already running
+    return u8state;
+  }
+
+  switch (u8state)
+  {
+    case LINK_WIFI_DOWN:
+      if (u32elapsed < u32retryIn) break;
+      WiFi.disconnect();
+      WiFi.begin(ssid, pass);
+      setState(LINK_WIFI_JOINING);
+    break;
+
+    case LINK_WIFI_JOINING:
+      if (WiFi.status() == WL_CONNECTED)
+      {
+        Serial.print("WiFi connected, IP address: ");
+        Serial.println(WiFi.localIP());
+        resetBackoff();
+        setState(LINK_MQTT_DOWN);
+      }
+      else if (u32elapsed > LINK_WIFI_TIMEOUT)
+      {
+        setState(LINK_WIFI_DOWN);
+        retryLater();
+      }
+    break;
+
+    case LINK_MQTT_DOWN:
+      if (u32elapsed < u32retryIn) break;
+      Serial.print("MQTT connection... ");
+      if (mqtt->connect(clientId))
+      {
+        Serial.println("connected");
+        u16reconnects++;
+        resetBackoff();
+        setState(LINK_ONLINE);
+        if (onConnect != NULL) onConnect();
+      }
+      else
+      {
+        Serial.println("failed");
+        setState(LINK_MQTT_DOWN);
+        retryLater();
+      }
+    break;
+
+    case LINK_ONLINE:
+      if (mqtt->loop()) break;
+      Serial.println("MQTT lost");
+      setState(LINK_MQTT_DOWN);               // first retry right away
+    break;
+  }
+  return u8state;
+}
+
+/**
+ * @brief
+ * @return true once WiFi is associated
+ * @ingroup link
+ */
+boolean Connectivity::isWifiUp()
+{
+  return u8state >= LINK_MQTT_DOWN;
+}
+
+/**
+ * @brief
+ * @return true while the MQTT session is up
+ * @ingroup link
+ */
+boolean Connectivity::isOnline()
+{
+  return u8state == LINK_ONLINE;
+}
+
+/**
+ * @brief
+ * @return number of successful MQTT connects since boot
+ * @ingroup link
+ */
+uint16_t Connectivity::getReconnects()
+{
+  return u16reconnects;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+void Connectivity::setState(uint8_t u8state)
+{
+  this->u8state = u8state;
+  u32since = millis();
+  u32retryIn = 0;
+}
+
+/**
+ * @brief
+ * Schedules the next attempt after backoff/2 + random(backoff/2) ms
+ * and doubles the backoff up to LINK_BACKOFF_MAX.
+ *
+ * @ingroup link
+ */
+void Connectivity::retryLater()
+{
+  u32retryIn = u32backoff / 2 + random(u32backoff / 2 + 1);
+  u32backoff = (u32backoff >= LINK_BACKOFF_MAX / 2) ? LINK_BACKOFF_MAX : u32backoff * 2;
+}
+
+void Connectivity::resetBackoff()
+{
+  u32backoff = LINK_BACKOFF_MIN;
+}
+
+#endif // CONNECTIVITY_H
@@ -0,0 +1,255 @@
+/**
+ * @file Diagnostics.h
+ * @brief
+ * Stage latency histograms timed with the CPU cycle counter.
+ *
+ * Each LatencyHistogram keeps log2 buckets of microseconds:
+ * bucket 0 holds 0 us, bucket b holds [2^(b-1), 2^b) us, so 33 buckets
+ * cover everything a 32-bit value can hold. Recording is a count-leading-zeros
+ * and an increment; nothing is allocated and no lock is taken.
+ *
+ * Samples go into one of two banks. The reporter calls swap() to close the
+ * current window, reads the closed bank and clears it, so the writing task
+ * never waits for the reporter. A sample recorded across the swap may land
+ * in either window.
+ *
+ * Each histogram must be written by one task only. Percentiles are
+ * interpolated inside the bucket, so they are accurate to within a factor
+ * of two; max and min are exact.
+ *
+ * With DIAG_ENABLED 0 the DIAG_* macros expand to nothing and the timing
+ * costs neither code nor cycles.
+ *
+ * @defgroup diag Diagnostics
+ */
+
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <Arduino.h>
+
+#ifndef DIAG_ENABLED
+#define DIAG_ENABLED            0
+#endif
+
+#define DIAG_BUCKETS            33
+#define DIAG_JSON_MAX           96            //!< worst-case length of diagFormat() output incl. '\0'
+
+/**
+ * @class LatencyHistogram
+ * @brief
+ * Fixed-bucket log-scale latency histogram, single writer.
+ */
+class LatencyHistogram
+{
+private:
+  uint32_t au32count[ 2 ][ DIAG_BUCKETS ];
+  uint32_t au32min[ 2 ];
+  uint32_t au32max[ 2 ];
+  volatile uint8_t u8bank;                    //!< bank record() writes to
+
+  static uint8_t bucket(uint32_t u32us);
+
+public:
+  LatencyHistogram();
+
+  void record(uint32_t u32us);                //!<writer: add one sample
+  void swap();                                //!<reporter: close the current window
+  void clear();                               //!<reporter: empty the closed window
+  uint32_t getCount();                        //!<samples in the closed window
+  uint32_t getMin();
+  uint32_t getMax();
+  uint32_t getPercentile(uint8_t u8pct);
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+LatencyHistogram::LatencyHistogram()
+{
+  u8bank = 0;
+  clear();
+  swap();
+  clear();
+}
+
+/**
+ * @brief
+ * Adds one sample to the open window.
+ *
+ * @param u32us  latency in microseconds
+ * @ingroup diag
+ */
+void LatencyHistogram::record(uint32_t u32us)
+{
+  uint8_t u8b = u8bank;
+  au32count[ u8b ][ bucket(u32us) ]++;
+  if (u32us < au32min[ u8b ]) au32min[ u8b ] = u32us;
+  if (u32us > au32max[ u8b ]) au32max[ u8b ] = u32us;
+}
+
+/**
+ * @brief
+ * Closes the open window; record() continues in the other bank,
+ * which must have been cleared since it was last closed.
+ *
+ * @ingroup diag
+ */
+void LatencyHistogram::swap()
+{
+  u8bank ^= 1;
+}
+
+/**
+ * @brief
+ * Empties the closed window once it has been reported.
+ *
+ * @ingroup diag
+ */
+void LatencyHistogram::clear()
+{
+  uint8_t u8b = u8bank ^ 1;
+  memset(au32count[ u8b ], 0, sizeof(au32count[ u8b ]));
+  au32min[ u8b ] = 0xFFFFFFFF;
+  au32max[ u8b ] = 0;
+}
+
+/**
+ * @brief
+ * @return number of samples in the closed window
+ * @ingroup diag
+ */
+uint32_t LatencyHistogram::getCount()
+{
+  uint8_t u8b = u8bank ^ 1;
+  uint32_t u32n = 0;
+  for (uint8_t i = 0; i < DIAG_BUCKETS; i++) u32n += au32count[ u8b ][ i ];
+  return u32n;
+}
+
+/**
+ * @brief
+ * @return smallest sample of the closed window, 0 if it is empty
+ * @ingroup diag
+ */
+uint32_t LatencyHistogram::getMin()
+{
+  uint8_t u8b = u8bank ^ 1;
+  return (au32max[ u8b ] < au32min[ u8b ]) ? 0 : au32min[ u8b ];
+}
+
+/**
+ * @brief
+ * @return largest sample of the closed window
+ * @ingroup diag
+ */
+uint32_t LatencyHistogram::getMax()
+{
+  return au32max[ u8bank ^ 1 ];
+}
+
+/**
+ * @brief
+ * Estimates a percentile of the closed window by linear interpolation
+ * inside the bucket that holds it.
+ *
+ * @param u8pct  1..100
+ * @return latency in microseconds, 0 if the window is empty
+ * @ingroup diag
+ */
+uint32_t LatencyHistogram::getPercentile(uint8_t u8pct)
+{
+  uint8_t u8b = u8bank ^ 1;
+  uint32_t u32n = getCount();
+  if (u32n == 0) return 0;
+
+  uint32_t u32rank = ((uint64_t)u32n * u8pct + 99) / 100;   // 1-based, nearest rank
+  uint32_t u32seen = 0;
+  for (uint8_t i = 0; i < DIAG_BUCKETS; i++)
+  {
+    uint32_t u32c = au32count[ u8b ][ i ];
+    if (u32seen + u32c < u32rank)
+    {
+      u32seen += u32c;
+      continue;
+    }
+    if (i == 0) return 0;
+    uint32_t u32lo = 1UL << (i - 1);
+    uint32_t u32est = u32lo + (uint64_t)u32lo * (u32rank - u32seen) / u32c;
+    if (u32est > au32max[ u8b ]) u32est = au32max[ u8b ];
+    if (u32est < au32min[ u8b ]) u32est = au32min[ u8b ];
+    return u32est;
+  }
+  return au32max[ u8b ];
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+uint8_t LatencyHistogram::bucket(uint32_t u32us)
+{
+  return (u32us == 0) ? 0 : 32 - __builtin_clz(u32us);
+}
+
+/* _____HELPERS_______________________________________________________________ */
+
+/**
+ * @brief
+ * Formats the closed window of a histogram as
+ *   {"n":1200,"p50":180,"p99":950,"max":1410}
+ *
+ * @return length written, 0 if acBuf is too small
+ * @ingroup diag
+ */
+uint16_t diagFormat(LatencyHistogram &hist, char *acBuf, uint16_t u16size)
+{
+  int iLen = snprintf(acBuf, u16size, "{\"n\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}",
+                      (unsigned long)hist.getCount(), (unsigned long)hist.getPercentile(50),
+                      (unsigned long)hist.getPercentile(99), (unsigned long)hist.getMax());
+  if ((iLen < 0) || (iLen >= u16size)) return 0;
+  return iLen;
+}
+
+#if DIAG_ENABLED
+
+uint32_t u32diagMHz = 240;                   //!< CPU clock, set by diagBegin()
+
+/**
+ * @brief
+ * Reads the CPU clock once for diagCyclesToUs().
+ * Call from setup() before any task starts timing.
+ *
+ * @ingroup diag
+ */
+void diagBegin()
+{
+  u32diagMHz = ESP.getCpuFreqMHz();
+}
+
+/**
+ * @brief
+ * Converts a cycle count delta into microseconds at the CPU clock
+ * read by diagBegin().
+ *
+ * @ingroup diag
+ */
+inline uint32_t diagCyclesToUs(uint32_t u32cycles)
+{
+  return u32cycles / u32diagMHz;
+}
+
+// Stage timing. The cycle counter is per core and wraps after ~17 s at
+// 240 MHz, so only time what runs on one core (pinned tasks) and is shorter.
+#define DIAG_BEGIN(t)             uint32_t t = ESP.getCycleCount()
+#define DIAG_END(hist, t)         (hist).record(diagCyclesToUs(ESP.getCycleCount() - (t)))
+// Period of a cyclic loop: records the time since the last lap and restarts t.
+#define DIAG_LAP(hist, t)         do { uint32_t _now = ESP.getCycleCount(); \
+                                       (hist).record(diagCyclesToUs(_now - (t))); (t) = _now; } while (0)
+
+#else
+
+#define DIAG_BEGIN(t)
+#define DIAG_END(hist, t)
+#define DIAG_LAP(hist, t)
+
+#endif // DIAG_ENABLED
+
+#endif // DIAGNOSTICS_H
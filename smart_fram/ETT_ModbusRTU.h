@@ -16,6 +16,10 @@
  *  http://modbus.org/
  *  http://modbus.org/docs/Modbus_over_serial_line_V1_02.pdf
  *
+ *  Platform dependencies are limited to Stream, millis(), pinMode(),
+ *  digitalWrite() and delayMicroseconds(), so the class also builds
+ *  against a host-side Arduino shim with an in-memory Stream.
+ *
  * @license
  *  This library is free software; you can redistribute it and/or
  *  modify it under the terms of the GNU Lesser General Public
@@ -39,6 +43,9 @@
  *
  */
 
+#ifndef ETT_MODBUSRTU_H
+#define ETT_MODBUSRTU_H
+
 #include <inttypes.h>
 #include <Arduino.h>
 #include <Print.h>
@@ -55,13 +62,34 @@
 typedef struct
 {
   uint8_t u8id;                               /*!< Slave address between 1 and 247. 0 means broadcast */
-  uint8_t u8fct;                              /*!< Function code: 1, 2, 3, 4, 5, 6, 15 or 16 */
+  uint8_t u8fct;                              /*!< Function code: 1, 2, 3, 4, 5, 6, 15, 16 or 23 */
   uint16_t u16RegAdd;                         /*!< Address of the first register to access at slave/s */
   uint16_t u16CoilsNo;                        /*!< Number of coils or registers to access */
   uint16_t *au16reg;                          /*!< Pointer to memory image in master */
+  uint16_t u16WriteAdd;                       /*!< FC23 only: first register to write, u16RegAdd is read */
+  uint16_t u16WriteNo;                        /*!< FC23 only: number of registers to write */
+  uint16_t *au16write;                        /*!< FC23 only: values to write, the answer goes to au16reg */
 }
 modbus_t;
 
+/**
+ * @struct modbus_register_t
+ * @brief
+ * Slave register map entry: a block of consecutive registers served by
+ * callbacks instead of a plain array.
+ * A map is an array of these sorted by u16address, without overlaps.
+ * Addresses between blocks do not exist and answer EXC_ADDR_RANGE, so a
+ * map can be sparse anywhere in the 16-bit address space.
+ */
+typedef struct
+{
+  uint16_t u16address;                        /*!< first register of the block */
+  uint16_t u16count;                          /*!< number of registers */
+  uint16_t (*read)(uint16_t u16offset);       /*!< value of register u16address + u16offset */
+  boolean (*write)(uint16_t u16offset, uint16_t u16value); /*!< NULL = read only, false = EXC_EXECUTE */
+}
+modbus_register_t;
+
 enum
 {
   RESPONSE_SIZE = 6,
@@ -104,13 +132,54 @@ enum MB_FC
   MB_FC_WRITE_COIL               = 5,	        /*!< FCT=5 -> write single coil or output */
   MB_FC_WRITE_REGISTER           = 6,	        /*!< FCT=6 -> write single register */
   MB_FC_WRITE_MULTIPLE_COILS     = 15,	      /*!< FCT=15 -> write multiple coils or outputs */
-  MB_FC_WRITE_MULTIPLE_REGISTERS = 16	        /*!< FCT=16 -> write multiple registers */
+  MB_FC_WRITE_MULTIPLE_REGISTERS = 16,	      /*!< FCT=16 -> write multiple registers */
+  MB_FC_READ_WRITE_REGISTERS     = 23	        /*!< FCT=23 -> write then read multiple registers (master only) */
 };
 
 enum COM_STATES
 {
   COM_IDLE                     = 0,
-  COM_WAITING                  = 1
+  COM_WAITING                  = 1,
+  COM_SENDING                  = 2,           //!< TX_ASYNC only: frame still leaving the UART
+  COM_RECEIVING                = 3            //!< RX_EVENT only: rxEvent() holds the frame buffer
+};
+
+/**
+ * @enum TX_MODES
+ * @brief
+ * RS485 direction handling when u8txenpin > 1.
+ * With a UART that switches DE/RE in hardware, use u8txenpin = 0 instead:
+ * query() then returns as soon as the frame is queued and neither mode applies.
+ */
+enum TX_MODES
+{
+  TX_BLOCKING                  = 0,           //!< flush() and busy-wait the turnaround inside query()
+  TX_ASYNC                     = 1            //!< return at once, poll() releases the line when the frame is out
+};
+
+/**
+ * @enum RX_MODES
+ * @brief
+ * How the master collects its answers.
+ */
+enum RX_MODES
+{
+  RX_POLLED                    = 0,           //!< poll() reads the Serial buffer on every call
+  RX_EVENT                     = 1            //!< the port's receive callback calls rxEvent(), poll() only reports
+};
+
+/**
+ * @enum MB_EVENTS
+ * @brief
+ * Master transaction events passed to the monitor set with setMonitor().
+ */
+enum MB_EVENTS
+{
+  MB_EV_REQUEST                = 0,           //!< query sent
+  MB_EV_RESPONSE               = 1,           //!< valid answer, with its RTT
+  MB_EV_EXCEPTION              = 2,           //!< exception answer, with its RTT
+  MB_EV_BAD_FRAME              = 3,           //!< CRC error, truncated, oversized or unknown answer
+  MB_EV_TIMEOUT                = 4            //!< no answer within the time-out
 };
 
 enum ERR_LIST
@@ -140,11 +209,173 @@ const unsigned char fctsupported[] =
   MB_FC_WRITE_COIL,
   MB_FC_WRITE_REGISTER,
   MB_FC_WRITE_MULTIPLE_COILS,
-  MB_FC_WRITE_MULTIPLE_REGISTERS
+  MB_FC_WRITE_MULTIPLE_REGISTERS,
+  MB_FC_READ_WRITE_REGISTERS
+};
+
+#define T35_FAST_US  1750                     //!< fixed T3.5 in us above 19200 baud (Modbus over serial line 2.5.1.1)
+/**
+ * @brief
+ * Size of the frame buffer of every Modbus object, in bytes.
+ * Define MAX_BUFFER before including this file to shrink it. The default
+ * holds a full RTU ADU: a 125-register FC3/FC4 answer (255 bytes) or a
+ * 123-register FC16 request (255 bytes) in one transaction. With a smaller
+ * buffer, query() and the slave refuse what would not fit.
+ */
+#ifndef MAX_BUFFER
+#define  MAX_BUFFER  256
+#endif
+#if (MAX_BUFFER < 16) || (MAX_BUFFER > 256)
+#error "MAX_BUFFER must be 16..256"
+#endif
+#define  MAX_READ_REGS   125                  //!< FC3/FC4 quantity limit of the protocol
+#define  MAX_WRITE_REGS  123                  //!< FC16 quantity limit of the protocol
+#define  MAX_READ_BITS   2000                 //!< FC1/FC2 quantity limit of the protocol
+#define  MAX_WRITE_BITS  1968                 //!< FC15 quantity limit of the protocol
+#define  MAX_RW_WRITE_REGS 121                //!< FC23 write quantity limit of the protocol (read: MAX_READ_REGS)
+#define  TURNAROUND_DEFAULT  100              //!< ms of silence after a broadcast, for the slaves to act on it
+
+/**
+ * @brief
+ * CRC16 backend selection.
+ * Define MODBUS_CRC_BACKEND before including this file to override the default.
+ *
+ * MODBUS_CRC_BITWISE : 8 shift/xor steps per byte, no table (flash-starved builds)
+ * MODBUS_CRC_TABLE   : one 256-entry lookup per byte, 512 bytes of flash
+ * MODBUS_CRC_SLICE4  : 4 bytes per step, 2 KB of RAM tables built on first use
+ * MODBUS_CRC_SLICE8  : 8 bytes per step, 4 KB of RAM tables built on first use
+ *
+ * All backends return the same value.
+ */
+#define MODBUS_CRC_BITWISE  0
+#define MODBUS_CRC_TABLE    1
+#define MODBUS_CRC_SLICE4   4
+#define MODBUS_CRC_SLICE8   8
+
+#ifndef MODBUS_CRC_BACKEND
+#define MODBUS_CRC_BACKEND  MODBUS_CRC_TABLE
+#endif
+
+#define MODBUS_CRC_INIT     0xFFFF            //!< CRC16 seed value for a new frame
+
+#if MODBUS_CRC_BACKEND != MODBUS_CRC_BITWISE
+/**
+ * CRC16 (polynomial 0xA001, reflected) of a single byte.
+ * Also slice 0 of the slicing-by-N tables.
+ */
+const uint16_t au16crcTable[256] =
+{
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
 };
+#endif
+
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_SLICE4 || MODBUS_CRC_BACKEND == MODBUS_CRC_SLICE8
+static uint16_t au16crcSlice[MODBUS_CRC_BACKEND - 1][256];
+static boolean bCrcSliceReady = false;
+
+/**
+ * @brief
+ * Builds the slicing-by-N tables from au16crcTable.
+ * au16crcSlice[k][i] is the CRC contribution of byte i followed by k+1 zero bytes.
+ *
+ * @ingroup buffer
+ */
+static void modbusCRC16Init()
+{
+  for (uint16_t i = 0; i < 256; i++)
+  {
+    uint16_t u16crc = au16crcTable[i];
+    for (uint8_t k = 0; k < MODBUS_CRC_BACKEND - 1; k++)
+    {
+      u16crc = (u16crc >> 8) ^ au16crcTable[u16crc & 0xff];
+      au16crcSlice[k][i] = u16crc;
+    }
+  }
+  bCrcSliceReady = true;
+}
+#endif
+
+/**
+ * @brief
+ * Calculates the Modbus CRC16 of any buffer.
+ * The result can be fed back as u16crc to continue over a frame received in pieces.
+ *
+ * @param au8data   data to checksum
+ * @param u16length number of bytes
+ * @param u16crc    running CRC, MODBUS_CRC_INIT for a new frame
+ * @return CRC16 in native order: low byte goes first on the wire
+ * @ingroup buffer
+ */
+uint16_t modbusCRC16(const uint8_t *au8data, uint16_t u16length, uint16_t u16crc = MODBUS_CRC_INIT)
+{
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_SLICE4 || MODBUS_CRC_BACKEND == MODBUS_CRC_SLICE8
+  if (!bCrcSliceReady) modbusCRC16Init();
+
+  while (u16length >= MODBUS_CRC_BACKEND)
+  {
+    u16crc ^= au8data[0] | (au8data[1] << 8);
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_SLICE8
+    u16crc = au16crcSlice[6][u16crc & 0xff] ^ au16crcSlice[5][u16crc >> 8]
+           ^ au16crcSlice[4][au8data[2]] ^ au16crcSlice[3][au8data[3]]
+           ^ au16crcSlice[2][au8data[4]] ^ au16crcSlice[1][au8data[5]]
+           ^ au16crcSlice[0][au8data[6]] ^ au16crcTable[au8data[7]];
+#else
+    u16crc = au16crcSlice[2][u16crc & 0xff] ^ au16crcSlice[1][u16crc >> 8]
+           ^ au16crcSlice[0][au8data[2]] ^ au16crcTable[au8data[3]];
+#endif
+    au8data += MODBUS_CRC_BACKEND;
+    u16length -= MODBUS_CRC_BACKEND;
+  }
+#endif
 
-#define T35  5
-#define  MAX_BUFFER  64	                      //!< maximum size for the communication buffer in bytes
+  for (uint16_t i = 0; i < u16length; i++)
+  {
+#if MODBUS_CRC_BACKEND == MODBUS_CRC_BITWISE
+    u16crc ^= au8data[i];
+    for (uint8_t j = 0; j < 8; j++)
+    {
+      if (u16crc & 0x0001)
+        u16crc = (u16crc >> 1) ^ 0xA001;
+      else
+        u16crc >>= 1;
+    }
+#else
+    u16crc = (u16crc >> 8) ^ au16crcTable[(u16crc ^ au8data[i]) & 0xff];
+#endif
+  }
+  return u16crc;
+}
 
 /**
  * @class Modbus
@@ -158,33 +389,64 @@ private:
   Stream* MODBUS_SERIAL;
   uint8_t u8id;                               //!< 0=master, 1..247=slave number
   uint8_t u8txenpin;                          //!< flow control pin: 0=USB or RS-232 mode, >0=RS-485 mode
-  uint8_t u8state;
+  volatile uint8_t u8state;                   //!< also read and written by rxEvent() in RX_EVENT mode
   uint8_t u8lastError;
+  uint8_t u8lastException;                    //!< exception code of the last ERR_EXCEPTION answer
   uint8_t au8Buffer[MAX_BUFFER];
-  uint8_t u8BufferSize;
-  uint8_t u8lastRec;
+  uint16_t u16BufferSize;
+  uint16_t u16lastRec;
   uint16_t *au16regs;
   uint16_t u16InCnt, u16OutCnt, u16errCnt;
   uint16_t u16timeOut;
+  uint16_t u16turnaround;                     //!< ms to wait after a broadcast
+  boolean bBroadcast;                         //!< the query in flight has no answer
   uint32_t u32time, u32timeOut, u32overTime;
-  uint8_t u8regsize;
+  uint8_t u8txMode;
+  uint32_t u32baud;
+  uint16_t u16charTime;                       //!< us per character, 11 bits at u32baud
+  uint32_t u32T35;                            //!< inter-frame silence in us
+  uint32_t u32txStart, u32txTime;             //!< TX_ASYNC transmission window in us
+  uint16_t u16expected;                       //!< predicted answer length, 0 = unknown (wait for T3.5)
+  uint16_t u16rxCRC;                          //!< running CRC over the received bytes, 0 when a frame is intact
+  boolean bRxOverflow;
+  uint8_t u8rxMode;
+  volatile boolean bRxDone;                   //!< RX_EVENT: rxEvent() finished a transaction
+  volatile int16_t i16rxResult;               //!< RX_EVENT: poll() return value for that transaction
+  void (*rxNotify)(void);
+  void (*monitor)(uint8_t u8id, uint8_t u8fct, uint8_t u8event, uint32_t u32rtt);
+  uint8_t u8queryId, u8queryFct;              //!< transaction in flight, for the monitor
+  uint32_t u32rttStart;                       //!< micros() at the end of the request
+  uint8_t u8answerEvent;                      //!< MB_EVENTS of the last answer, reported by poll()
+  uint32_t u32answerTime;                     //!< micros() when that answer was complete
+  uint16_t u16regsize;                        //!< slave: size of the register array
+  const modbus_register_t *map;               //!< slave: register map instead of an array, NULL = array
+  uint8_t u8mapSize;
   uint8_t u8AnswerID;  
   
   void init(uint8_t u8id);
   void init(uint8_t u8id, Stream &serial, uint8_t u8txenpin);
   void sendTxBuffer();
-  int8_t getRxBuffer();
-  uint16_t calcCRC(uint8_t u8length);
+  boolean pollTxDone();
+  void setTimings(uint32_t u32speed);
+  int16_t getRxBuffer();
+  uint16_t getRxBytes();
+  int16_t rxDone();
+  int16_t processAnswer();
+  void report(uint8_t u8event);
+  uint16_t calcCRC(uint16_t u16length);
   uint8_t validateAnswer();
   uint8_t validateRequest();
+  int16_t processRequest();
+  const modbus_register_t *findRegister(uint16_t u16address);
+  int16_t process_map();
   void get_FC1();
   void get_FC3();
-  int8_t process_FC1( uint16_t *regs, uint8_t u8size );
-  int8_t process_FC3( uint16_t *regs, uint8_t u8size );
-  int8_t process_FC5( uint16_t *regs, uint8_t u8size );
-  int8_t process_FC6( uint16_t *regs, uint8_t u8size );
-  int8_t process_FC15( uint16_t *regs, uint8_t u8size );
-  int8_t process_FC16( uint16_t *regs, uint8_t u8size );
+  int16_t process_FC1( uint16_t *regs, uint16_t u16size );
+  int16_t process_FC3( uint16_t *regs, uint16_t u16size );
+  int16_t process_FC5( uint16_t *regs, uint16_t u16size );
+  int16_t process_FC6( uint16_t *regs, uint16_t u16size );
+  int16_t process_FC15( uint16_t *regs, uint16_t u16size );
+  int16_t process_FC16( uint16_t *regs, uint16_t u16size );
   void buildException( uint8_t u8exception ); // build exception message
 
 public:
@@ -193,12 +455,15 @@ public:
   Modbus(uint8_t u8id, Stream &serial, uint8_t u8txenpin);
   
   void begin(Stream &serial);
+  void begin(Stream &serial, uint32_t u32speed);
   void setTimeOut( uint16_t u16timeOut);                //!<write communication watch-dog timer
+  void setTurnaround( uint16_t u16turnaround );         //!<delay after a broadcast
   uint16_t getTimeOut();                                //!<get communication watch-dog timer value
   boolean getTimeOutState();                            //!<get communication watch-dog timer state
   int8_t query( modbus_t telegram );                    //!<only for master
-  int8_t poll();                                        //!<cyclic poll for master
-  int8_t poll( uint16_t *regs, uint8_t u8size );        //!<cyclic poll for slave
+  int16_t poll();                                       //!<cyclic poll for master
+  int16_t poll( uint16_t *regs, uint16_t u16size );     //!<cyclic poll for slave
+  int16_t poll( const modbus_register_t *map, uint8_t u8entries ); //!<cyclic poll for slave, sparse register map
   uint16_t getInCnt();                                  //!<number of incoming messages
   uint16_t getOutCnt();                                 //!<number of outcoming messages
   uint16_t getErrCnt();                                 //!<error counter
@@ -206,8 +471,15 @@ public:
   uint8_t getAnswerID();                                //!<get Answer slave ID between 1 and 247
   uint8_t getState();
   uint8_t getLastError();                               //!<get last error message
+  uint8_t getLastException();                           //!<exception code sent by the slave
+  uint32_t getT35();                                    //!<inter-frame silence in us
   void setID( uint8_t u8id );                           //!<write new ID for the slave
   void setTxendPinOverTime( uint32_t u32overTime );
+  void setTxMode( uint8_t u8txMode );                   //!<TX_BLOCKING or TX_ASYNC
+  void setRxMode( uint8_t u8rxMode );                   //!<RX_POLLED or RX_EVENT
+  void setRxNotify( void (*rxNotify)(void) );           //!<called when RX_EVENT completes a transaction
+  void setMonitor( void (*monitor)(uint8_t u8id, uint8_t u8fct, uint8_t u8event, uint32_t u32rtt) ); //!<master transaction events, see MB_EVENTS
+  void rxEvent();                                       //!<serial receive callback for RX_EVENT
   void end();                                           //!<finish any communication and release serial communication port
 };
 
@@ -294,11 +566,28 @@ void Modbus::begin(Stream &serial)
   //=================================================================================================
   while(MODBUS_SERIAL->read() >= 0);
   //=================================================================================================
-  u8lastRec = u8BufferSize = 0;
+  u16lastRec = u16BufferSize = 0;
   u16InCnt = u16OutCnt = u16errCnt = 0;
   //=================================================================================================
 }
 
+/**
+ * @brief
+ * Initialize class object with the line speed of the port.
+ *
+ * The serial port itself must already be started. The speed sets the
+ * T3.5 inter-frame silence and the RS485 turnaround in TX_ASYNC mode.
+ *
+ * @param serial   serial port, already started
+ * @param u32speed baud rate of serial
+ * @ingroup setup
+ */
+void Modbus::begin(Stream &serial, uint32_t u32speed)
+{
+  setTimings(u32speed);
+  begin(serial);
+}
+
 /**
  * @brief
  * Method to write a new slave ID address
@@ -329,6 +618,77 @@ void Modbus::setTxendPinOverTime( uint32_t u32overTime )
   this->u32overTime = u32overTime;
 }
 
+/**
+ * @brief
+ * Method to select how the RS485 direction pin is released after a frame.
+ *
+ * TX_BLOCKING keeps the original behaviour: query() returns once the frame
+ * is on the wire and the line has turned around.
+ * TX_ASYNC returns as soon as the frame is handed to the UART. poll() then
+ * drops the direction pin once the frame's transmit time has elapsed. That
+ * time comes from the speed given to begin(Stream&, uint32_t).
+ *
+ * Both modes only apply with a direction pin (u8txenpin > 1). Without one,
+ * e.g. when the UART drives DE/RE in hardware RS485 mode, query() never
+ * waits for the frame to leave and the setting has no effect.
+ *
+ * @param u8txMode  TX_BLOCKING or TX_ASYNC
+ * @ingroup setup
+ */
+void Modbus::setTxMode( uint8_t u8txMode )
+{
+  this->u8txMode = u8txMode;
+}
+
+/**
+ * @brief
+ * Method to select how the master collects its answers.
+ *
+ * RX_POLLED keeps the original behaviour: poll() reads the Serial buffer.
+ * RX_EVENT leaves the Serial buffer to rxEvent(), which the port's receive
+ * callback must call (on the ESP32: Serial2.onReceive(cb, true)). The answer
+ * is validated and copied to the telegram's registers inside the callback,
+ * so its latency no longer depends on how often loop() calls poll().
+ *
+ * @param u8rxMode  RX_POLLED or RX_EVENT
+ * @ingroup setup
+ */
+void Modbus::setRxMode( uint8_t u8rxMode )
+{
+  this->u8rxMode = u8rxMode;
+}
+
+/**
+ * @brief
+ * Method to register a function called from rxEvent() once a transaction
+ * has completed, e.g. to wake the task that consumes the registers.
+ * It runs in the context of the serial receive callback: keep it short.
+ *
+ * @param rxNotify  function to call, NULL to disable
+ * @ingroup setup
+ */
+void Modbus::setRxNotify( void (*rxNotify)(void) )
+{
+  this->rxNotify = rxNotify;
+}
+
+/**
+ * @brief
+ * Method to register a function called on every master transaction event,
+ * e.g. to keep per-slave statistics (see ModbusStats.h).
+ * u8event is one of MB_EVENTS. u32rtt is the time in us from the end of the
+ * request to the end of the answer, 0 for MB_EV_REQUEST and MB_EV_TIMEOUT.
+ * It always runs on the task that calls query() and poll(), also in RX_EVENT
+ * mode, where poll() reports the answer rxEvent() has processed.
+ *
+ * @param monitor  function to call, NULL to disable
+ * @ingroup setup
+ */
+void Modbus::setMonitor( void (*monitor)(uint8_t u8id, uint8_t u8fct, uint8_t u8event, uint32_t u32rtt) )
+{
+  this->monitor = monitor;
+}
+
 /**
  * @brief
  * Method to read current slave ID address
@@ -369,6 +729,33 @@ void Modbus::setTimeOut( uint16_t u16timeOut)
   this->u16timeOut = u16timeOut;
 }
 
+/**
+ * @brief
+ * Get time-out parameter
+ *
+ * @return time-out value (ms)
+ * @ingroup setup
+ */
+uint16_t Modbus::getTimeOut()
+{
+  return u16timeOut;
+}
+
+/**
+ * @brief
+ * *** Only Modbus Master ***
+ * Sets the turnaround delay: how long the master stays silent after a
+ * broadcast, which has no answer, so that every slave can act on it
+ * before the next query. The specification suggests 100 to 200 ms.
+ *
+ * @param turnaround delay (ms)
+ * @ingroup setup
+ */
+void Modbus::setTurnaround( uint16_t u16turnaround )
+{
+  this->u16turnaround = u16turnaround;
+}
+
 /**
  * @brief
  * Return communication Watchdog state.
@@ -423,8 +810,13 @@ uint16_t Modbus::getErrCnt()
 
 /**
  * Get modbus master state
+ * A transaction stays COM_WAITING until poll() has reported its result,
+ * also in RX_EVENT mode where the answer is processed in the receive
+ * callback, so that a master shared by several callers is not taken by
+ * another query before the owner has read getLastError().
  *
- * @return = 0 IDLE, = 1 WAITING FOR ANSWER
+ * @return = 0 IDLE, = 1 WAITING FOR ANSWER, = 2 SENDING (TX_ASYNC),
+ * = 3 RECEIVING (RX_EVENT, rxEvent() at work)
  * @ingroup buffer
  */
 uint8_t Modbus::getState()
@@ -446,6 +838,30 @@ uint8_t Modbus::getLastError()
   return u8lastError;
 }
 
+/**
+ * @brief
+ * Get the exception code of the last answer when getLastError() is
+ * ERR_EXCEPTION, e.g. to forward it to another master.
+ *
+ * @return   exception code sent by the slave (EXC_FUNC_CODE ...), 0 if none yet
+ * @ingroup buffer
+ */
+uint8_t Modbus::getLastException()
+{
+  return u8lastException;
+}
+
+/**
+ * Get the inter-frame silence used to detect the end of a frame
+ *
+ * @return T3.5 in us for the configured speed
+ * @ingroup buffer
+ */
+uint32_t Modbus::getT35()
+{
+  return u32T35;
+}
+
 /**
  * @brief
  * *** Only Modbus Master ***
@@ -453,20 +869,72 @@ uint8_t Modbus::getLastError()
  * The Master must be in COM_IDLE mode. After it, its state would be COM_WAITING.
  * This method has to be called only in loop() section.
  *
+ * Slave id 0 broadcasts a write (FC5, FC6, FC15, FC16) to every slave.
+ * Nobody answers: poll() returns the master to COM_IDLE once the
+ * turnaround delay has passed, with getLastError() = 0, and the monitor
+ * only sees MB_EV_REQUEST.
+ *
+ * FC15 takes coil n from bit n % 16 of au16reg[n / 16], the layout FC1
+ * answers are stored in. FC23 writes u16WriteNo registers from au16write
+ * at u16WriteAdd, then reads u16CoilsNo registers at u16RegAdd into au16reg;
+ * both quantities must be at least 1 and au16write must be set.
+ * FC5 and FC6 take u16CoilsNo = 1.
+ *
  * @see modbus_t
  * @param modbus_t  modbus telegram structure (id, fct, ...)
+ * @return 0 if sent, -1 busy, -2 not a master, -3 bad slave id or a read broadcast,
+ * ERR_BUFF_OVERFLOW if a quantity is 0 or above the protocol limit
+ * (MAX_READ_BITS, MAX_WRITE_BITS, MAX_READ_REGS, MAX_WRITE_REGS, MAX_RW_WRITE_REGS),
+ * if an FC23 telegram has no au16write, or if the request or its answer exceeds MAX_BUFFER
  * @ingroup loop
- * @todo finish function 15
  */
 int8_t Modbus::query( modbus_t telegram )
 {
-  uint8_t u8regsno, u8bytesno;
+  uint16_t u16bytesno;
   if (u8id!=0) return -2;
-  if (u8state != COM_IDLE) return -1;
+  if (getState() != COM_IDLE) return -1;
+
+  if (telegram.u8id>247) return -3;
+  boolean bWrite = (telegram.u8fct == MB_FC_WRITE_COIL) || (telegram.u8fct == MB_FC_WRITE_REGISTER) ||
+                   (telegram.u8fct == MB_FC_WRITE_MULTIPLE_COILS) || (telegram.u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS);
+  if ((telegram.u8id==0) && !bWrite) return -3;
 
-  if ((telegram.u8id==0) || (telegram.u8id>247)) return -3;
+  // quantity within the protocol limit, then request and answer must both fit au8Buffer
+  if (telegram.u16CoilsNo == 0) return ERR_BUFF_OVERFLOW;
+  uint32_t u32request = RESPONSE_SIZE + CHECKSUM_SIZE;
+  uint32_t u32answer = RESPONSE_SIZE + CHECKSUM_SIZE;
+  switch( telegram.u8fct )
+  {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+      if (telegram.u16CoilsNo > MAX_READ_BITS) return ERR_BUFF_OVERFLOW;
+      u32answer = 3 + (telegram.u16CoilsNo + 7) / 8 + CHECKSUM_SIZE;
+    break;
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+      if (telegram.u16CoilsNo > MAX_READ_REGS) return ERR_BUFF_OVERFLOW;
+      u32answer = 3 + (uint32_t)telegram.u16CoilsNo * 2 + CHECKSUM_SIZE;
+    break;
+    case MB_FC_WRITE_MULTIPLE_COILS:
+      if (telegram.u16CoilsNo > MAX_WRITE_BITS) return ERR_BUFF_OVERFLOW;
+      u32request = 7 + (telegram.u16CoilsNo + 7) / 8 + CHECKSUM_SIZE;
+    break;
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+      if (telegram.u16CoilsNo > MAX_WRITE_REGS) return ERR_BUFF_OVERFLOW;
+      u32request = 7 + (uint32_t)telegram.u16CoilsNo * 2 + CHECKSUM_SIZE;
+    break;
+    case MB_FC_READ_WRITE_REGISTERS:
+      if ((telegram.au16write == NULL) || (telegram.u16WriteNo == 0)) return ERR_BUFF_OVERFLOW;
+      if ((telegram.u16WriteNo > MAX_RW_WRITE_REGS) || (telegram.u16CoilsNo > MAX_READ_REGS)) return ERR_BUFF_OVERFLOW;
+      u32request = 11 + (uint32_t)telegram.u16WriteNo * 2 + CHECKSUM_SIZE;
+      u32answer = 3 + (uint32_t)telegram.u16CoilsNo * 2 + CHECKSUM_SIZE;
+    break;
+  }
+  if ((u32request > MAX_BUFFER) || (u32answer > MAX_BUFFER)) return ERR_BUFF_OVERFLOW;
 
   au16regs = telegram.au16reg;
+  u8queryId = telegram.u8id;
+  u8queryFct = telegram.u8fct;
 
   // telegram header
   au8Buffer[ ID ]         = telegram.u8id;
@@ -474,54 +942,63 @@ int8_t Modbus::query( modbus_t telegram )
   au8Buffer[ ADD_HI ]     = highByte(telegram.u16RegAdd );
   au8Buffer[ ADD_LO ]     = lowByte( telegram.u16RegAdd );
 
+  // answer length: id + fct + byte count + data + crc, or an echo of the request header
+  u16expected = RESPONSE_SIZE + CHECKSUM_SIZE;
+
   switch( telegram.u8fct )
   {
     case MB_FC_READ_COILS:
     case MB_FC_READ_DISCRETE_INPUT:
+      au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
+      au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
+      u16BufferSize = 6;
+      u16expected = 3 + (telegram.u16CoilsNo + 7) / 8 + CHECKSUM_SIZE;
+    break;
+
     case MB_FC_READ_REGISTERS:
     case MB_FC_READ_INPUT_REGISTER:
       au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
       au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-      u8BufferSize = 6;
+      u16BufferSize = 6;
+      u16expected = 3 + telegram.u16CoilsNo * 2 + CHECKSUM_SIZE;
     break;
     
     case MB_FC_WRITE_COIL:
       au8Buffer[ NB_HI ]      = ((au16regs[0] > 0) ? 0xff : 0);
       au8Buffer[ NB_LO ]      = 0;
-      u8BufferSize = 6;
+      u16BufferSize = 6;
     break;
     
     case MB_FC_WRITE_REGISTER:
       au8Buffer[ NB_HI ]      = highByte(au16regs[0]);
       au8Buffer[ NB_LO ]      = lowByte(au16regs[0]);
-      u8BufferSize = 6;
+      u16BufferSize = 6;
     break;
         
-    case MB_FC_WRITE_MULTIPLE_COILS: // TODO: implement "sending coils"
-      u8regsno = telegram.u16CoilsNo / 16;
-      u8bytesno = u8regsno * 2;
-      if ((telegram.u16CoilsNo % 16) != 0)
-      {
-        u8bytesno++;
-        u8regsno++;
-      }
+    case MB_FC_WRITE_MULTIPLE_COILS:
+      // 8 coils per byte, first coil in bit 0: the low byte of a register holds its coils 0..7
+      u16bytesno = (telegram.u16CoilsNo + 7) / 8;
 
       au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
       au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
-      au8Buffer[ BYTE_CNT ]    = u8bytesno;
-      u8BufferSize = 7;
+      au8Buffer[ BYTE_CNT ]    = u16bytesno;
+      u16BufferSize = 7;
 
-      for (uint16_t i = 0; i < u8bytesno; i++)
+      for (uint16_t i = 0; i < u16bytesno; i++)
       {
         if(i%2)
         {
-          au8Buffer[ u8BufferSize ] = lowByte( au16regs[ i/2 ] );
+          au8Buffer[ u16BufferSize ] = highByte( au16regs[ i/2 ] );
         }
         else
         {
-          au8Buffer[ u8BufferSize ] = highByte( au16regs[ i/2] );
+          au8Buffer[ u16BufferSize ] = lowByte( au16regs[ i/2] );
         }          
-        u8BufferSize++;
+        u16BufferSize++;
+      }
+      if ((telegram.u16CoilsNo % 8) != 0)
+      {
+        au8Buffer[ u16BufferSize - 1 ] &= (1 << (telegram.u16CoilsNo % 8)) - 1;   // unused bits are sent as 0
       }
     break;
 
@@ -529,20 +1006,49 @@ int8_t Modbus::query( modbus_t telegram )
       au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
       au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
       au8Buffer[ BYTE_CNT ]    = (uint8_t) ( telegram.u16CoilsNo * 2 );
-      u8BufferSize = 7;
+      u16BufferSize = 7;
 
       for (uint16_t i=0; i< telegram.u16CoilsNo; i++)
       {
-        au8Buffer[ u8BufferSize ] = highByte( au16regs[ i ] );
-        u8BufferSize++;
-        au8Buffer[ u8BufferSize ] = lowByte( au16regs[ i ] );
-        u8BufferSize++;
+        au8Buffer[ u16BufferSize ] = highByte( au16regs[ i ] );
+        u16BufferSize++;
+        au8Buffer[ u16BufferSize ] = lowByte( au16regs[ i ] );
+        u16BufferSize++;
       }
     break;
+
+    case MB_FC_READ_WRITE_REGISTERS:
+      au8Buffer[ NB_HI ]      = highByte(telegram.u16CoilsNo );
+      au8Buffer[ NB_LO ]      = lowByte( telegram.u16CoilsNo );
+      au8Buffer[ 6 ]          = highByte(telegram.u16WriteAdd );
+      au8Buffer[ 7 ]          = lowByte( telegram.u16WriteAdd );
+      au8Buffer[ 8 ]          = highByte(telegram.u16WriteNo );
+      au8Buffer[ 9 ]          = lowByte( telegram.u16WriteNo );
+      au8Buffer[ 10 ]         = (uint8_t) ( telegram.u16WriteNo * 2 );
+      u16BufferSize = 11;
+
+      for (uint16_t i=0; i< telegram.u16WriteNo; i++)
+      {
+        au8Buffer[ u16BufferSize ] = highByte( telegram.au16write[ i ] );
+        u16BufferSize++;
+        au8Buffer[ u16BufferSize ] = lowByte( telegram.au16write[ i ] );
+        u16BufferSize++;
+      }
+      u16expected = 3 + telegram.u16CoilsNo * 2 + CHECKSUM_SIZE;
+    break;
+
+    default:
+      u16expected = 0;                       // unknown function: frame end by T3.5 only
+    break;
   }
+  bBroadcast = (telegram.u8id == 0);
   sendTxBuffer();
-  u8state = COM_WAITING;
+  u16rxCRC = MODBUS_CRC_INIT;
+  bRxOverflow = false;
+  bRxDone = false;
+  if (u8state == COM_IDLE) u8state = COM_WAITING;  // TX_ASYNC moves on from COM_SENDING in poll()
   u8lastError = 0;
+  report(MB_EV_REQUEST);
   return 0;
 }
 
@@ -560,82 +1066,63 @@ int8_t Modbus::query( modbus_t telegram )
  * @return errors counter
  * @ingroup loop
  */
-int8_t Modbus::poll()
+int16_t Modbus::poll()
 {
   // check if there is any incoming frame
-	uint8_t u8current;
+	uint16_t u16current;
   
+  if (!pollTxDone()) return 0;
+
+  // RX_EVENT: the answer has been handled by rxEvent(), the transaction ends here
+  if (bRxDone) return rxDone();
+  if (u8state != COM_WAITING) return 0;
+
   u8AnswerID = 0;
-  u8current = MODBUS_SERIAL->available();
-  
-  if((unsigned long)(millis() -u32timeOut) > (unsigned long)u16timeOut)
+  if (bBroadcast)
   {
+    // no answer: the slaves only need the turnaround delay
+    if((unsigned long)(millis() -u32timeOut) < (unsigned long)u16turnaround) return 0;
+    while(MODBUS_SERIAL->read() >= 0);
+    bBroadcast = false;
     u8state = COM_IDLE;
+    return 0;
+  }
+  if((unsigned long)(millis() -u32timeOut) > (unsigned long)u16timeOut)
+  {
+    // RX_EVENT: never time out a frame rxEvent() is processing, and report
+    // one it finished since bRxDone was read above
+    if (!__sync_bool_compare_and_swap(&u8state, COM_WAITING, COM_IDLE)) return 0;
+    if (bRxDone) return rxDone();
     u8lastError = NO_REPLY;
     u16errCnt++;
+    report(MB_EV_TIMEOUT);
     return 0;
   }
+  if (u8rxMode == RX_EVENT) return 0;
 
-  if(u8current == 0) return 0;
+  u16current = MODBUS_SERIAL->available();
 
-  // check T35 after frame end or still no frame end
-  if (u8current != u8lastRec)
+  // consume bytes as they arrive, CRC included
+  if (u16current > 0)
   {
-    u8lastRec = u8current;
-    u32time = millis();
-    return 0;
+    getRxBytes();
+    u32time = micros();
   }
-  if((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
+  if (u16BufferSize == 0) return 0;
 
-  // transfer Serial buffer frame to auBuffer
-  u8lastRec = 0;
-  int8_t i8state = getRxBuffer();
-  if (i8state < 6)                          // 7 was incorrect for functions 1 and 2 the smallest frame could be 6 bytes long
-  {
-    u8state = COM_IDLE;
-    u16errCnt++;
-    return i8state;
-  }
+  // an exception answer is always id + fct + code + crc
+  if ((u16BufferSize > FUNC) && (au8Buffer[ FUNC ] & 0x80)) u16expected = EXCEPTION_SIZE + CHECKSUM_SIZE;
 
-  // validate message: id, CRC, FCT, exception
-  uint8_t u8exception = validateAnswer();
-  if (u8exception != 0)
+  // frame end: predicted length reached, otherwise T3.5 of silence
+  if ((u16expected == 0) || (u16BufferSize < u16expected))
   {
-    u8state = COM_IDLE;
-    return u8exception;
+    if((unsigned long)(micros() -u32time) < (unsigned long)u32T35) return 0;
   }
 
-  //=============================================================================
-  // validate message Answer from Slave ID
-  //=============================================================================
-  u8AnswerID = au8Buffer[ID];
-  //=============================================================================
-  
-  // process answer
-  switch(au8Buffer[FUNC])
-  {
-    case MB_FC_READ_COILS:
-    case MB_FC_READ_DISCRETE_INPUT:
-      get_FC1( );                           // call get_FC1 to transfer the incoming message to au16regs buffer
-    break;
-    
-    case MB_FC_READ_INPUT_REGISTER:
-    case MB_FC_READ_REGISTERS :
-      get_FC3( );                           // call get_FC3 to transfer the incoming message to au16regs buffer
-    break;
-    
-    case MB_FC_WRITE_COIL:
-    case MB_FC_WRITE_REGISTER :
-    case MB_FC_WRITE_MULTIPLE_COILS:
-    case MB_FC_WRITE_MULTIPLE_REGISTERS :
-      // nothing to do
-    break;
-    
-    default:
-    break;
-  }
+  int16_t i16result = processAnswer();
+  report(u8answerEvent);
   u8state = COM_IDLE;
-  return u8BufferSize;
+  return i16result;
 }
 
 /**
@@ -647,32 +1134,112 @@ int8_t Modbus::poll()
  * After a successful frame between the Master and the Slave, the time-out timer is reset.
  *
  * @param *regs  register table for communication exchange
- * @param u8size  size of the register table
+ * @param u16size  size of the register table
  * @return 0 if no query, 1..4 if communication error, >4 if correct query processed
  * @ingroup loop
  */
-int8_t Modbus::poll( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::poll( uint16_t *regs, uint16_t u16size )
 {
   au16regs = regs;
-  u8regsize = u8size;
-	uint8_t u8current;
+  u16regsize = u16size;
+  map = NULL;
+  return processRequest();
+}
+
+/**
+ * @brief
+ * *** Only for Modbus Slave ***
+ * Same as poll(regs, size), but registers are served by a sparse map of
+ * callbacks (see modbus_register_t). FC3/FC4 read, FC6/FC16 write; coil
+ * functions answer EXC_FUNC_CODE. A request touching an address outside
+ * the map, or a read-only register for a write, answers EXC_ADDR_RANGE.
+ *
+ * @param map        register blocks sorted by address
+ * @param u8entries  number of blocks
+ * @return 0 if no query, 1..4 if communication error, >4 if correct query processed
+ * @ingroup loop
+ */
+int16_t Modbus::poll( const modbus_register_t *map, uint8_t u8entries )
+{
+  au16regs = NULL;
+  u16regsize = 0;
+  this->map = map;
+  u8mapSize = u8entries;
+  return processRequest();
+}
+
+/**
+ * @brief *** Only for Modbus Master in RX_EVENT mode ***
+ * Receive callback: call it from the serial port's receive event, e.g.
+ * Serial2.onReceive(cb, true) on the ESP32, which fires when the line goes idle.
+ * Moves the received bytes straight into the frame buffer and, once the answer
+ * is complete, validates it and copies its data to the telegram's registers.
+ * poll() then only reports the result.
+ *
+ * @ingroup loop
+ */
+void Modbus::rxEvent()
+{
+  if (u8state == COM_SENDING) return;     // echo of our own frame, pollTxDone() drops it
+  // claim the transaction: while COM_RECEIVING, poll() cannot time it out
+  if (bBroadcast || bRxDone || !__sync_bool_compare_and_swap(&u8state, COM_WAITING, COM_RECEIVING))
+  {
+    while(MODBUS_SERIAL->read() >= 0);      // nobody is waiting: stray bytes
+    return;
+  }
+
+  getRxBytes();
+
+  // an idle-line event ends the frame even when its length is unknown
+  if ((u16BufferSize > FUNC) && (au8Buffer[ FUNC ] & 0x80)) u16expected = EXCEPTION_SIZE + CHECKSUM_SIZE;
+  if ((u16expected != 0) && (u16BufferSize < u16expected))
+  {
+    u8state = COM_WAITING;                  // the rest comes with the next event
+    return;
+  }
+
+  // back to COM_WAITING, not COM_IDLE: poll() ends the transaction on the
+  // owner's task. The result and the registers must be visible before
+  // bRxDone is, and bRxDone before the state is released.
+  i16rxResult = processAnswer();
+  __sync_synchronize();
+  bRxDone = true;
+  __sync_synchronize();
+  u8state = COM_WAITING;
+  if (rxNotify != NULL) rxNotify();
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Slave: receives a request, validates it and answers it from au16regs
+ * or from the register map.
+ *
+ * @return 0 if no query, 1..4 if communication error, >4 if correct query processed
+ * @ingroup loop
+ */
+int16_t Modbus::processRequest()
+{
+	uint16_t u16current;
   
-  u8current = MODBUS_SERIAL->available();  
-  if (u8current == 0) return 0;
+  if (!pollTxDone()) return 0;
+  u16current = MODBUS_SERIAL->available();  
+  if (u16current == 0) return 0;
   
   // check T35 after frame end or still no frame end
-  if (u8current != u8lastRec)
+  if (u16current != u16lastRec)
   {
-    u8lastRec = u8current;
-    u32time = millis();
+    u16lastRec = u16current;
+    u32time = micros();
     return 0;
   }
-  if ((unsigned long)(millis() -u32time) < (unsigned long)T35) return 0;
+  if ((unsigned long)(micros() -u32time) < (unsigned long)u32T35) return 0;
   
-  u8lastRec = 0;
-  int8_t i8state = getRxBuffer();
-  u8lastError = i8state;
-  if (i8state < 7) return i8state;
+  u16lastRec = 0;
+  int16_t i16state = getRxBuffer();
+  u8lastError = i16state;
+  if (i16state < 7) return i16state;
   
   // check slave id
   if (au8Buffer[ ID ] != u8id) return 0;
@@ -693,49 +1260,60 @@ int8_t Modbus::poll( uint16_t *regs, uint8_t u8size )
   u32timeOut = millis();
   u8lastError = 0;
   
+  if (map != NULL) return process_map();
+
   // process message
   switch( au8Buffer[ FUNC ] )
   {
     case MB_FC_READ_COILS:
     case MB_FC_READ_DISCRETE_INPUT:
-      return process_FC1(regs, u8size );
+      return process_FC1(au16regs, u16regsize );
     break;
     
     case MB_FC_READ_INPUT_REGISTER:
     case MB_FC_READ_REGISTERS :
-      return process_FC3(regs, u8size );
+      return process_FC3(au16regs, u16regsize );
     break;
     
     case MB_FC_WRITE_COIL:
-      return process_FC5(regs, u8size );
+      return process_FC5(au16regs, u16regsize );
     break;
     
     case MB_FC_WRITE_REGISTER :
-      return process_FC6(regs, u8size );
+      return process_FC6(au16regs, u16regsize );
     break;
     
     case MB_FC_WRITE_MULTIPLE_COILS:
-      return process_FC15(regs, u8size );
+      return process_FC15(au16regs, u16regsize );
     break;
     
     case MB_FC_WRITE_MULTIPLE_REGISTERS :
-      return process_FC16(regs, u8size );
+      return process_FC16(au16regs, u16regsize );
     break;
     
     default:
     break;
   }
-  return i8state;
+  return i16state;
 }
-/* _____PRIVATE FUNCTIONS_____________________________________________________ */
 
 void Modbus::init(uint8_t u8id, Stream &serial, uint8_t u8txenpin)
 {
   this->u8id = u8id;
   this->u8txenpin = u8txenpin;
   this->u16timeOut = 1000;
+  this->u16turnaround = TURNAROUND_DEFAULT;
+  this->bBroadcast = false;
   this->u32overTime = 0;
   MODBUS_SERIAL = &serial;
+  this->u8state = COM_IDLE;
+  this->u8lastException = 0;
+  this->u8txMode = TX_BLOCKING;
+  this->u8rxMode = RX_POLLED;
+  this->bRxDone = false;
+  this->rxNotify = NULL;
+  this->monitor = NULL;
+  setTimings(9600);
 }
 
 void Modbus::init(uint8_t u8id)
@@ -743,39 +1321,67 @@ void Modbus::init(uint8_t u8id)
   this->u8id = u8id;
   this->u8txenpin = 0;
   this->u16timeOut = 1000;
+  this->u16turnaround = TURNAROUND_DEFAULT;
+  this->bBroadcast = false;
   this->u32overTime = 0;
+  this->u8state = COM_IDLE;
+  this->u8lastException = 0;
+  this->u8txMode = TX_BLOCKING;
+  this->u8rxMode = RX_POLLED;
+  this->bRxDone = false;
+  this->rxNotify = NULL;
+  this->monitor = NULL;
+  setTimings(9600);
+}
+
+/**
+ * @brief
+ * Derives character and inter-frame times from the line speed.
+ * An RTU character is 11 bits. T3.5 is 3.5 characters up to 19200 baud
+ * and a fixed 1750 us above, as the serial line spec recommends.
+ *
+ * @param u32speed  baud rate
+ * @ingroup buffer
+ */
+void Modbus::setTimings(uint32_t u32speed)
+{
+  u32baud = u32speed;
+  u16charTime = 11000000UL / u32speed;
+  u32T35 = (u32speed > 19200) ? T35_FAST_US : ((uint32_t)u16charTime * 7) / 2;
 }
 
 /**
  * @brief
  * This method moves Serial buffer data to the Modbus au8Buffer.
  *
- * @return buffer size if OK, ERR_BUFF_OVERFLOW if u8BufferSize >= MAX_BUFFER
+ * @return buffer size if OK, ERR_BUFF_OVERFLOW if the frame is longer than MAX_BUFFER
  * @ingroup buffer
  */
-int8_t Modbus::getRxBuffer()
+int16_t Modbus::getRxBuffer()
 {
   boolean bBuffOverflow = false;
 
   if (u8txenpin > 1) digitalWrite( u8txenpin, LOW );
   
-  u8BufferSize = 0;
+  u16BufferSize = 0;
   while(MODBUS_SERIAL->available())
   {
-    //au8Buffer[ u8BufferSize ] = port->read();
-    au8Buffer[ u8BufferSize ] = MODBUS_SERIAL->read();
-    //au8Buffer[ u8BufferSize ] = Serial2.read();
-    u8BufferSize ++;
-      
-    if(u8BufferSize >= MAX_BUFFER) bBuffOverflow = true;
+    int16_t i16byte = MODBUS_SERIAL->read();
+    if (u16BufferSize >= MAX_BUFFER)
+    {
+      bBuffOverflow = true;                 // drain the rest, keep nothing past the buffer
+      continue;
+    }
+    au8Buffer[ u16BufferSize ] = i16byte;
+    u16BufferSize ++;
   }
   
   /*
   //======================================
   Serial.print("RX: ");
-  Serial.print(u8BufferSize);
+  Serial.print(u16BufferSize);
   Serial.print(":");
-  for(int i=0; i<u8BufferSize; i++)
+  for(int i=0; i<u16BufferSize; i++)
   {
     Serial.print(" ");
     Serial.print(au8Buffer[i],HEX);
@@ -790,7 +1396,139 @@ int8_t Modbus::getRxBuffer()
     u16errCnt++;
     return ERR_BUFF_OVERFLOW;
   }
-  return u8BufferSize;
+  return u16BufferSize;
+}
+
+/**
+ * @brief
+ * Master: validates a complete answer in au8Buffer and transfers its data
+ * to the telegram's registers. The caller ends the transaction (COM_IDLE)
+ * and reports u8answerEvent to the monitor.
+ *
+ * @return answer size if OK, error or exception code otherwise
+ * @ingroup buffer
+ */
+int16_t Modbus::processAnswer()
+{
+  u16InCnt++;
+  u32answerTime = micros();
+  u8answerEvent = MB_EV_BAD_FRAME;
+  if (bRxOverflow || (u16BufferSize < EXCEPTION_SIZE + CHECKSUM_SIZE))
+  {
+    u8lastError = bRxOverflow ? (uint8_t)ERR_BUFF_OVERFLOW : (uint8_t)u16BufferSize;
+    u16errCnt++;
+    return bRxOverflow ? (int16_t)ERR_BUFF_OVERFLOW : (int16_t)u16BufferSize;
+  }
+  // CRC over data + CRC of an intact frame is 0. An intact frame from
+  // another slave, e.g. a late answer to the previous query, is no answer either.
+  if ((u16rxCRC != 0) || (au8Buffer[ ID ] != u8queryId))
+  {
+    u8lastError = NO_REPLY;
+    u16errCnt++;
+    return NO_REPLY;
+  }
+
+  // validate message: FCT, exception
+  uint8_t u8exception = validateAnswer();
+  if (u8exception != 0)
+  {
+    u8lastError = u8exception;
+    if (u8exception == (uint8_t)ERR_EXCEPTION) u8lastException = au8Buffer[ 2 ];
+    if (u8exception == (uint8_t)ERR_EXCEPTION) u8answerEvent = MB_EV_EXCEPTION;
+    return u8exception;
+  }
+
+  u8AnswerID = au8Buffer[ID];
+  
+  // process answer
+  switch(au8Buffer[FUNC])
+  {
+    case MB_FC_READ_COILS:
+    case MB_FC_READ_DISCRETE_INPUT:
+      get_FC1( );                           // call get_FC1 to transfer the incoming message to au16regs buffer
+    break;
+    
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_REGISTERS :
+    case MB_FC_READ_WRITE_REGISTERS :
+      get_FC3( );                           // call get_FC3 to transfer the incoming message to au16regs buffer
+    break;
+    
+    case MB_FC_WRITE_COIL:
+    case MB_FC_WRITE_REGISTER :
+    case MB_FC_WRITE_MULTIPLE_COILS:
+    case MB_FC_WRITE_MULTIPLE_REGISTERS :
+      // nothing to do
+    break;
+    
+    default:
+    break;
+  }
+  u8answerEvent = MB_EV_RESPONSE;
+  return u16BufferSize;
+}
+
+/**
+ * @brief
+ * Passes a transaction event to the monitor, if any.
+ *
+ * @param u8event  MB_EVENTS value
+ * @ingroup buffer
+ */
+void Modbus::report(uint8_t u8event)
+{
+  if (monitor == NULL) return;
+  uint32_t u32rtt = ((u8event == MB_EV_REQUEST) || (u8event == MB_EV_TIMEOUT)) ? 0 : u32answerTime - u32rttStart;
+  monitor(u8queryId, u8queryFct, u8event, u32rtt);
+}
+
+/**
+ * @brief
+ * RX_EVENT: ends the transaction rxEvent() has finished and reports its
+ * answer, so the monitor runs on the owner's task and not in the callback.
+ *
+ * @return the poll() result rxEvent() left in i16rxResult
+ * @ingroup loop
+ */
+int16_t Modbus::rxDone()
+{
+  int16_t i16result = i16rxResult;
+  bRxDone = false;
+  report(u8answerEvent);
+  __sync_synchronize();
+  u8state = COM_IDLE;
+  return i16result;
+}
+
+/**
+ * @brief
+ * Master receive path: appends the bytes waiting in the Serial buffer to
+ * au8Buffer and folds them into the running CRC u16rxCRC, so the frame is
+ * checked by the time its last byte arrives.
+ *
+ * @return number of bytes read
+ * @ingroup buffer
+ */
+uint16_t Modbus::getRxBytes()
+{
+  uint16_t u16start = u16BufferSize;
+
+  if (u8txenpin > 1) digitalWrite( u8txenpin, LOW );
+
+  while(MODBUS_SERIAL->available())
+  {
+    int16_t i16byte = MODBUS_SERIAL->read();
+    if (u16BufferSize >= MAX_BUFFER)
+    {
+      bRxOverflow = true;
+      continue;
+    }
+    au8Buffer[ u16BufferSize ] = i16byte;
+    u16BufferSize++;
+  }
+  u16rxCRC = modbusCRC16(&au8Buffer[ u16start ], u16BufferSize - u16start, u16rxCRC);
+
+  return u16BufferSize - u16start;
 }
 
 /**
@@ -807,14 +1545,12 @@ int8_t Modbus::getRxBuffer()
  */
 void Modbus::sendTxBuffer()
 {
-  uint8_t i = 0;
-
   // append CRC to message
-  uint16_t u16crc = calcCRC( u8BufferSize );
-  au8Buffer[ u8BufferSize ] = u16crc >> 8;
-  u8BufferSize++;
-  au8Buffer[ u8BufferSize ] = u16crc & 0x00ff;
-  u8BufferSize++;
+  uint16_t u16crc = calcCRC( u16BufferSize );
+  au8Buffer[ u16BufferSize ] = u16crc >> 8;
+  u16BufferSize++;
+  au8Buffer[ u16BufferSize ] = u16crc & 0x00ff;
+  u16BufferSize++;
 	
   if (u8txenpin > 1)
   {
@@ -823,11 +1559,19 @@ void Modbus::sendTxBuffer()
     //=============================================================
   }
   //===============================================================  
-  MODBUS_SERIAL->write(au8Buffer, u8BufferSize); 
+  MODBUS_SERIAL->write(au8Buffer, u16BufferSize); 
   //=============================================================== 
   
   //=============================================================== 
-  if(u8txenpin > 1)
+  if((u8txenpin > 1) && (u8txMode == TX_ASYNC))
+  {
+    //=============================================================
+    u32txStart = micros();                                        // pin is released by pollTxDone()
+    u32txTime = (uint32_t)(u16BufferSize + 1) * u16charTime;       // frame + one character guard
+    u8state = COM_SENDING;
+    //=============================================================
+  }
+  else if(u8txenpin > 1)
   {
     //=============================================================
     MODBUS_SERIAL->flush();                                       // must wait transmission end before changing pin state
@@ -838,7 +1582,7 @@ void Modbus::sendTxBuffer()
     delayMicroseconds(1500);                                      // Wait Packet Complete : 1500uS = OK
     while(MODBUS_SERIAL->available() > 0)
     {
-      uint8_t dummy = MODBUS_SERIAL->read();
+      MODBUS_SERIAL->read();
     }
     //=============================================================
     volatile uint32_t u32overTimeCountDown = u32overTime;
@@ -846,44 +1590,54 @@ void Modbus::sendTxBuffer()
     //=============================================================
   }
   //===============================================================
-  u8BufferSize = 0;
+  u16BufferSize = 0;
   //===============================================================
   u32timeOut = millis();                                         // set time-out for master 
+  u32rttStart = micros();
   u16OutCnt++;                                                   // increase message counter
   //===============================================================
 }
 
 /**
  * @brief
- * This method calculates CRC
+ * TX_ASYNC turnaround: once the frame in flight has left the UART, returns
+ * the RS485 transceiver to receive mode and drops the line echo.
+ * The master then starts waiting for its answer, the slave goes idle.
  *
- * @return uint16_t calculated CRC value for the message
+ * @return true if the line is free for reception
  * @ingroup buffer
  */
-uint16_t Modbus::calcCRC(uint8_t u8length)
+boolean Modbus::pollTxDone()
 {
-  unsigned int temp, temp2, flag;
-  temp = 0xFFFF;
-  for (unsigned char i = 0; i < u8length; i++)
+  if (u8state != COM_SENDING) return true;
+  if ((uint32_t)(micros() - u32txStart) < u32txTime) return false;
+
+  digitalWrite(u8txenpin, LOW);                                   // return RS485 transceiver to receive mode
+  while(MODBUS_SERIAL->available() > 0)
   {
-    temp = temp ^ au8Buffer[i];
-    for (unsigned char j = 1; j <= 8; j++)
-    {
-      flag = temp & 0x0001;
-      temp >>=1;
-      if (flag)
-        temp ^= 0xA001;
-    }
+    MODBUS_SERIAL->read();
   }
-  
-  // Reverse byte order.
-  temp2 = temp >> 8;
-  temp = (temp << 8) | temp2;
-  temp &= 0xFFFF;
-  
+  u32timeOut = millis();                                          // answer time-out runs from end of frame
+  u32rttStart = micros();
+  u16lastRec = 0;
+  u8state = (u8id == 0) ? COM_WAITING : COM_IDLE;
+  return true;
+}
+
+/**
+ * @brief
+ * This method calculates CRC
+ *
+ * @return uint16_t calculated CRC value for the message
+ * @ingroup buffer
+ */
+uint16_t Modbus::calcCRC(uint16_t u16length)
+{
+  uint16_t u16crc = modbusCRC16(au8Buffer, u16length);
+
   // the returned value is already swapped
   // crcLo byte is first & crcHi byte is last
-  return temp;
+  return (u16crc << 8) | (u16crc >> 8);
 }
 
 /**
@@ -896,9 +1650,9 @@ uint16_t Modbus::calcCRC(uint8_t u8length)
 uint8_t Modbus::validateRequest()
 {
   // check message crc vs calculated crc
-  uint16_t u16MsgCRC = ((au8Buffer[u8BufferSize - 2] << 8)
-                       | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-  if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC )
+  uint16_t u16MsgCRC = ((au8Buffer[u16BufferSize - 2] << 8)
+                       | au8Buffer[u16BufferSize - 1]); // combine the crc Low & High bytes
+  if ( calcCRC( u16BufferSize-2 ) != u16MsgCRC )
   {
     u16errCnt ++;
     return NO_REPLY;
@@ -920,62 +1674,69 @@ uint8_t Modbus::validateRequest()
     return EXC_FUNC_CODE;
   }
   
-  // check start address & nb range
-  uint16_t u16regs = 0;
-  uint8_t u8regs;
+  // check quantity against the protocol, the frame and the answer buffer,
+  // then start address & nb against the register array (the map checks its own)
+  uint16_t u16add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16no = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  uint32_t u32end = 0;                        // first register past the request
   switch ( au8Buffer[ FUNC ] )
   {
     case MB_FC_READ_COILS:
     case MB_FC_READ_DISCRETE_INPUT:
+        if ((u16no == 0) || (u16no > MAX_READ_BITS)) return EXC_REGS_QUANT;
+        if (3 + (u16no + 7) / 8 + 2 > MAX_BUFFER) return EXC_REGS_QUANT;
+        if (map != NULL) return EXC_FUNC_CODE;
+        u32end = ((uint32_t)u16add + u16no + 15) / 16;
+    break;
+    
     case MB_FC_WRITE_MULTIPLE_COILS:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]) /16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if ((u16no == 0) || (u16no > MAX_WRITE_BITS)) return EXC_REGS_QUANT;
+        if ((au8Buffer[ BYTE_CNT ] != (u16no + 7) / 8) || (u16BufferSize != BYTE_CNT + 1 + au8Buffer[ BYTE_CNT ] + 2)) return EXC_REGS_QUANT;
+        if (map != NULL) return EXC_FUNC_CODE;
+        u32end = ((uint32_t)u16add + u16no + 15) / 16;
     break;
     
     case MB_FC_WRITE_COIL:
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]) / 16;
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if (map != NULL) return EXC_FUNC_CODE;
+        u32end = (uint32_t)u16add / 16 + 1;
     break;
     
     case MB_FC_WRITE_REGISTER :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        u32end = (uint32_t)u16add + 1;
     break;
     
     case MB_FC_READ_REGISTERS :
     case MB_FC_READ_INPUT_REGISTER :
+        if ((u16no == 0) || (u16no > MAX_READ_REGS)) return EXC_REGS_QUANT;
+        if (3 + u16no * 2 + 2 > MAX_BUFFER) return EXC_REGS_QUANT;
+        u32end = (uint32_t)u16add + u16no;
+    break;
+    
     case MB_FC_WRITE_MULTIPLE_REGISTERS :
-        u16regs = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ]);
-        u16regs += word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ]);
-        u8regs = (uint8_t) u16regs;
-        if (u8regs > u8regsize) return EXC_ADDR_RANGE;
+        if ((u16no == 0) || (u16no > MAX_WRITE_REGS)) return EXC_REGS_QUANT;
+        if ((au8Buffer[ BYTE_CNT ] != u16no * 2) || (u16BufferSize != BYTE_CNT + 1 + u16no * 2 + 2)) return EXC_REGS_QUANT;
+        u32end = (uint32_t)u16add + u16no;
     break;
+
+    case MB_FC_READ_WRITE_REGISTERS :
+        return EXC_FUNC_CODE;                 // master only
   }
+  if ((map == NULL) && (u32end > u16regsize)) return EXC_ADDR_RANGE;
   return 0; // OK, no exception code thrown
 }
 
 /**
  * @brief
- * This method validates master incoming messages
+ * This method validates master incoming messages.
+ * The CRC must already have been checked through u16rxCRC.
  *
  * @return 0 if OK, EXCEPTION if anything fails
  * @ingroup buffer
  */
 uint8_t Modbus::validateAnswer()
 {
-  // check message crc vs calculated crc
-  uint16_t u16MsgCRC = ((au8Buffer[u8BufferSize - 2] << 8)
-                       | au8Buffer[u8BufferSize - 1]); // combine the crc Low & High bytes
-  if ( calcCRC( u8BufferSize-2 ) != u16MsgCRC )
-  {
-    u16errCnt ++;
-    return NO_REPLY;
-  }
-  
+  // CRC has already been checked byte by byte in getRxBytes()
+
   // check exception
   if ((au8Buffer[ FUNC ] & 0x80) != 0)
   {
@@ -1015,7 +1776,7 @@ void Modbus::buildException( uint8_t u8exception )
   au8Buffer[ ID ]   = u8id;
   au8Buffer[ FUNC ] = u8func + 0x80;
   au8Buffer[ 2 ]    = u8exception;
-  u8BufferSize      = EXCEPTION_SIZE;
+  u16BufferSize      = EXCEPTION_SIZE;
 }
 
 /**
@@ -1027,17 +1788,17 @@ void Modbus::buildException( uint8_t u8exception )
  */
 void Modbus::get_FC1()
 {
-  uint8_t u8byte, i, maxI;
-  u8byte = 3;
+  uint16_t u16byte, i;
+  u16byte = 3;
   for (i=0; i< au8Buffer[2]; i++) 
   {      
     if(i%2)
     {
-      au16regs[i/2]= word(au8Buffer[i+u8byte], lowByte(au16regs[i/2]));
+      au16regs[i/2]= word(au8Buffer[i+u16byte], lowByte(au16regs[i/2]));
     }
     else
     {     
-      au16regs[i/2]= word(highByte(au16regs[i/2]), au8Buffer[i+u8byte]); 
+      au16regs[i/2]= word(highByte(au16regs[i/2]), au8Buffer[i+u16byte]); 
     }  
   }
 }
@@ -1050,13 +1811,13 @@ void Modbus::get_FC1()
  */
 void Modbus::get_FC3()
 {
-  uint8_t u8byte, i;
-  u8byte = 3;
+  uint16_t u16byte, i;
+  u16byte = 3;
 
   for (i=0; i< au8Buffer[2]/2; i++)
   {
-    au16regs[i] = word(au8Buffer[u8byte], au8Buffer[u8byte+1]);
-    u8byte += 2;
+    au16regs[i] = word(au8Buffer[u16byte], au8Buffer[u16byte+1]);
+    u16byte += 2;
   }
 }
 
@@ -1065,13 +1826,15 @@ void Modbus::get_FC3()
  * This method processes functions 1 & 2
  * This method reads a bit array and transfers it to the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC1( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC1( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8currentRegister, u8currentBit, u8bytesno, u8bitsno;
-  uint8_t u8CopyBufferSize;
+  uint16_t u16currentRegister;
+  uint8_t u8currentBit, u8bitsno;
+  uint16_t u16bytesno;
+  uint16_t u16CopyBufferSize;
   uint16_t u16currentCoil, u16coil;
 
   // get the first and last coil from the message
@@ -1079,11 +1842,11 @@ int8_t Modbus::process_FC1( uint16_t *regs, uint8_t u8size )
   uint16_t u16Coilno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
 
   // put the number of bytes in the outcoming message
-  u8bytesno = (uint8_t) (u16Coilno / 8);
-  if (u16Coilno % 8 != 0) u8bytesno ++;
-  au8Buffer[ ADD_HI ]  = u8bytesno;
-  u8BufferSize         = ADD_LO;
-  au8Buffer[ u8BufferSize + u8bytesno - 1 ] = 0;
+  u16bytesno = u16Coilno / 8;
+  if (u16Coilno % 8 != 0) u16bytesno ++;
+  au8Buffer[ ADD_HI ]  = u16bytesno;
+  u16BufferSize         = ADD_LO;
+  au8Buffer[ u16BufferSize + u16bytesno - 1 ] = 0;
 
   // read each coil from the register map and put its value inside the outcoming message
   u8bitsno = 0;
@@ -1091,28 +1854,28 @@ int8_t Modbus::process_FC1( uint16_t *regs, uint8_t u8size )
   for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
   {
     u16coil = u16StartCoil + u16currentCoil;
-    u8currentRegister = (uint8_t) (u16coil / 16);
+    u16currentRegister = u16coil / 16;
     u8currentBit = (uint8_t) (u16coil % 16);
 
     bitWrite(
-              au8Buffer[ u8BufferSize ],
+              au8Buffer[ u16BufferSize ],
               u8bitsno,
-              bitRead( regs[ u8currentRegister ], u8currentBit )
+              bitRead( regs[ u16currentRegister ], u8currentBit )
             );
     u8bitsno ++;
 
     if (u8bitsno > 7)
     {
       u8bitsno = 0;
-      u8BufferSize++;
+      u16BufferSize++;
     }
   }
 
   // send outcoming message
-  if (u16Coilno % 8 != 0) u8BufferSize ++;
-  u8CopyBufferSize = u8BufferSize +2;
+  if (u16Coilno % 8 != 0) u16BufferSize ++;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
 
 /**
@@ -1120,30 +1883,30 @@ int8_t Modbus::process_FC1( uint16_t *regs, uint8_t u8size )
  * This method processes functions 3 & 4
  * This method reads a word array and transfers it to the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC3( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC3( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-  uint8_t u8regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
-  uint8_t u8CopyBufferSize;
-  uint8_t i;
+  uint16_t u16StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  uint16_t u16CopyBufferSize;
+  uint32_t i;
   
-  au8Buffer[ 2 ]       = u8regsno * 2;
-  u8BufferSize         = 3;
+  au8Buffer[ 2 ]       = u16regsno * 2;
+  u16BufferSize         = 3;
   
-  for(i = u8StartAdd; i < u8StartAdd + u8regsno; i++)
+  for(i = u16StartAdd; i < (uint32_t)u16StartAdd + u16regsno; i++)
   {
-    au8Buffer[ u8BufferSize ] = highByte(regs[i]);
-    u8BufferSize++;
-    au8Buffer[ u8BufferSize ] = lowByte(regs[i]);
-    u8BufferSize++;
+    au8Buffer[ u16BufferSize ] = highByte(regs[i]);
+    u16BufferSize++;
+    au8Buffer[ u16BufferSize ] = lowByte(regs[i]);
+    u16BufferSize++;
   }
-  u8CopyBufferSize = u8BufferSize +2;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
   
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
 
 /**
@@ -1151,33 +1914,34 @@ int8_t Modbus::process_FC3( uint16_t *regs, uint8_t u8size )
  * This method processes function 5
  * This method writes a value assigned by the master to a single bit
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC5( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC5( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8currentRegister, u8currentBit;
-  uint8_t u8CopyBufferSize;
+  uint16_t u16currentRegister;
+  uint8_t u8currentBit;
+  uint16_t u16CopyBufferSize;
   uint16_t u16coil = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
 
   // point to the register and its bit
-  u8currentRegister = (uint8_t) (u16coil / 16);
+  u16currentRegister = u16coil / 16;
   u8currentBit = (uint8_t) (u16coil % 16);
 
   // write to coil
   bitWrite(
-            regs[ u8currentRegister ],
+            regs[ u16currentRegister ],
             u8currentBit,
             au8Buffer[ NB_HI ] == 0xff 
           );
 
 
   // send answer to master
-  u8BufferSize = 6;
-  u8CopyBufferSize = u8BufferSize +2;
+  u16BufferSize = 6;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
 
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
 
 /**
@@ -1185,24 +1949,24 @@ int8_t Modbus::process_FC5( uint16_t *regs, uint8_t u8size )
  * This method processes function 6
  * This method writes a value assigned by the master to a single word
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC6( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC6( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
-  uint8_t u8CopyBufferSize;
+  uint16_t u16add = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16CopyBufferSize;
   uint16_t u16val = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
   
-  regs[ u8add ] = u16val;
+  regs[ u16add ] = u16val;
   
   // keep the same header
-  u8BufferSize         = RESPONSE_SIZE;
+  u16BufferSize         = RESPONSE_SIZE;
   
-  u8CopyBufferSize = u8BufferSize +2;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
   
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
 
 /**
@@ -1210,13 +1974,15 @@ int8_t Modbus::process_FC6( uint16_t *regs, uint8_t u8size )
  * This method processes function 15
  * This method writes a bit array assigned by the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup discrete
  */
-int8_t Modbus::process_FC15( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC15( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8currentRegister, u8currentBit, u8frameByte, u8bitsno;
-  uint8_t u8CopyBufferSize;
+  uint16_t u16currentRegister;
+  uint8_t u8currentBit, u8bitsno;
+  uint16_t u16frameByte;
+  uint16_t u16CopyBufferSize;
   uint16_t u16currentCoil, u16coil;
   boolean bTemp;
 
@@ -1226,16 +1992,16 @@ int8_t Modbus::process_FC15( uint16_t *regs, uint8_t u8size )
   
   // read each coil from the register map and put its value inside the outcoming message
   u8bitsno = 0;
-  u8frameByte = 7;
+  u16frameByte = 7;
   for (u16currentCoil = 0; u16currentCoil < u16Coilno; u16currentCoil++)
   {
     u16coil = u16StartCoil + u16currentCoil;
-    u8currentRegister = (uint8_t) (u16coil / 16);
+    u16currentRegister = u16coil / 16;
     u8currentBit = (uint8_t) (u16coil % 16);
     
-    bTemp = bitRead(au8Buffer[ u8frameByte ], u8bitsno);
+    bTemp = bitRead(au8Buffer[ u16frameByte ], u8bitsno);
     
-    bitWrite( regs[ u8currentRegister ],
+    bitWrite( regs[ u16currentRegister ],
               u8currentBit,
               bTemp 
             );
@@ -1243,16 +2009,16 @@ int8_t Modbus::process_FC15( uint16_t *regs, uint8_t u8size )
     if(u8bitsno > 7)
     {
       u8bitsno = 0;
-      u8frameByte++;
+      u16frameByte++;
     }
   }
 
   // send outcoming message
   // it's just a copy of the incomping frame until 6th byte
-  u8BufferSize     = 6;
-  u8CopyBufferSize = u8BufferSize +2;
+  u16BufferSize     = 6;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
 }
 
 /**
@@ -1260,31 +2026,127 @@ int8_t Modbus::process_FC15( uint16_t *regs, uint8_t u8size )
  * This method processes function 16
  * This method writes a word array assigned by the master
  *
- * @return u8BufferSize Response to master length
+ * @return u16BufferSize Response to master length
  * @ingroup register
  */
-int8_t Modbus::process_FC16( uint16_t *regs, uint8_t u8size )
+int16_t Modbus::process_FC16( uint16_t *regs, uint16_t /* u16size: checked by validateRequest() */ )
 {
-  uint8_t u8func = au8Buffer[ FUNC ];  // get the original FUNC code
-  uint8_t u8StartAdd = au8Buffer[ ADD_HI ] << 8 | au8Buffer[ ADD_LO ];
-  uint8_t u8regsno = au8Buffer[ NB_HI ] << 8 | au8Buffer[ NB_LO ];
-  uint8_t u8CopyBufferSize;
-  uint8_t i;
+  uint16_t u16StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  uint16_t u16CopyBufferSize;
+  uint16_t i;
   uint16_t temp;
 
-  // build header
-  au8Buffer[ NB_HI ]   = 0;
-  au8Buffer[ NB_LO ]   = u8regsno;
-  u8BufferSize         = RESPONSE_SIZE;
+  // the answer echoes the header: address and quantity stay in place
+  u16BufferSize         = RESPONSE_SIZE;
 
   // write registers
-  for (i = 0; i < u8regsno; i++)
+  for (i = 0; i < u16regsno; i++)
   {
     temp = word(au8Buffer[ (BYTE_CNT + 1) + i * 2 ], au8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
-    regs[ u8StartAdd + i ] = temp;
+    regs[ u16StartAdd + i ] = temp;
   }
-  u8CopyBufferSize = u8BufferSize +2;
+  u16CopyBufferSize = u16BufferSize +2;
   sendTxBuffer();
   
-  return u8CopyBufferSize;
+  return u16CopyBufferSize;
+}
+
+/**
+ * @brief
+ * Finds the map block holding a register, by binary search.
+ *
+ * @return block, NULL if the address is not mapped
+ * @ingroup register
+ */
+const modbus_register_t *Modbus::findRegister(uint16_t u16address)
+{
+  uint8_t u8lo = 0, u8hi = u8mapSize;
+  while (u8lo < u8hi)
+  {
+    uint8_t u8mid = (u8lo + u8hi) / 2;
+    const modbus_register_t *block = &map[ u8mid ];
+    if (u16address < block->u16address) u8hi = u8mid;
+    else if ((uint32_t)u16address >= (uint32_t)block->u16address + block->u16count) u8lo = u8mid + 1;
+    else return block;
+  }
+  return NULL;
 }
+
+/**
+ * @brief
+ * Answers functions 3, 4, 6 and 16 from the register map.
+ * Every register of a write is checked before the first one is written.
+ *
+ * @return answer length, or the exception code sent
+ * @ingroup register
+ */
+int16_t Modbus::process_map()
+{
+  uint16_t u16StartAdd = word( au8Buffer[ ADD_HI ], au8Buffer[ ADD_LO ] );
+  uint16_t u16regsno = word( au8Buffer[ NB_HI ], au8Buffer[ NB_LO ] );
+  const modbus_register_t *block = NULL;
+  uint8_t u8exception = 0;
+  uint16_t i;
+
+  switch( au8Buffer[ FUNC ] )
+  {
+    case MB_FC_READ_INPUT_REGISTER:
+    case MB_FC_READ_REGISTERS :
+      au8Buffer[ 2 ] = u16regsno * 2;
+      u16BufferSize = 3;
+      for (i = 0; i < u16regsno; i++)
+      {
+        uint16_t u16add = u16StartAdd + i;
+        if ((i == 0) || (u16add >= block->u16address + block->u16count)) block = findRegister(u16add);
+        if ((block == NULL) || (u16add < u16StartAdd))
+        {
+          u8exception = EXC_ADDR_RANGE;
+          break;
+        }
+        uint16_t u16val = block->read(u16add - block->u16address);
+        au8Buffer[ u16BufferSize++ ] = highByte(u16val);
+        au8Buffer[ u16BufferSize++ ] = lowByte(u16val);
+      }
+    break;
+
+    case MB_FC_WRITE_REGISTER :
+      block = findRegister(u16StartAdd);
+      if ((block == NULL) || (block->write == NULL)) u8exception = EXC_ADDR_RANGE;
+      else if (!block->write(u16StartAdd - block->u16address, u16regsno)) u8exception = EXC_EXECUTE;
+      u16BufferSize = RESPONSE_SIZE;           // echo of the request
+    break;
+
+    case MB_FC_WRITE_MULTIPLE_REGISTERS :
+      for (i = 0; (i < u16regsno) && (u8exception == 0); i++)
+      {
+        uint16_t u16add = u16StartAdd + i;
+        if ((i == 0) || (u16add >= block->u16address + block->u16count)) block = findRegister(u16add);
+        if ((block == NULL) || (block->write == NULL) || (u16add < u16StartAdd)) u8exception = EXC_ADDR_RANGE;
+      }
+      for (i = 0; (i < u16regsno) && (u8exception == 0); i++)
+      {
+        uint16_t u16add = u16StartAdd + i;
+        if ((i == 0) || (u16add >= block->u16address + block->u16count)) block = findRegister(u16add);
+        uint16_t u16val = word(au8Buffer[ (BYTE_CNT + 1) + i * 2 ], au8Buffer[ (BYTE_CNT + 2) + i * 2 ]);
+        if (!block->write(u16add - block->u16address, u16val)) u8exception = EXC_EXECUTE;
+      }
+      u16BufferSize = RESPONSE_SIZE;           // echo of address and quantity
+    break;
+
+    default:
+      u8exception = EXC_FUNC_CODE;
+    break;
+  }
+
+  if (u8exception != 0)
+  {
+    buildException( u8exception );
+    u8lastError = u8exception;
+  }
+  uint16_t u16CopyBufferSize = u16BufferSize + 2;
+  sendTxBuffer();
+  return (u8exception != 0) ? u8exception : u16CopyBufferSize;
+}
+
+#endif // ETT_MODBUSRTU_H
@@ -0,0 +1,269 @@
+/**
+ * @file LightSensor.h
+ * @brief
+ * Non-blocking BH1750 driver with automatic range selection.
+ *
+ * poll() runs a small state machine: it starts a one-time conversion,
+ * returns, and reads the result only once the conversion time for the
+ * current mode and MTreg has elapsed. Between conversions the sensor
+ * powers down by itself. The only bus traffic is one command to start a
+ * conversion and one 2-byte read per result.
+ *
+ * Three ranges are used:
+ * | range       | mode        | MTreg | lux/count | full scale  | conversion |
+ * |-------------|-------------|-------|-----------|-------------|------------|
+ * | LIGHT_DIM   | H-res mode2 | 254   | 0.11      | ~7 400 lux  | 663 ms     |
+ * | LIGHT_NORMAL| H-res       | 69    | 0.83      | ~54 600 lux | 180 ms     |
+ * | LIGHT_BRIGHT| H-res       | 31    | 1.86      | ~121 000 lux| 81 ms      |
+ * Conversion times are the datasheet maximum scaled by MTreg / 69.
+ * A reading above LIGHT_HIGH_COUNTS switches to the next less sensitive
+ * range. A level that the next more sensitive range would read as fewer
+ * than LIGHT_LOW_COUNTS switches to that range; the 2:1 gap between the
+ * two thresholds keeps the range from toggling. The reading that caused
+ * a switch is still used.
+ *
+ * @defgroup light Light sensor
+ */
+
+#ifndef LIGHT_SENSOR_H
+#define LIGHT_SENSOR_H
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#define BH1750_ADDRESS          0x23          //!< ADDR pin low (0x5C with ADDR high)
+#define BH1750_POWER_ON         0x01
+#define BH1750_ONE_TIME_HRES    0x20
+#define BH1750_ONE_TIME_HRES2   0x21
+#define BH1750_MTREG_HI         0x40          //!< | MTreg[7:5]
+#define BH1750_MTREG_LO         0x60          //!< | MTreg[4:0]
+#define BH1750_MTREG_DEFAULT    69
+#define BH1750_HRES_MAX_MS      180           //!< H-res conversion time at MTreg 69
+
+#define LIGHT_HIGH_COUNTS       60000         //!< near saturation: less sensitive range
+#define LIGHT_LOW_COUNTS        30000         //!< counts the more sensitive range would read
+#define LIGHT_RETRY_MS          1000          //!< wait after a bus error
+
+enum LIGHT_RANGES
+{
+  LIGHT_DIM                    = 0,
+  LIGHT_NORMAL                 = 1,
+  LIGHT_BRIGHT                 = 2
+};
+
+enum LIGHT_STATES
+{
+  LIGHT_IDLE                   = 0,           //!< next poll() starts a conversion
+  LIGHT_CONVERTING             = 1            //!< waiting for the conversion time
+};
+
+/**
+ * @class LightSensor
+ * @brief
+ * BH1750 ambient light sensor, one-time conversions driven by poll().
+ */
+class LightSensor
+{
+private:
+  TwoWire *wire;
+  uint8_t u8address;
+  uint8_t u8state;
+  uint8_t u8range;
+  uint8_t u8mtreg;                            //!< MTreg currently programmed in the sensor
+  uint32_t u32since;                          //!< millis() of the last trigger or error
+  uint32_t u32wait;                           //!< ms to wait from u32since
+  float fLux;
+  uint32_t u32count;
+  uint16_t u16errors;
+
+  boolean command(uint8_t u8command);
+  boolean trigger();
+  uint8_t rangeMtreg(uint8_t u8range);
+  float rangeScale(uint8_t u8range);
+
+public:
+  LightSensor(TwoWire &wire, uint8_t u8address = BH1750_ADDRESS);
+
+  boolean begin();                            //!<probe the sensor, start the first conversion
+  boolean poll();                             //!<cyclic call, true when a new value is available
+  float getLux();                             //!<latest value, lux
+  uint8_t getRange();                         //!<LIGHT_RANGES
+  uint32_t getCount();                        //!<values read so far
+  uint16_t getErrors();                       //!<bus errors so far
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param wire       I2C bus, already started
+ * @param u8address  BH1750_ADDRESS or 0x5C
+ * @ingroup light
+ */
+LightSensor::LightSensor(TwoWire &wire, uint8_t u8address)
+{
+  this->wire = &wire;
+  this->u8address = u8address;
+  u8state = LIGHT_IDLE;
+  u8range = LIGHT_NORMAL;
+  u8mtreg = BH1750_MTREG_DEFAULT;
+  u32since = 0;
+  u32wait = 0;
+  fLux = 0;
+  u32count = 0;
+  u16errors = 0;
+}
+
+/**
+ * @brief
+ * Checks that the sensor answers and starts the first conversion.
+ *
+ * @return false if the sensor does not acknowledge
+ * @ingroup light
+ */
+boolean LightSensor::begin()
+{
+  if (!command(BH1750_POWER_ON)) return false;
+  return trigger();
+}
+
+/**
+ * @brief
+ * Advances the acquisition by at most one step. Never waits.
+ *
+ * @return true if getLux() holds a new value
+ * @ingroup light
+ */
+boolean LightSensor::poll()
+{
+  if ((uint32_t)(millis() - u32since) < u32wait) return false;
+
+  if (u8state == LIGHT_IDLE)
+  {
+    trigger();
+    return false;
+  }
+
+  if (wire->requestFrom(u8address, (uint8_t)2) != 2)
+  {
+    u16errors++;
+    u8state = LIGHT_IDLE;
+    u32since = millis();
+    u32wait = LIGHT_RETRY_MS;
+    return false;
+  }
+  uint16_t u16counts = wire->read() << 8;
+  u16counts |= wire->read();
+
+  fLux = u16counts * rangeScale(u8range);
+  u32count++;
+
+  if ((u16counts > LIGHT_HIGH_COUNTS) && (u8range < LIGHT_BRIGHT)) u8range++;
+  else if ((u8range > LIGHT_DIM) && (fLux < LIGHT_LOW_COUNTS * rangeScale(u8range - 1))) u8range--;
+
+  u8state = LIGHT_IDLE;
+  trigger();
+  return true;
+}
+
+/**
+ * @brief
+ * @return latest light level in lux
+ * @ingroup light
+ */
+float LightSensor::getLux()
+{
+  return fLux;
+}
+
+/**
+ * @brief
+ * @return range of the conversion in progress, LIGHT_RANGES
+ * @ingroup light
+ */
+uint8_t LightSensor::getRange()
+{
+  return u8range;
+}
+
+/**
+ * @brief
+ * @return number of values read since begin()
+ * @ingroup light
+ */
+uint32_t LightSensor::getCount()
+{
+  return u32count;
+}
+
+/**
+ * @brief
+ * @return number of I2C transfers that failed
+ * @ingroup light
+ */
+uint16_t LightSensor::getErrors()
+{
+  return u16errors;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+boolean LightSensor::command(uint8_t u8command)
+{
+  wire->beginTransmission(u8address);
+  wire->write(u8command);
+  return wire->endTransmission() == 0;
+}
+
+/**
+ * @brief
+ * Programs MTreg if the range changed and starts a one-time conversion.
+ * On a bus error the next attempt is made after LIGHT_RETRY_MS.
+ */
+boolean LightSensor::trigger()
+{
+  uint8_t u8mtreg = rangeMtreg(u8range);
+  boolean bOk = true;
+  if (u8mtreg != this->u8mtreg)
+  {
+    bOk = command(BH1750_MTREG_HI | (u8mtreg >> 5)) && command(BH1750_MTREG_LO | (u8mtreg & 0x1F));
+    if (bOk) this->u8mtreg = u8mtreg;
+  }
+  if (bOk) bOk = command((u8range == LIGHT_DIM) ? BH1750_ONE_TIME_HRES2 : BH1750_ONE_TIME_HRES);
+
+  u32since = millis();
+  if (!bOk)
+  {
+    u16errors++;
+    u8state = LIGHT_IDLE;
+    u32wait = LIGHT_RETRY_MS;
+    return false;
+  }
+  u8state = LIGHT_CONVERTING;
+  u32wait = ((uint32_t)BH1750_HRES_MAX_MS * this->u8mtreg + BH1750_MTREG_DEFAULT - 1) / BH1750_MTREG_DEFAULT;
+  return true;
+}
+
+/**
+ * @brief
+ * @return lux per count: 1 / 1.2 * (69 / MTreg), halved in H-res mode2
+ */
+float LightSensor::rangeScale(uint8_t u8range)
+{
+  float fScale = (float)BH1750_MTREG_DEFAULT / (1.2f * rangeMtreg(u8range));
+  return (u8range == LIGHT_DIM) ? fScale / 2 : fScale;
+}
+
+uint8_t LightSensor::rangeMtreg(uint8_t u8range)
+{
+  switch (u8range)
+  {
+    case LIGHT_DIM:    return 254;
+    case LIGHT_BRIGHT: return 31;
+    default:           return BH1750_MTREG_DEFAULT;
+  }
+}
+
+#endif // LIGHT_SENSOR_H
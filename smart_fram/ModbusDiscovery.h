@@ -0,0 +1,460 @@
+/**
+ * @file ModbusDiscovery.h
+ * @brief
+ * Finds the slaves on the bus and tells their types apart.
+ *
+ * A scan probes slave ids 1..247 one transaction at a time, between the
+ * telegrams of the other users of the master (ModbusScheduler,
+ * ModbusGateway): it only queries when the master is idle, and leaves
+ * DISCOVERY_GAP ms of bus time after each probe. Normal polling goes on
+ * during a scan, only slower.
+ *
+ * Ids of the previous map are probed first, with the master's normal
+ * time-out, so that a rescan confirms the known slaves early. Every other
+ * id gets a short time-out that adapts to the slowest answer seen so far,
+ * between DISCOVERY_TIMEOUT_MIN and DISCOVERY_TIMEOUT_MAX. The scan stops
+ * early once setExpected() slaves have been found, and aborts after
+ * DISCOVERY_ERRORS_MAX corrupt answers in a row (noise, a wrong baud rate
+ * or two slaves with the same id), keeping the previous map.
+ *
+ * A known slave that does not answer is probed once more after the range,
+ * and stays in the map until it has missed DISCOVERY_MISSES_MAX scans in a
+ * row (u8missed), so one lost answer does not drop a device and stop its
+ * polling. A known id the scan did not get to (early stop) keeps its count.
+ *
+ * Fingerprint: a slave that answers, even with an exception, is present.
+ * Its type is the first of the caller's probes (function, address, count)
+ * that it answers without an exception, so list the most specific
+ * register blocks first. The first probe doubles as the presence probe.
+ * A slave that answers none of them is kept as DISCOVERY_UNKNOWN.
+ *
+ * The resulting discovery_map_t is a plain struct, sorted by id, meant to
+ * be stored as it is (e.g. NVS) and passed back to start() on the next boot.
+ *
+ * @defgroup discovery Modbus bus discovery
+ */
+
+#ifndef MODBUS_DISCOVERY_H
+#define MODBUS_DISCOVERY_H
+
+#include "ETT_ModbusRTU.h"
+
+#define DISCOVERY_ID_MAX        247           //!< highest slave address
+#define DISCOVERY_DEVICES_MAX   16            //!< slaves one map holds
+#define DISCOVERY_REGS_MAX      8             //!< registers one probe reads, longer probes are cut
+#define DISCOVERY_UNKNOWN       0xFF          //!< type of a slave that matched no probe
+#define DISCOVERY_TIMEOUT_MIN   20            //!< ms, shortest time-out for an unknown id
+#define DISCOVERY_TIMEOUT_MAX   100           //!< ms, time-out for an unknown id until a slave answered
+#define DISCOVERY_GAP           20            //!< ms of bus time left to the other users after each probe
+#define DISCOVERY_ERRORS_MAX    5             //!< corrupt answers in a row that abort a scan
+#define DISCOVERY_MISSES_MAX    3             //!< scans in a row a known slave may miss before it is dropped
+
+/**
+ * @enum DISCOVERY_STATES
+ * @brief
+ * Scan state, see getState().
+ */
+enum DISCOVERY_STATES
+{
+  DISC_IDLE = 0,                              //!< no scan started
+  DISC_SCANNING,
+  DISC_DONE,                                  //!< getMap() holds the result
+  DISC_ABORTED                                //!< abort() or too many corrupt answers
+};
+
+/**
+ * @struct discovery_probe_t
+ * @brief
+ * Register block that identifies one device type.
+ */
+typedef struct
+{
+  uint8_t u8fct;                              /*!< MB_FC_READ_REGISTERS or MB_FC_READ_INPUT_REGISTER */
+  uint16_t u16address;
+  uint16_t u16count;                          /*!< at most DISCOVERY_REGS_MAX */
+}
+discovery_probe_t;
+
+/**
+ * @struct discovery_device_t
+ * @brief
+ * One slave found on the bus.
+ */
+typedef struct
+{
+  uint8_t u8id;
+  uint8_t u8type;                             /*!< index of the matching probe, or DISCOVERY_UNKNOWN */
+  uint8_t u8missed;                           /*!< scans in a row without an answer, 0 = answered the last one */
+}
+discovery_device_t;
+
+/**
+ * @struct discovery_map_t
+ * @brief
+ * Slaves found by a scan, sorted by id. Unused entries are zero.
+ */
+typedef struct
+{
+  uint8_t u8count;
+  discovery_device_t aDevices[ DISCOVERY_DEVICES_MAX ];
+}
+discovery_map_t;
+
+/**
+ * @class ModbusDiscovery
+ * @brief
+ * Background scan of the bus through a shared Modbus master.
+ */
+class ModbusDiscovery
+{
+private:
+  Modbus *master;
+  const discovery_probe_t *probes;
+  uint8_t u8probes;
+  discovery_map_t known;                      //!< previous map, probed first
+  discovery_map_t found;                      //!< scan in progress
+  discovery_map_t result;                     //!< last completed scan
+  uint8_t u8state;
+  uint8_t u8expected;
+  uint8_t u8knownNext;                        //!< next entry of known to probe
+  uint8_t u8scanNext;                         //!< next id of the full range to probe
+  uint8_t u8retryNext;                        //!< next entry of known to probe again if it has not answered
+  uint8_t u8id;                               //!< slave being probed, 0 = pick the next one
+  uint8_t u8probe;                            //!< probe being tried on u8id
+  uint8_t u8errors;
+  boolean bActive;                            //!< a probe is on the bus
+  uint16_t u16timeOut;                        //!< adaptive time-out for unknown ids
+  uint16_t u16saved;                          //!< master time-out to restore
+  uint32_t u32rttMax;
+  uint32_t u32sent, u32idle;
+  uint16_t u16inCnt;                          //!< master's frame counter when the probe was sent
+  uint8_t u8probed;
+  uint16_t au16scratch[ DISCOVERY_REGS_MAX ];
+
+  boolean isKnown(uint8_t u8id);
+  boolean isFound(uint8_t u8id);
+  uint8_t nextId();
+  void classify(uint8_t u8error);
+  void add(uint8_t u8type);
+  void insert(uint8_t u8slave, uint8_t u8type, uint8_t u8missed);
+  void finish();
+
+public:
+  ModbusDiscovery(Modbus &master, const discovery_probe_t *probes, uint8_t u8probes);
+
+  void setExpected(uint8_t u8expected);       //!<stop once this many slaves answered, 0 = scan every id
+  void start(const discovery_map_t *known);   //!<start a scan, known = previous map or NULL
+  void abort();
+  boolean poll();                             //!<cyclic call after the other users of the master
+  uint8_t getState();
+  uint8_t getProbed();                        //!<ids probed so far
+  const discovery_map_t &getMap();            //!<result of the last completed scan
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param master    Modbus object in master mode (id 0), may be shared
+ * @param probes    one register block per device type, most specific first; must outlive the object
+ * @param u8probes  number of probes, at least 1
+ * @ingroup discovery
+ */
+ModbusDiscovery::ModbusDiscovery(Modbus &master, const discovery_probe_t *probes, uint8_t u8probes)
+{
+  this->master = &master;
+  this->probes = probes;
+  this->u8probes = u8probes;
+  memset(&known, 0, sizeof(known));
+  memset(&found, 0, sizeof(found));
+  memset(&result, 0, sizeof(result));
+  u8state = DISC_IDLE;
+  u8expected = 0;
+  bActive = false;
+  u8probed = 0;
+}
+
+/**
+ * @brief
+ * Ends a scan as soon as this many slaves have been found, for an
+ * installation whose size is known.
+ *
+ * @ingroup discovery
+ */
+void ModbusDiscovery::setExpected(uint8_t u8expected)
+{
+  this->u8expected = u8expected;
+}
+
+/**
+ * @brief
+ * Starts a scan. A scan in progress starts over.
+ *
+ * @param known  map of the previous scan, its ids are probed first; NULL if none
+ * @ingroup discovery
+ */
+void ModbusDiscovery::start(const discovery_map_t *known)
+{
+  if (known != NULL) this->known = *known;
+  else memset(&this->known, 0, sizeof(this->known));
+  memset(&found, 0, sizeof(found));
+  u8knownNext = 0;
+  u8scanNext = 1;
+  u8retryNext = 0;
+  u8id = 0;
+  u8probe = 0;
+  u8errors = 0;
+  u8probed = 0;
+  u16timeOut = DISCOVERY_TIMEOUT_MAX;
+  u32rttMax = 0;
+  u32idle = millis() - DISCOVERY_GAP;
+  u8state = (u8probes > 0) ? DISC_SCANNING : DISC_ABORTED;
+}
+
+/**
+ * @brief
+ * Stops the scan after the probe on the bus, if any. getMap() keeps the
+ * result of the last completed scan.
+ *
+ * @ingroup discovery
+ */
+void ModbusDiscovery::abort()
+{
+  if (u8state == DISC_SCANNING) u8state = DISC_ABORTED;
+}
+
+/**
+ * @brief
+ * Cyclic scan step. Call it after the other users of the master
+ * (ModbusScheduler::poll(), ModbusGateway::poll()): it only starts a probe
+ * when they left the master idle.
+ *
+ * @return true once, when a scan has completed and getMap() holds its result
+ * @ingroup discovery
+ */
+boolean ModbusDiscovery::poll()
+{
+  if (bActive)
+  {
+    master->poll();
+    if (master->getState() != COM_IDLE) return false;
+
+    bActive = false;
+    master->setTimeOut(u16saved);
+    u32idle = millis();
+    if ((u8state == DISC_SCANNING) && (u8id != 0)) classify(master->getLastError());   // dropped after abort() or start()
+
+    if ((u8state == DISC_SCANNING) && (u8expected > 0) && (found.u8count >= u8expected))
+    {
+      finish();
+      return true;
+    }
+  }
+
+  if (u8state != DISC_SCANNING) return false;
+  if (master->getState() != COM_IDLE) return false;
+  if ((unsigned long)(millis() - u32idle) < (unsigned long)DISCOVERY_GAP) return false;
+
+  if (u8id == 0)
+  {
+    u8id = nextId();
+    u8probe = 0;
+    if (u8id == 0)
+    {
+      finish();
+      return true;
+    }
+    u8probed++;
+  }
+
+  const discovery_probe_t *probe = &probes[ u8probe ];
+  modbus_t telegram;
+  telegram.u8id = u8id;
+  telegram.u8fct = probe->u8fct;
+  telegram.u16RegAdd = probe->u16address;
+  telegram.u16CoilsNo = min(probe->u16count, (uint16_t)DISCOVERY_REGS_MAX);
+  telegram.au16reg = au16scratch;
+
+  u16saved = master->getTimeOut();
+  if (!isKnown(u8id)) master->setTimeOut(u16timeOut);
+  if (master->query(telegram) != 0)
+  {
+    master->setTimeOut(u16saved);
+    return false;
+  }
+  bActive = true;
+  u32sent = millis();
+  u16inCnt = master->getInCnt();
+  return false;
+}
+
+/**
+ * @brief
+ * @return DISCOVERY_STATES value
+ * @ingroup discovery
+ */
+uint8_t ModbusDiscovery::getState()
+{
+  return u8state;
+}
+
+/**
+ * @brief
+ * @return ids probed by the current or last scan
+ * @ingroup discovery
+ */
+uint8_t ModbusDiscovery::getProbed()
+{
+  return u8probed;
+}
+
+/**
+ * @brief
+ * @return slaves found by the last completed scan
+ * @ingroup discovery
+ */
+const discovery_map_t &ModbusDiscovery::getMap()
+{
+  return result;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+boolean ModbusDiscovery::isKnown(uint8_t u8id)
+{
+  for (uint8_t i = 0; i < known.u8count; i++)
+  {
+    if (known.aDevices[ i ].u8id == u8id) return true;
+  }
+  return false;
+}
+
+boolean ModbusDiscovery::isFound(uint8_t u8id)
+{
+  for (uint8_t i = 0; i < found.u8count; i++)
+  {
+    if (found.aDevices[ i ].u8id == u8id) return true;
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * Ids of the previous map first, then the rest of 1..247, then once more
+ * the ids of the previous map that have not answered.
+ *
+ * @return next id to probe, 0 at the end of the scan
+ */
+uint8_t ModbusDiscovery::nextId()
+{
+  if (u8knownNext < known.u8count) return known.aDevices[ u8knownNext++ ].u8id;
+  while ((u8scanNext > 0) && (u8scanNext <= DISCOVERY_ID_MAX))
+  {
+    uint8_t u8next = u8scanNext++;
+    if (!isKnown(u8next)) return u8next;
+  }
+  while (u8retryNext < known.u8count)
+  {
+    uint8_t u8next = known.aDevices[ u8retryNext++ ].u8id;
+    if (!isFound(u8next)) return u8next;
+  }
+  return 0;
+}
+
+/**
+ * @brief
+ * Records the slave being probed and moves on to the next id.
+ */
+void ModbusDiscovery::add(uint8_t u8type)
+{
+  insert(u8id, u8type, 0);
+  u8id = 0;
+}
+
+/**
+ * @brief
+ * Adds a slave to the scan's map, in id order, if there is room.
+ */
+void ModbusDiscovery::insert(uint8_t u8slave, uint8_t u8type, uint8_t u8missed)
+{
+  if (found.u8count >= DISCOVERY_DEVICES_MAX) return;
+  uint8_t i = found.u8count++;
+  while ((i > 0) && (found.aDevices[ i - 1 ].u8id > u8slave))
+  {
+    found.aDevices[ i ] = found.aDevices[ i - 1 ];
+    i--;
+  }
+  found.aDevices[ i ].u8id = u8slave;
+  found.aDevices[ i ].u8type = u8type;
+  found.aDevices[ i ].u8missed = u8missed;
+}
+
+/**
+ * @brief
+ * Takes the outcome of the probe sent to u8id.
+ */
+void ModbusDiscovery::classify(uint8_t u8error)
+{
+  if ((u8error == 0) || (u8error == (uint8_t)ERR_EXCEPTION))
+  {
+    u8errors = 0;
+    if (!isKnown(u8id))
+    {
+      // a slave answered: unknown ids wait twice the slowest answer seen so far
+      u32rttMax = max(u32rttMax, (uint32_t)(u32idle - u32sent));
+      u16timeOut = constrain(2 * u32rttMax, DISCOVERY_TIMEOUT_MIN, DISCOVERY_TIMEOUT_MAX);
+    }
+    if (u8error == 0) add(u8probe);
+    else if (++u8probe >= u8probes) add(DISCOVERY_UNKNOWN);
+  }
+  else if ((u8error == NO_REPLY) && (master->getInCnt() == u16inCnt))
+  {
+    u8errors = 0;
+    if (u8probe == 0) u8id = 0;             // nobody there
+    else if (++u8probe >= u8probes) add(DISCOVERY_UNKNOWN);
+  }
+  else if (++u8errors >= DISCOVERY_ERRORS_MAX)   // bad CRC is NO_REPLY too, but a frame came in
+  {
+    u8state = DISC_ABORTED;                 // the same probe is sent again otherwise
+  }
+}
+
+/**
+ * @brief
+ * Carries the known slaves that did not answer into the result, until
+ * they have missed DISCOVERY_MISSES_MAX scans.
+ */
+void ModbusDiscovery::finish()
+{
+  for (uint8_t i = 0; i < known.u8count; i++)
+  {
+    const discovery_device_t *device = &known.aDevices[ i ];
+    if (isFound(device->u8id)) continue;
+    boolean bProbed = (i < u8knownNext);      // an early stop may not have reached it
+    uint8_t u8missed = bProbed ? device->u8missed + 1 : device->u8missed;
+    if (u8missed < DISCOVERY_MISSES_MAX) insert(device->u8id, device->u8type, u8missed);
+  }
+  result = found;
+  u8state = DISC_DONE;
+  u8id = 0;
+}
+
+/* _____HELPERS_______________________________________________________________ */
+
+/**
+ * @brief
+ * @return id of the first slave of a type in a map, 0 if there is none
+ * @ingroup discovery
+ */
+uint8_t discoveryFind(const discovery_map_t &map, uint8_t u8type)
+{
+  for (uint8_t i = 0; i < map.u8count; i++)
+  {
+    if (map.aDevices[ i ].u8type == u8type) return map.aDevices[ i ].u8id;
+  }
+  return 0;
+}
+
+#endif // MODBUS_DISCOVERY_H
@@ -0,0 +1,844 @@
+/**
+ * @file ModbusGateway.h
+ * @brief
+ * Modbus TCP (MBAP) server that forwards requests to the RTU bus.
+ *
+ * The work is split between the two tasks that already own each side:
+ *
+ * - ModbusTcpServer runs in the network task. It accepts up to
+ *   GATEWAY_CLIENTS connections, frames MBAP requests, checks them and
+ *   places each one in a free request slot. When the slot has been
+ *   answered, it writes the MBAP response back to the client.
+ * - ModbusGateway runs in the task that owns the Modbus master, after
+ *   ModbusScheduler::poll(). It only starts a transaction when the master
+ *   is idle, so periodic telegrams and gateway requests share the bus one
+ *   transaction at a time.
+ *
+ * A slot changes owner through its atomic state, FREE -> QUEUED (network
+ * side) -> ACTIVE -> DONE (bus side) -> FREE (network side). The fields
+ * are only touched by the side that owns the current state, so no lock is
+ * needed.
+ *
+ * Fairness: the next request comes from the next client, round robin,
+ * oldest first, and a client may have at most GATEWAY_PER_CLIENT requests
+ * in flight. A busy HMI cannot starve another.
+ *
+ * Coalescing: when an FC3/FC4 read starts, every queued read of the same
+ * unit and function that overlaps or touches it joins the transaction, as
+ * long as the union fits one answer. Several HMIs polling the same values
+ * cost one bus transaction.
+ *
+ * Cache: the answer of each read is kept for GATEWAY_CACHE_TTL ms. A read
+ * that lies within a cached block is answered without touching the bus.
+ * Any write to a unit drops its cached blocks.
+ *
+ * Only register functions are forwarded (FC3, FC4, FC6, FC16). Unit 0
+ * (broadcast) and 255 answer EXC_GATEWAY_PATH, a missing or corrupt RTU
+ * answer EXC_GATEWAY_TARGET, and an RTU exception is passed through.
+ *
+ * @defgroup gateway Modbus TCP gateway
+ */
+
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include <atomic>
+#include "ETT_ModbusRTU.h"
+
+#define GATEWAY_CLIENTS         4             //!< TCP connections served at once
+#define GATEWAY_PER_CLIENT      2             //!< requests one connection may have in flight
+#define GATEWAY_SLOTS           (GATEWAY_CLIENTS * GATEWAY_PER_CLIENT)
+#define GATEWAY_CACHE           4             //!< cached read blocks
+#define GATEWAY_CACHE_TTL       250           //!< ms a cached read stays valid
+#define GATEWAY_IDLE_TIMEOUT    60000         //!< ms without a request before a connection is closed
+#define GATEWAY_READ_MAX        ((MAX_BUFFER - 5) / 2 < MAX_READ_REGS ? (MAX_BUFFER - 5) / 2 : MAX_READ_REGS)
+#define GATEWAY_WRITE_MAX       ((MAX_BUFFER - 9) / 2 < MAX_WRITE_REGS ? (MAX_BUFFER - 9) / 2 : MAX_WRITE_REGS)
+
+#define MBAP_HEADER             7             //!< transaction, protocol, length, unit
+#define MBAP_MAX                (MBAP_HEADER + 253) //!< header + largest PDU
+
+#define EXC_GATEWAY_PATH        0x0A          //!< gateway path unavailable
+#define EXC_GATEWAY_TARGET      0x0B          //!< gateway target device failed to respond
+
+/**
+ * @enum GATEWAY_STATES
+ * @brief
+ * Owner of a request slot.
+ */
+enum GATEWAY_STATES
+{
+  GW_FREE = 0,                                //!< network side, unused
+  GW_QUEUED,                                  //!< bus side, waiting for the bus
+  GW_ACTIVE,                                  //!< bus side, in the transaction on the bus
+  GW_DONE                                     //!< network side, answer ready
+};
+
+/**
+ * @struct gateway_slot_t
+ * @brief
+ * One forwarded request and its answer.
+ */
+typedef struct
+{
+  std::atomic<uint8_t> u8state;               /*!< GATEWAY_STATES */
+  uint8_t u8client;                           /*!< connection index */
+  uint8_t u8generation;                       /*!< connection generation, stale answers are dropped */
+  uint16_t u16transaction;                    /*!< MBAP transaction identifier */
+  uint32_t u32seq;                            /*!< arrival order */
+  uint8_t u8unit;                             /*!< RTU slave address */
+  uint8_t u8fct;
+  uint16_t u16address;
+  uint16_t u16count;                          /*!< registers, 1 for FC6 */
+  uint8_t u8exception;                        /*!< 0 = OK, else exception code of the answer */
+  uint16_t au16data[ MAX_READ_REGS ];         /*!< values written, or values read */
+}
+gateway_slot_t;
+
+/**
+ * @struct gateway_cache_t
+ * @brief
+ * Answer of a recent read.
+ */
+typedef struct
+{
+  boolean bValid;
+  uint8_t u8unit;
+  uint8_t u8fct;
+  uint16_t u16address;
+  uint16_t u16count;
+  uint32_t u32time;                           /*!< millis() of the answer */
+  uint16_t au16data[ GATEWAY_READ_MAX ];
+}
+gateway_cache_t;
+
+/**
+ * @class ModbusGateway
+ * @brief
+ * Request slots, and the bus side of the gateway.
+ */
+class ModbusGateway
+{
+private:
+  Modbus *master;
+  gateway_slot_t aSlots[ GATEWAY_SLOTS ];
+  gateway_cache_t aCache[ GATEWAY_CACHE ];
+  uint16_t u16cacheTtl;
+  void (*notify)(void);
+  boolean bActive;                            //!< a gateway transaction is on the bus
+  uint8_t u8nextClient;                       //!< round robin position
+  uint8_t u8blockUnit, u8blockFct;            //!< transaction in flight
+  uint16_t u16blockAddress, u16blockCount;
+  uint16_t au16scratch[ GATEWAY_READ_MAX ];   //!< answer of the read in flight
+  uint32_t u32transactions, u32coalesced, u32cacheHits;
+
+  static boolean isRead(uint8_t u8fct);
+  gateway_slot_t *pickNext();
+  boolean serveCached(gateway_slot_t *slot);
+  void start(gateway_slot_t *slot);
+  void finish();
+  void complete(uint8_t u8exception);
+  void store();
+  void invalidate(uint8_t u8unit);
+
+public:
+  ModbusGateway(Modbus &master);
+
+  void setCacheTtl(uint16_t u16cacheTtl);     //!<ms a read is served from the cache, 0 = off
+  void setNotify(void (*notify)(void));       //!<called when a request is queued, e.g. to wake the bus task
+  boolean poll();                             //!<bus side: cyclic call after ModbusScheduler::poll()
+
+  gateway_slot_t *acquire();                  //!<network side: free slot, NULL if none
+  void submit(gateway_slot_t *slot);          //!<network side: hand a filled slot to the bus side
+  gateway_slot_t *getSlot(uint8_t u8slot);
+
+  uint32_t getTransactions();                 //!<RTU transactions started by the gateway
+  uint32_t getCoalesced();                    //!<requests that joined another's transaction
+  uint32_t getCacheHits();                    //!<requests answered from the cache
+};
+
+/**
+ * @class ModbusTcpServer
+ * @brief
+ * Network side of the gateway: MBAP framing over CLIENT connections.
+ *
+ * CLIENT is WiFiClient on the ESP32, or any class with connected(),
+ * available(), read(buf, size), write(buf, size), stop() and copy
+ * assignment, e.g. a socket wrapper when testing on a PC.
+ */
+template <class CLIENT>
+class ModbusTcpServer
+{
+private:
+  ModbusGateway *gateway;
+  CLIENT aClients[ GATEWAY_CLIENTS ];
+  boolean abOpen[ GATEWAY_CLIENTS ];
+  uint8_t au8generation[ GATEWAY_CLIENTS ];
+  uint32_t au32lastRequest[ GATEWAY_CLIENTS ];
+  uint8_t au8rx[ GATEWAY_CLIENTS ][ MBAP_MAX ];
+  uint16_t au16rx[ GATEWAY_CLIENTS ];
+  uint32_t u32seq;
+
+  void close(uint8_t u8client);
+  uint8_t inFlight(uint8_t u8client);
+  void receive(uint8_t u8client);
+  uint8_t decode(const uint8_t *au8frame, uint16_t u16length, gateway_slot_t *slot);
+  void reply(gateway_slot_t *slot);
+  void replyException(uint8_t u8client, const uint8_t *au8request, uint8_t u8exception);
+
+public:
+  ModbusTcpServer(ModbusGateway &gateway);
+
+  boolean attach(const CLIENT &client);       //!<take an accepted connection, false if all are in use
+  void poll();                                //!<network side: cyclic call
+  uint8_t getClientCount();                   //!<open connections
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param master  Modbus object in master mode (id 0), shared with ModbusScheduler
+ * @ingroup gateway
+ */
+ModbusGateway::ModbusGateway(Modbus &master)
+{
+  this->master = &master;
+  u16cacheTtl = GATEWAY_CACHE_TTL;
+  notify = NULL;
+  bActive = false;
+  u8nextClient = 0;
+  u8blockUnit = u8blockFct = 0;
+  u16blockAddress = u16blockCount = 0;
+  u32transactions = u32coalesced = u32cacheHits = 0;
+  for (uint8_t i = 0; i < GATEWAY_SLOTS; i++) aSlots[ i ].u8state.store(GW_FREE);
+  for (uint8_t i = 0; i < GATEWAY_CACHE; i++) aCache[ i ].bValid = false;
+}
+
+/**
+ * @brief
+ * Sets how long the answer of a read may be reused.
+ *
+ * @ingroup gateway
+ */
+void ModbusGateway::setCacheTtl(uint16_t u16cacheTtl)
+{
+  this->u16cacheTtl = u16cacheTtl;
+}
+
+/**
+ * @brief
+ * Sets a function called from submit(), in the network task.
+ *
+ * @ingroup gateway
+ */
+void ModbusGateway::setNotify(void (*notify)(void))
+{
+  this->notify = notify;
+}
+
+/**
+ * @brief
+ * Bus side. Finishes the gateway transaction in flight, answers queued
+ * reads from the cache, and starts the next transaction when the master
+ * is idle. Call it right after ModbusScheduler::poll(): a scheduler
+ * transaction that ended in that call has then been collected, and a
+ * master that is not idle belongs to the scheduler.
+ *
+ * @return true while a gateway transaction is on the bus
+ * @ingroup gateway
+ */
+boolean ModbusGateway::poll()
+{
+  if (bActive)
+  {
+    master->poll();
+    if (master->getState() != COM_IDLE) return true;
+    finish();
+  }
+  if (master->getState() != COM_IDLE) return false;
+
+  gateway_slot_t *slot;
+  while ((slot = pickNext()) != NULL)
+  {
+    if (!serveCached(slot)) break;
+  }
+  if (slot == NULL) return false;
+
+  start(slot);
+  return bActive;
+}
+
+/**
+ * @brief
+ * Network side: finds a free slot to fill.
+ *
+ * @return slot, NULL if all are in use
+ * @ingroup gateway
+ */
+gateway_slot_t *ModbusGateway::acquire()
+{
+  for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+  {
+    if (aSlots[ i ].u8state.load(std::memory_order_acquire) == GW_FREE) return &aSlots[ i ];
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * Network side: queues a slot returned by acquire() and filled in.
+ *
+ * @ingroup gateway
+ */
+void ModbusGateway::submit(gateway_slot_t *slot)
+{
+  slot->u8state.store(GW_QUEUED, std::memory_order_release);
+  if (notify != NULL) notify();
+}
+
+/**
+ * @brief
+ * @return slot u8slot, NULL if out of range
+ * @ingroup gateway
+ */
+gateway_slot_t *ModbusGateway::getSlot(uint8_t u8slot)
+{
+  return (u8slot < GATEWAY_SLOTS) ? &aSlots[ u8slot ] : NULL;
+}
+
+/**
+ * @brief
+ * @return RTU transactions started by the gateway
+ * @ingroup gateway
+ */
+uint32_t ModbusGateway::getTransactions()
+{
+  return u32transactions;
+}
+
+/**
+ * @brief
+ * @return requests answered by a transaction started for another request
+ * @ingroup gateway
+ */
+uint32_t ModbusGateway::getCoalesced()
+{
+  return u32coalesced;
+}
+
+/**
+ * @brief
+ * @return requests answered from the cache
+ * @ingroup gateway
+ */
+uint32_t ModbusGateway::getCacheHits()
+{
+  return u32cacheHits;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+boolean ModbusGateway::isRead(uint8_t u8fct)
+{
+  return (u8fct == MB_FC_READ_REGISTERS) || (u8fct == MB_FC_READ_INPUT_REGISTER);
+}
+
+/**
+ * @brief
+ * Oldest queued request of the next client that has one, round robin.
+ */
+gateway_slot_t *ModbusGateway::pickNext()
+{
+  for (uint8_t n = 0; n < GATEWAY_CLIENTS; n++)
+  {
+    uint8_t u8client = (u8nextClient + n) % GATEWAY_CLIENTS;
+    gateway_slot_t *oldest = NULL;
+    for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+    {
+      gateway_slot_t *slot = &aSlots[ i ];
+      if (slot->u8state.load(std::memory_order_acquire) != GW_QUEUED) continue;
+      if (slot->u8client != u8client) continue;
+      if ((oldest == NULL) || ((int32_t)(slot->u32seq - oldest->u32seq) < 0)) oldest = slot;
+    }
+    if (oldest != NULL)
+    {
+      u8nextClient = (u8client + 1) % GATEWAY_CLIENTS;
+      return oldest;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * Answers a read that lies within a fresh cached block.
+ *
+ * @return true if the slot has been answered
+ */
+boolean ModbusGateway::serveCached(gateway_slot_t *slot)
+{
+  if (!isRead(slot->u8fct) || (u16cacheTtl == 0)) return false;
+
+  uint32_t u32now = millis();
+  for (uint8_t i = 0; i < GATEWAY_CACHE; i++)
+  {
+    gateway_cache_t *entry = &aCache[ i ];
+    if (!entry->bValid || (entry->u8unit != slot->u8unit) || (entry->u8fct != slot->u8fct)) continue;
+    if ((unsigned long)(u32now - entry->u32time) >= (unsigned long)u16cacheTtl) continue;
+    if (slot->u16address < entry->u16address) continue;
+    if ((uint32_t)slot->u16address + slot->u16count > (uint32_t)entry->u16address + entry->u16count) continue;
+
+    memcpy(slot->au16data, &entry->au16data[ slot->u16address - entry->u16address ], slot->u16count * sizeof(uint16_t));
+    slot->u8exception = 0;
+    slot->u8state.store(GW_DONE, std::memory_order_release);
+    u32cacheHits++;
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * Sends the request of a slot. A read takes along every queued read of
+ * the same unit and function that overlaps or touches it.
+ */
+void ModbusGateway::start(gateway_slot_t *slot)
+{
+  modbus_t telegram;
+  telegram.u8id = slot->u8unit;
+  telegram.u8fct = slot->u8fct;
+  slot->u8state.store(GW_ACTIVE, std::memory_order_relaxed);
+
+  if (isRead(slot->u8fct))
+  {
+    uint32_t u32start = slot->u16address;
+    uint32_t u32end = u32start + slot->u16count;   // first register past the block
+    boolean bGrown = true;
+    while (bGrown)
+    {
+      bGrown = false;
+      for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+      {
+        gateway_slot_t *other = &aSlots[ i ];
+        if (other->u8state.load(std::memory_order_acquire) != GW_QUEUED) continue;
+        if ((other->u8unit != slot->u8unit) || (other->u8fct != slot->u8fct)) continue;
+        uint32_t u32otherEnd = (uint32_t)other->u16address + other->u16count;
+        if ((other->u16address > u32end) || (u32otherEnd < u32start)) continue;
+        uint32_t u32newStart = min(u32start, (uint32_t)other->u16address);
+        uint32_t u32newEnd = max(u32end, u32otherEnd);
+        if (u32newEnd - u32newStart > GATEWAY_READ_MAX) continue;
+
+        u32start = u32newStart;
+        u32end = u32newEnd;
+        other->u8state.store(GW_ACTIVE, std::memory_order_relaxed);
+        u32coalesced++;
+        bGrown = true;
+      }
+    }
+    telegram.u16RegAdd = u32start;
+    telegram.u16CoilsNo = u32end - u32start;
+    telegram.au16reg = au16scratch;
+  }
+  else
+  {
+    telegram.u16RegAdd = slot->u16address;
+    telegram.u16CoilsNo = slot->u16count;
+    telegram.au16reg = slot->au16data;
+  }
+
+  u8blockUnit = telegram.u8id;
+  u8blockFct = telegram.u8fct;
+  u16blockAddress = telegram.u16RegAdd;
+  u16blockCount = telegram.u16CoilsNo;
+  if (master->query(telegram) != 0)
+  {
+    complete(EXC_GATEWAY_PATH);
+    return;
+  }
+  bActive = true;
+  u32transactions++;
+}
+
+/**
+ * @brief
+ * Collects the answer of the gateway transaction, once the master is idle.
+ */
+void ModbusGateway::finish()
+{
+  bActive = false;
+  uint8_t u8error = master->getLastError();
+  uint8_t u8exception = 0;
+  if (u8error == (uint8_t)ERR_EXCEPTION) u8exception = master->getLastException();
+  else if (u8error != 0) u8exception = EXC_GATEWAY_TARGET;
+
+  if (!isRead(u8blockFct)) invalidate(u8blockUnit);   // even a timeout may have written
+  else if (u8exception == 0) store();
+  complete(u8exception);
+}
+
+/**
+ * @brief
+ * Answers every slot of the transaction in flight.
+ */
+void ModbusGateway::complete(uint8_t u8exception)
+{
+  for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+  {
+    gateway_slot_t *slot = &aSlots[ i ];
+    if (slot->u8state.load(std::memory_order_relaxed) != GW_ACTIVE) continue;
+    if ((u8exception == 0) && isRead(slot->u8fct))
+    {
+      memcpy(slot->au16data, &au16scratch[ slot->u16address - u16blockAddress ], slot->u16count * sizeof(uint16_t));
+    }
+    slot->u8exception = u8exception;
+    slot->u8state.store(GW_DONE, std::memory_order_release);
+  }
+}
+
+/**
+ * @brief
+ * Keeps the answer of the read in flight, replacing the same block or
+ * the oldest one.
+ */
+void ModbusGateway::store()
+{
+  if (u16cacheTtl == 0) return;
+
+  gateway_cache_t *entry = &aCache[ 0 ];
+  for (uint8_t i = 0; i < GATEWAY_CACHE; i++)
+  {
+    gateway_cache_t *candidate = &aCache[ i ];
+    if (!candidate->bValid ||
+        ((candidate->u8unit == u8blockUnit) && (candidate->u8fct == u8blockFct) &&
+         (candidate->u16address == u16blockAddress) && (candidate->u16count == u16blockCount)))
+    {
+      entry = candidate;
+      break;
+    }
+    if ((int32_t)(candidate->u32time - entry->u32time) < 0) entry = candidate;
+  }
+
+  entry->bValid = true;
+  entry->u8unit = u8blockUnit;
+  entry->u8fct = u8blockFct;
+  entry->u16address = u16blockAddress;
+  entry->u16count = u16blockCount;
+  entry->u32time = millis();
+  memcpy(entry->au16data, au16scratch, u16blockCount * sizeof(uint16_t));
+}
+
+/**
+ * @brief
+ * Drops the cached blocks of a unit.
+ */
+void ModbusGateway::invalidate(uint8_t u8unit)
+{
+  for (uint8_t i = 0; i < GATEWAY_CACHE; i++)
+  {
+    if (aCache[ i ].u8unit == u8unit) aCache[ i ].bValid = false;
+  }
+}
+
+/* _____TCP SERVER_____________________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param gateway  bus side that runs the requests
+ * @ingroup gateway
+ */
+template <class CLIENT>
+ModbusTcpServer<CLIENT>::ModbusTcpServer(ModbusGateway &gateway)
+{
+  this->gateway = &gateway;
+  u32seq = 0;
+  for (uint8_t i = 0; i < GATEWAY_CLIENTS; i++)
+  {
+    abOpen[ i ] = false;
+    au8generation[ i ] = 0;
+    au32lastRequest[ i ] = 0;
+    au16rx[ i ] = 0;
+  }
+}
+
+/**
+ * @brief
+ * Takes over a connection accepted by the listening server.
+ *
+ * @return false if GATEWAY_CLIENTS connections are open; the caller closes it
+ * @ingroup gateway
+ */
+template <class CLIENT>
+boolean ModbusTcpServer<CLIENT>::attach(const CLIENT &client)
+{
+  for (uint8_t i = 0; i < GATEWAY_CLIENTS; i++)
+  {
+    if (abOpen[ i ]) continue;
+    aClients[ i ] = client;
+    abOpen[ i ] = true;
+    au16rx[ i ] = 0;
+    au32lastRequest[ i ] = millis();
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * Network side. Sends the answers that are ready, reads and queues new
+ * requests, and closes connections that dropped or stayed idle.
+ *
+ * @ingroup gateway
+ */
+template <class CLIENT>
+void ModbusTcpServer<CLIENT>::poll()
+{
+  for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+  {
+    gateway_slot_t *slot = gateway->getSlot(i);
+    if (slot->u8state.load(std::memory_order_acquire) != GW_DONE) continue;
+    if (abOpen[ slot->u8client ] && (slot->u8generation == au8generation[ slot->u8client ])) reply(slot);
+    slot->u8state.store(GW_FREE, std::memory_order_release);
+  }
+
+  for (uint8_t i = 0; i < GATEWAY_CLIENTS; i++)
+  {
+    if (!abOpen[ i ]) continue;
+    if (!aClients[ i ].connected() ||
+        ((unsigned long)(millis() - au32lastRequest[ i ]) > (unsigned long)GATEWAY_IDLE_TIMEOUT))
+    {
+      close(i);
+      continue;
+    }
+    receive(i);
+  }
+}
+
+/**
+ * @brief
+ * @return open connections
+ * @ingroup gateway
+ */
+template <class CLIENT>
+uint8_t ModbusTcpServer<CLIENT>::getClientCount()
+{
+  uint8_t u8count = 0;
+  for (uint8_t i = 0; i < GATEWAY_CLIENTS; i++)
+  {
+    if (abOpen[ i ]) u8count++;
+  }
+  return u8count;
+}
+
+/**
+ * @brief
+ * Closes a connection. Its requests still on the bus are answered into
+ * the void: the new generation no longer matches them.
+ */
+template <class CLIENT>
+void ModbusTcpServer<CLIENT>::close(uint8_t u8client)
+{
+  aClients[ u8client ].stop();
+  abOpen[ u8client ] = false;
+  au16rx[ u8client ] = 0;
+  au8generation[ u8client ]++;
+}
+
+/**
+ * @brief
+ * Requests of a connection that have not been answered yet.
+ */
+template <class CLIENT>
+uint8_t ModbusTcpServer<CLIENT>::inFlight(uint8_t u8client)
+{
+  uint8_t u8count = 0;
+  for (uint8_t i = 0; i < GATEWAY_SLOTS; i++)
+  {
+    gateway_slot_t *slot = gateway->getSlot(i);
+    if (slot->u8state.load(std::memory_order_acquire) == GW_FREE) continue;
+    if ((slot->u8client == u8client) && (slot->u8generation == au8generation[ u8client ])) u8count++;
+  }
+  return u8count;
+}
+
+/**
+ * @brief
+ * Reads what fits the receive buffer and queues every complete request.
+ * A connection over its GATEWAY_PER_CLIENT limit is simply not read any
+ * further, TCP flow control holds the client back.
+ */
+template <class CLIENT>
+void ModbusTcpServer<CLIENT>::receive(uint8_t u8client)
+{
+  uint8_t *au8frame = au8rx[ u8client ];
+  uint16_t &u16length = au16rx[ u8client ];
+
+  int iAvailable = aClients[ u8client ].available();
+  if ((iAvailable > 0) && (u16length < MBAP_MAX))
+  {
+    int iRead = aClients[ u8client ].read(au8frame + u16length, min(iAvailable, (int)(MBAP_MAX - u16length)));
+    if (iRead > 0) u16length += iRead;
+  }
+
+  while (u16length >= MBAP_HEADER)
+  {
+    uint16_t u16protocol = word(au8frame[ 2 ], au8frame[ 3 ]);
+    uint16_t u16mbap = word(au8frame[ 4 ], au8frame[ 5 ]);   // unit + PDU
+    if ((u16protocol != 0) || (u16mbap < 2) || (u16mbap > MBAP_MAX - 6))
+    {
+      close(u8client);                        // not Modbus, or out of step: no way to resync
+      return;
+    }
+    uint16_t u16frame = 6 + u16mbap;
+    if (u16length < u16frame) return;
+    if (inFlight(u8client) >= GATEWAY_PER_CLIENT) return;
+
+    gateway_slot_t *slot = gateway->acquire();
+    if (slot == NULL) return;
+
+    au32lastRequest[ u8client ] = millis();
+    uint8_t u8exception = decode(au8frame, u16frame, slot);
+    if (u8exception != 0)
+    {
+      replyException(u8client, au8frame, u8exception);
+    }
+    else
+    {
+      slot->u8client = u8client;
+      slot->u8generation = au8generation[ u8client ];
+      slot->u32seq = u32seq++;
+      gateway->submit(slot);
+    }
+    u16length -= u16frame;
+    memmove(au8frame, au8frame + u16frame, u16length);
+  }
+}
+
+/**
+ * @brief
+ * Checks an MBAP request and fills a slot with it.
+ *
+ * @return 0 if the slot is ready to submit, else the exception to answer
+ */
+template <class CLIENT>
+uint8_t ModbusTcpServer<CLIENT>::decode(const uint8_t *au8frame, uint16_t u16length, gateway_slot_t *slot)
+{
+  const uint8_t *au8pdu = au8frame + MBAP_HEADER;
+  uint16_t u16pdu = u16length - MBAP_HEADER;
+
+  slot->u16transaction = word(au8frame[ 0 ], au8frame[ 1 ]);
+  slot->u8unit = au8frame[ 6 ];
+  slot->u8fct = au8pdu[ 0 ];
+  if ((slot->u8unit == 0) || (slot->u8unit > 247)) return EXC_GATEWAY_PATH;
+
+  switch (slot->u8fct)
+  {
+    case MB_FC_READ_REGISTERS:
+    case MB_FC_READ_INPUT_REGISTER:
+      if (u16pdu != 5) return EXC_REGS_QUANT;
+      slot->u16address = word(au8pdu[ 1 ], au8pdu[ 2 ]);
+      slot->u16count = word(au8pdu[ 3 ], au8pdu[ 4 ]);
+      if ((slot->u16count == 0) || (slot->u16count > GATEWAY_READ_MAX)) return EXC_REGS_QUANT;
+      break;
+
+    case MB_FC_WRITE_REGISTER:
+      if (u16pdu != 5) return EXC_REGS_QUANT;
+      slot->u16address = word(au8pdu[ 1 ], au8pdu[ 2 ]);
+      slot->u16count = 1;
+      slot->au16data[ 0 ] = word(au8pdu[ 3 ], au8pdu[ 4 ]);
+      break;
+
+    case MB_FC_WRITE_MULTIPLE_REGISTERS:
+      if (u16pdu < 6) return EXC_REGS_QUANT;
+      slot->u16address = word(au8pdu[ 1 ], au8pdu[ 2 ]);
+      slot->u16count = word(au8pdu[ 3 ], au8pdu[ 4 ]);
+      if ((slot->u16count == 0) || (slot->u16count > GATEWAY_WRITE_MAX)) return EXC_REGS_QUANT;
+      if ((au8pdu[ 5 ] != slot->u16count * 2) || (u16pdu != 6 + slot->u16count * 2)) return EXC_REGS_QUANT;
+      for (uint16_t i = 0; i < slot->u16count; i++)
+      {
+        slot->au16data[ i ] = word(au8pdu[ 6 + 2 * i ], au8pdu[ 7 + 2 * i ]);
+      }
+      break;
+
+    default:
+      return EXC_FUNC_CODE;
+  }
+  if ((uint32_t)slot->u16address + slot->u16count > 0x10000UL) return EXC_ADDR_RANGE;
+  return 0;
+}
+
+/**
+ * @brief
+ * Writes the MBAP answer of a finished slot to its connection.
+ */
+template <class CLIENT>
+void ModbusTcpServer<CLIENT>::reply(gateway_slot_t *slot)
+{
+  uint8_t au8frame[ MBAP_MAX ];
+  uint8_t *au8pdu = au8frame + MBAP_HEADER;
+  uint16_t u16pdu;
+
+  au8pdu[ 0 ] = slot->u8fct;
+  if (slot->u8exception != 0)
+  {
+    au8pdu[ 0 ] |= 0x80;
+    au8pdu[ 1 ] = slot->u8exception;
+    u16pdu = 2;
+  }
+  else if (slot->u8fct == MB_FC_WRITE_REGISTER)
+  {
+    au8pdu[ 1 ] = highByte(slot->u16address);
+    au8pdu[ 2 ] = lowByte(slot->u16address);
+    au8pdu[ 3 ] = highByte(slot->au16data[ 0 ]);
+    au8pdu[ 4 ] = lowByte(slot->au16data[ 0 ]);
+    u16pdu = 5;
+  }
+  else if (slot->u8fct == MB_FC_WRITE_MULTIPLE_REGISTERS)
+  {
+    au8pdu[ 1 ] = highByte(slot->u16address);
+    au8pdu[ 2 ] = lowByte(slot->u16address);
+    au8pdu[ 3 ] = highByte(slot->u16count);
+    au8pdu[ 4 ] = lowByte(slot->u16count);
+    u16pdu = 5;
+  }
+  else
+  {
+    au8pdu[ 1 ] = slot->u16count * 2;
+    for (uint16_t i = 0; i < slot->u16count; i++)
+    {
+      au8pdu[ 2 + 2 * i ] = highByte(slot->au16data[ i ]);
+      au8pdu[ 3 + 2 * i ] = lowByte(slot->au16data[ i ]);
+    }
+    u16pdu = 2 + slot->u16count * 2;
+  }
+
+  au8frame[ 0 ] = highByte(slot->u16transaction);
+  au8frame[ 1 ] = lowByte(slot->u16transaction);
+  au8frame[ 2 ] = 0;
+  au8frame[ 3 ] = 0;
+  au8frame[ 4 ] = highByte(u16pdu + 1);
+  au8frame[ 5 ] = lowByte(u16pdu + 1);
+  au8frame[ 6 ] = slot->u8unit;
+  aClients[ slot->u8client ].write(au8frame, MBAP_HEADER + u16pdu);
+}
+
+/**
+ * @brief
+ * Answers a request that was refused before reaching the bus.
+ */
+template <class CLIENT>
+void ModbusTcpServer<CLIENT>::replyException(uint8_t u8client, const uint8_t *au8request, uint8_t u8exception)
+{
+  uint8_t au8frame[ MBAP_HEADER + 2 ];
+  memcpy(au8frame, au8request, MBAP_HEADER);  // transaction, protocol, unit
+  au8frame[ 4 ] = 0;
+  au8frame[ 5 ] = 3;
+  au8frame[ 7 ] = au8request[ MBAP_HEADER ] | 0x80;
+  au8frame[ 8 ] = u8exception;
+  aClients[ u8client ].write(au8frame, sizeof(au8frame));
+}
+
+#endif // MODBUS_GATEWAY_H
@@ -0,0 +1,267 @@
+/**
+ * @file ModbusPlanner.h
+ * @brief
+ * Coalesces register reads into as few Modbus transactions as possible.
+ *
+ * The caller declares the values it needs as a table of points (slave,
+ * function, address, count, period, destination). plan() sorts the
+ * FC3/FC4 points of each slave by address and merges a point into the
+ * current block when the registers between them number at most the gap
+ * threshold and the merged block still fits one answer (MAX_READ_REGS
+ * and MAX_BUFFER). Each block becomes one ModbusScheduler task running at
+ * the shortest period of its points. Other function codes are scheduled
+ * as they are.
+ *
+ * Every transaction pays a fixed overhead of 8 request bytes, 5 answer
+ * header and CRC bytes, two T3.5 gaps, the turnaround and the slave's
+ * latency, while a register in a gap costs only 2 bytes. Bridging a gap
+ * is therefore cheap on the wire, but a slave answers a read that covers
+ * even one register it does not implement with exception 02 (illegal data
+ * address), and every point of the block is lost, not just the gap. The
+ * default gap is 0: only adjacent or overlapping points are merged, which
+ * never reads a register nobody asked for. Raise it with setGap() only for
+ * slaves known to implement the whole range.
+ *
+ * Merged blocks are read into one shared scratch buffer. complete() copies
+ * each point's slice back to its destination. It must be called with the
+ * result of every ModbusScheduler::poll(), before the next poll() starts
+ * another transaction.
+ *
+ * @defgroup planner Modbus Read Planner
+ */
+
+#ifndef MODBUS_PLANNER_H
+#define MODBUS_PLANNER_H
+
+#include "ModbusScheduler.h"
+
+#define PLAN_POINTS_MAX         32            //!< points one plan() accepts
+#define PLAN_GAP_DEFAULT        0             //!< registers that may be read and discarded between two points
+#define PLAN_REGS_MAX           ((MAX_BUFFER - 5) / 2 < MAX_READ_REGS ? (MAX_BUFFER - 5) / 2 : MAX_READ_REGS)
+
+/**
+ * @struct modbus_point_t
+ * @brief
+ * One logical value, or group of consecutive values, to poll.
+ * The last two fields are filled in by plan().
+ */
+typedef struct
+{
+  uint8_t u8id;                               /*!< slave address 1..247 */
+  uint8_t u8fct;                              /*!< function code, FC3/FC4 are coalesced */
+  uint16_t u16address;                        /*!< first register */
+  uint16_t u16count;                          /*!< number of registers */
+  uint16_t *au16dest;                         /*!< where the values go */
+  uint32_t u32period;                         /*!< ms between reads */
+  int8_t i8task;                              /*!< plan(): scheduler task reading the point, SCHED_NONE if not planned */
+  uint16_t u16offset;                         /*!< plan(): first register of the point in its task's answer */
+}
+modbus_point_t;
+
+/**
+ * @class ModbusPlanner
+ * @brief
+ * Turns a table of points into scheduler tasks and scatters their answers.
+ */
+class ModbusPlanner
+{
+private:
+  ModbusScheduler *scheduler;
+  modbus_point_t *points;
+  uint8_t u8points;
+  uint16_t u16gap;
+  uint16_t u16maxRegs;
+  uint8_t u8blocks;
+  uint16_t au16scratch[ PLAN_REGS_MAX ];      //!< answer of the merged block in flight
+
+  static boolean isRead(uint8_t u8fct);
+  void sort(uint8_t *au8order, uint8_t u8count);
+
+public:
+  ModbusPlanner(ModbusScheduler &scheduler);
+
+  void setGap(uint16_t u16gap);               //!<registers allowed between two merged points
+  void setMaxRegs(uint16_t u16maxRegs);       //!<upper limit of a merged read, at most PLAN_REGS_MAX
+  uint8_t plan(modbus_point_t *points, uint8_t u8count, uint8_t u8priority); //!<register the points, returns tasks added
+  boolean complete(int8_t i8task);            //!<scatter the answer of a finished task
+  uint8_t getBlockCount();                    //!<transactions per round
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param scheduler  scheduler that will run the merged reads
+ * @ingroup planner
+ */
+ModbusPlanner::ModbusPlanner(ModbusScheduler &scheduler)
+{
+  this->scheduler = &scheduler;
+  points = NULL;
+  u8points = 0;
+  u16gap = PLAN_GAP_DEFAULT;
+  u16maxRegs = PLAN_REGS_MAX;
+  u8blocks = 0;
+}
+
+/**
+ * @brief
+ * Sets how many unused registers may be read to join two points.
+ * 0 (the default) merges only adjacent or overlapping points.
+ * Every register in a gap must exist on the slave: one it does not
+ * implement turns the whole merged read into exception 02.
+ *
+ * @ingroup planner
+ */
+void ModbusPlanner::setGap(uint16_t u16gap)
+{
+  this->u16gap = u16gap;
+}
+
+/**
+ * @brief
+ * Limits the size of a merged read, e.g. for a slave that accepts fewer
+ * registers per request than the protocol allows.
+ *
+ * @ingroup planner
+ */
+void ModbusPlanner::setMaxRegs(uint16_t u16maxRegs)
+{
+  this->u16maxRegs = constrain(u16maxRegs, 1, PLAN_REGS_MAX);
+}
+
+/**
+ * @brief
+ * Groups the points into blocks and adds one scheduler task per block.
+ * The point table is owned by the caller and must outlive the planner.
+ *
+ * @param points      points to poll
+ * @param u8count     up to PLAN_POINTS_MAX
+ * @param u8priority  priority of the tasks added
+ * @return number of tasks added; points left out (table full) keep i8task = SCHED_NONE
+ * @ingroup planner
+ */
+uint8_t ModbusPlanner::plan(modbus_point_t *points, uint8_t u8count, uint8_t u8priority)
+{
+  uint8_t au8order[ PLAN_POINTS_MAX ];
+  this->points = points;
+  u8points = min(u8count, (uint8_t)PLAN_POINTS_MAX);
+  u8blocks = 0;
+
+  for (uint8_t i = 0; i < u8points; i++)
+  {
+    points[ i ].i8task = SCHED_NONE;
+    points[ i ].u16offset = 0;
+    au8order[ i ] = i;
+  }
+  sort(au8order, u8points);
+
+  uint8_t u8first = 0;
+  while (u8first < u8points)
+  {
+    modbus_point_t *head = &points[ au8order[ u8first ] ];
+    uint32_t u32start = head->u16address;
+    uint32_t u32end = u32start + head->u16count;   // first register past the block
+    uint32_t u32period = head->u32period;
+    uint8_t u8last = u8first;
+
+    // extend while the next point of the same slave and function is close enough
+    while (isRead(head->u8fct) && (u8last + 1 < u8points))
+    {
+      modbus_point_t *next = &points[ au8order[ u8last + 1 ] ];
+      uint32_t u32nextEnd = max(u32end, (uint32_t)next->u16address + next->u16count);
+      if ((next->u8id != head->u8id) || (next->u8fct != head->u8fct)) break;
+      if (next->u16address > u32end + u16gap) break;
+      if (u32nextEnd - u32start > u16maxRegs) break;
+      u32end = u32nextEnd;
+      u32period = min(u32period, next->u32period);
+      u8last++;
+    }
+
+    // a single point is read straight into its destination
+    uint16_t *au16reg = (u8last == u8first) ? head->au16dest : au16scratch;
+    int8_t i8task = scheduler->add(head->u8id, head->u8fct, u32start, u32end - u32start, au16reg, u32period, u8priority);
+    if (i8task == SCHED_NONE) break;
+
+    for (uint8_t i = u8first; i <= u8last; i++)
+    {
+      points[ au8order[ i ] ].i8task = i8task;
+      points[ au8order[ i ] ].u16offset = points[ au8order[ i ] ].u16address - u32start;
+    }
+    u8blocks++;
+    u8first = u8last + 1;
+  }
+  return u8blocks;
+}
+
+/**
+ * @brief
+ * Copies the answer of a merged read to the points it covers.
+ * Call it with every ModbusScheduler::poll() result.
+ *
+ * @param i8task  value returned by ModbusScheduler::poll()
+ * @return true if the task belongs to the plan and succeeded: its points are up to date
+ * @ingroup planner
+ */
+boolean ModbusPlanner::complete(int8_t i8task)
+{
+  if (i8task == SCHED_NONE) return false;
+  modbus_task_t *task = scheduler->getTask(i8task);
+  if ((task == NULL) || (task->u8lastError != 0)) return false;
+
+  boolean bPlanned = false;
+  for (uint8_t i = 0; i < u8points; i++)
+  {
+    modbus_point_t *point = &points[ i ];
+    if (point->i8task != i8task) continue;
+    bPlanned = true;
+    if (task->telegram.au16reg != au16scratch) continue;   // read in place
+    memcpy(point->au16dest, &au16scratch[ point->u16offset ], point->u16count * sizeof(uint16_t));
+  }
+  return bPlanned;
+}
+
+/**
+ * @brief
+ * @return number of transactions one round of all points takes
+ * @ingroup planner
+ */
+uint8_t ModbusPlanner::getBlockCount()
+{
+  return u8blocks;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+boolean ModbusPlanner::isRead(uint8_t u8fct)
+{
+  return (u8fct == MB_FC_READ_REGISTERS) || (u8fct == MB_FC_READ_INPUT_REGISTER);
+}
+
+/**
+ * @brief
+ * Insertion sort of point indices by slave, function and address.
+ */
+void ModbusPlanner::sort(uint8_t *au8order, uint8_t u8count)
+{
+  for (uint8_t i = 1; i < u8count; i++)
+  {
+    uint8_t u8index = au8order[ i ];
+    const modbus_point_t *point = &points[ u8index ];
+    uint32_t u32key = ((uint32_t)point->u8id << 24) | ((uint32_t)point->u8fct << 16) | point->u16address;
+    uint8_t j = i;
+    while (j > 0)
+    {
+      const modbus_point_t *prev = &points[ au8order[ j - 1 ] ];
+      uint32_t u32prev = ((uint32_t)prev->u8id << 24) | ((uint32_t)prev->u8fct << 16) | prev->u16address;
+      if (u32prev <= u32key) break;
+      au8order[ j ] = au8order[ j - 1 ];
+      j--;
+    }
+    au8order[ j ] = u8index;
+  }
+}
+
+#endif // MODBUS_PLANNER_H
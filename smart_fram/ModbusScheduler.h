@@ -0,0 +1,276 @@
+/**
+ * @file ModbusScheduler.h
+ * @brief
+ * Periodic multi-telegram scheduler for a Modbus master.
+ *
+ * Holds a caller-owned table of telegrams, each with its own period and
+ * priority, and issues them one at a time through Modbus::query() and
+ * Modbus::poll(). When several telegrams are due at once, the lowest
+ * priority value goes first and ties go to the oldest deadline. Telegrams
+ * of equal priority therefore rotate round-robin.
+ *
+ * @defgroup scheduler Modbus Master Scheduler
+ */
+
+#ifndef MODBUS_SCHEDULER_H
+#define MODBUS_SCHEDULER_H
+
+#include "ETT_ModbusRTU.h"
+
+/**
+ * @struct modbus_task_t
+ * @brief
+ * One scheduled telegram plus its timing and health bookkeeping.
+ */
+typedef struct
+{
+  modbus_t telegram;                          /*!< query sent to the slave */
+  uint32_t u32period;                         /*!< ms between two queries, 0 = whenever the bus is free */
+  uint8_t u8priority;                         /*!< 0 = most urgent */
+  uint32_t u32due;                            /*!< millis() at which the next query is due */
+  uint32_t u32lastOk;                         /*!< millis() of the last valid answer */
+  uint8_t u8lastError;                        /*!< Modbus::getLastError() of the last transaction, or the query() error, 0 = OK */
+  uint16_t u16okCnt;                          /*!< valid answers */
+  uint16_t u16errCnt;                         /*!< timeouts, CRC errors, exceptions and refused queries */
+}
+modbus_task_t;
+
+#define SCHED_NONE  -1                        //!< poll() result when no transaction finished
+
+/**
+ * @class ModbusScheduler
+ * @brief
+ * Drives a Modbus master through a table of periodic telegrams.
+ */
+class ModbusScheduler
+{
+private:
+  Modbus *master;
+  modbus_task_t *tasks;
+  uint8_t u8max;
+  uint8_t u8count;
+  int8_t i8active;                            //!< task waiting for an answer, SCHED_NONE if idle
+  uint16_t u16gap;                            //!< ms of bus silence between two transactions
+  uint32_t u32idle;                           //!< millis() when the last transaction ended
+
+  int8_t pickNext(uint32_t u32now);
+
+public:
+  ModbusScheduler(Modbus &master, modbus_task_t *tasks, uint8_t u8max);
+
+  int8_t add(uint8_t u8id, uint8_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo,
+             uint16_t *au16reg, uint32_t u32period, uint8_t u8priority);   //!<register a telegram
+  void setGap(uint16_t u16gap);                                            //!<minimum idle time between transactions
+  boolean clear();                                                         //!<drop every telegram, e.g. to plan again
+  int8_t poll();                                                           //!<cyclic call from loop()
+  uint8_t getCount();                                                      //!<number of registered telegrams
+  modbus_task_t *getTask(uint8_t u8task);                                  //!<telegram bookkeeping
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ * The task table is owned by the caller and must outlive the scheduler.
+ *
+ * @param master  Modbus object in master mode (id 0)
+ * @param tasks   storage for the scheduled telegrams
+ * @param u8max   number of entries in tasks
+ * @ingroup scheduler
+ */
+ModbusScheduler::ModbusScheduler(Modbus &master, modbus_task_t *tasks, uint8_t u8max)
+{
+  this->master = &master;
+  this->tasks = tasks;
+  this->u8max = u8max;
+  this->u8count = 0;
+  this->i8active = SCHED_NONE;
+  this->u16gap = 0;
+  this->u32idle = 0;
+}
+
+/**
+ * @brief
+ * Registers a periodic telegram. The first query is due immediately.
+ *
+ * @param u8id        slave address 1..247
+ * @param u8fct       function code
+ * @param u16RegAdd   first register or coil
+ * @param u16CoilsNo  number of registers or coils
+ * @param au16reg     memory image in master
+ * @param u32period   ms between queries
+ * @param u8priority  0 = most urgent
+ * @return task index, or SCHED_NONE if the table is full
+ * @ingroup scheduler
+ */
+int8_t ModbusScheduler::add(uint8_t u8id, uint8_t u8fct, uint16_t u16RegAdd, uint16_t u16CoilsNo,
+                            uint16_t *au16reg, uint32_t u32period, uint8_t u8priority)
+{
+  if (u8count >= u8max) return SCHED_NONE;
+
+  modbus_task_t *task = &tasks[ u8count ];
+  task->telegram.u8id       = u8id;
+  task->telegram.u8fct      = u8fct;
+  task->telegram.u16RegAdd  = u16RegAdd;
+  task->telegram.u16CoilsNo = u16CoilsNo;
+  task->telegram.au16reg    = au16reg;
+  task->telegram.u16WriteNo = 0;
+  task->telegram.au16write  = NULL;
+  task->u32period   = u32period;
+  task->u8priority  = u8priority;
+  task->u32due      = millis();
+  task->u32lastOk   = 0;
+  task->u8lastError = NO_REPLY;
+  task->u16okCnt    = 0;
+  task->u16errCnt   = 0;
+
+  return u8count++;
+}
+
+/**
+ * @brief
+ * Sets the minimum bus silence between the end of one transaction
+ * and the next query, for slaves that need settling time.
+ *
+ * @param u16gap  idle time in ms (default 0)
+ * @ingroup scheduler
+ */
+void ModbusScheduler::setGap(uint16_t u16gap)
+{
+  this->u16gap = u16gap;
+}
+
+/**
+ * @brief
+ * Removes every telegram, e.g. before planning the points of a new
+ * device map. Task indices handed out before are no longer valid.
+ *
+ * @return false, and nothing removed, while a telegram waits for its answer
+ * @ingroup scheduler
+ */
+boolean ModbusScheduler::clear()
+{
+  if (i8active != SCHED_NONE) return false;
+  u8count = 0;
+  return true;
+}
+
+/**
+ * @brief
+ * Cyclic scheduler step. Call it from loop() in place of Modbus::query()/poll().
+ * Never blocks beyond what Modbus::query() itself does.
+ *
+ * @return index of the task whose transaction just finished (check its
+ *         u8lastError), or SCHED_NONE. A telegram that Modbus::query()
+ *         rejects (bad id, too long for MAX_BUFFER...) finishes at once
+ *         with that error in u8lastError and waits for its next period.
+ * @ingroup scheduler
+ */
+int8_t ModbusScheduler::poll()
+{
+  if (i8active != SCHED_NONE)
+  {
+    master->poll();
+    if (master->getState() != COM_IDLE) return SCHED_NONE;
+
+    modbus_task_t *task = &tasks[ i8active ];
+    task->u8lastError = master->getLastError();
+    if (task->u8lastError == 0)
+    {
+      task->u32lastOk = millis();
+      task->u16okCnt++;
+    }
+    else
+    {
+      task->u16errCnt++;
+    }
+
+    int8_t i8done = i8active;
+    i8active = SCHED_NONE;
+    u32idle = millis();
+    return i8done;
+  }
+
+  uint32_t u32now = millis();
+  if ((unsigned long)(u32now - u32idle) < (unsigned long)u16gap) return SCHED_NONE;
+
+  int8_t i8next = pickNext(u32now);
+  if (i8next == SCHED_NONE) return SCHED_NONE;
+
+  modbus_task_t *task = &tasks[ i8next ];
+  int8_t i8error = master->query(task->telegram);
+  if (i8error == -1) return SCHED_NONE;       // bus busy (e.g. the gateway): retry on the next call
+
+  // keep the period phase-locked, but do not burst to catch up after a stall
+  task->u32due += task->u32period;
+  if ((int32_t)(u32now - task->u32due) >= 0) task->u32due = u32now + task->u32period;
+
+  if (i8error != 0)
+  {
+    // a telegram the master refuses never goes out: count it and let the others run
+    task->u8lastError = (uint8_t)i8error;
+    task->u16errCnt++;
+    return i8next;
+  }
+
+  i8active = i8next;
+  return SCHED_NONE;
+}
+
+/**
+ * @brief
+ * Number of registered telegrams.
+ *
+ * @ingroup scheduler
+ */
+uint8_t ModbusScheduler::getCount()
+{
+  return u8count;
+}
+
+/**
+ * @brief
+ * Access to a telegram's timing and health bookkeeping.
+ *
+ * @param u8task  index returned by add()
+ * @return task entry, or NULL if out of range
+ * @ingroup scheduler
+ */
+modbus_task_t *ModbusScheduler::getTask(uint8_t u8task)
+{
+  if (u8task >= u8count) return NULL;
+  return &tasks[ u8task ];
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Selects the due task with the lowest priority value, oldest deadline first.
+ *
+ * @return task index or SCHED_NONE if nothing is due
+ * @ingroup scheduler
+ */
+int8_t ModbusScheduler::pickNext(uint32_t u32now)
+{
+  int8_t i8best = SCHED_NONE;
+  int32_t i32bestLate = 0;
+
+  for (uint8_t i = 0; i < u8count; i++)
+  {
+    int32_t i32late = (int32_t)(u32now - tasks[ i ].u32due);
+    if (i32late < 0) continue;
+
+    if ((i8best == SCHED_NONE)
+        || (tasks[ i ].u8priority < tasks[ i8best ].u8priority)
+        || ((tasks[ i ].u8priority == tasks[ i8best ].u8priority) && (i32late > i32bestLate)))
+    {
+      i8best = i;
+      i32bestLate = i32late;
+    }
+  }
+  return i8best;
+}
+
+#endif // MODBUS_SCHEDULER_H
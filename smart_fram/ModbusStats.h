@@ -0,0 +1,226 @@
+/**
+ * @file ModbusStats.h
+ * @brief
+ * Per-slave, per-function-code statistics for a Modbus master.
+ *
+ * Fed from Modbus::setMonitor(). Each (slave id, function code) pair gets
+ * 32-bit counters and a histogram of request-to-response times (RTT), in
+ * log2 buckets: bucket 0 holds RTT < 512 us, bucket b holds
+ * [2^(b+8), 2^(b+9)) us, and the last bucket holds everything above 8 s.
+ *
+ * The table is a fixed array of MODBUS_STATS_MAX entries. Pairs seen once
+ * it is full are not tracked; getUntracked() counts their events.
+ *
+ * record() has a single writer: the master reports every event on the
+ * task that calls query() and poll(), also in RX_EVENT mode, where poll()
+ * reports the answer the receive callback has processed. Readers on other
+ * tasks may see an entry mid-update, which is fine for statistics.
+ *
+ * @defgroup stats Modbus statistics
+ */
+
+#ifndef MODBUS_STATS_H
+#define MODBUS_STATS_H
+
+#include "ETT_ModbusRTU.h"
+
+#ifndef MODBUS_STATS_MAX
+#define MODBUS_STATS_MAX        16            //!< tracked (id, function) pairs
+#endif
+#define MODBUS_RTT_BUCKETS      16
+#define MODBUS_RTT_SHIFT        9             //!< bucket 0 upper bound is 2^9 us
+#define MODBUS_STATS_JSON_MAX   320           //!< worst-case length of modbusStatsFormat() output incl. '\0'
+
+/**
+ * @struct modbus_stats_t
+ * @brief
+ * Counters of one (slave id, function code) pair.
+ */
+typedef struct
+{
+  uint8_t u8id;                               /*!< slave address */
+  uint8_t u8fct;                              /*!< function code of the request */
+  uint32_t u32requests;                       /*!< queries sent */
+  uint32_t u32responses;                      /*!< valid answers */
+  uint32_t u32badFrames;                      /*!< CRC errors, truncated or malformed answers */
+  uint32_t u32exceptions;                     /*!< exception answers */
+  uint32_t u32timeouts;                       /*!< no answer */
+  uint32_t u32rttMax;                         /*!< slowest answer, us */
+  uint32_t au32rtt[ MODBUS_RTT_BUCKETS ];     /*!< answers (valid or exception) per RTT bucket */
+}
+modbus_stats_t;
+
+/**
+ * @class ModbusStats
+ * @brief
+ * Fixed-size table of modbus_stats_t, no heap.
+ */
+class ModbusStats
+{
+private:
+  modbus_stats_t aEntries[ MODBUS_STATS_MAX ];
+  uint8_t u8count;
+  uint32_t u32untracked;
+
+  modbus_stats_t *lookup(uint8_t u8id, uint8_t u8fct);
+
+public:
+  ModbusStats();
+
+  void record(uint8_t u8id, uint8_t u8fct, uint8_t u8event, uint32_t u32rtt); //!<Modbus::setMonitor() signature
+  uint8_t getCount();                                         //!<number of tracked pairs
+  const modbus_stats_t *getEntry(uint8_t u8index);            //!<0..getCount()-1
+  const modbus_stats_t *find(uint8_t u8id, uint8_t u8fct);    //!<NULL if never seen
+  uint32_t getUntracked();                                    //!<events dropped because the table is full
+  void reset();
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+ModbusStats::ModbusStats()
+{
+  reset();
+}
+
+/**
+ * @brief
+ * Accounts one transaction event.
+ *
+ * @param u8id     slave address of the request
+ * @param u8fct    function code of the request
+ * @param u8event  MB_EVENTS value
+ * @param u32rtt   request-to-response time in us (answers only)
+ * @ingroup stats
+ */
+void ModbusStats::record(uint8_t u8id, uint8_t u8fct, uint8_t u8event, uint32_t u32rtt)
+{
+  modbus_stats_t *entry = lookup(u8id, u8fct);
+  if (entry == NULL)
+  {
+    u32untracked++;
+    return;
+  }
+
+  switch (u8event)
+  {
+    case MB_EV_REQUEST:   entry->u32requests++;   return;
+    case MB_EV_TIMEOUT:   entry->u32timeouts++;   return;
+    case MB_EV_BAD_FRAME: entry->u32badFrames++;  return;
+    case MB_EV_EXCEPTION: entry->u32exceptions++; break;
+    case MB_EV_RESPONSE:  entry->u32responses++;  break;
+    default: return;
+  }
+
+  uint32_t u32scaled = u32rtt >> MODBUS_RTT_SHIFT;
+  uint8_t u8bucket = (u32scaled == 0) ? 0 : 32 - __builtin_clz(u32scaled);
+  if (u8bucket >= MODBUS_RTT_BUCKETS) u8bucket = MODBUS_RTT_BUCKETS - 1;
+  entry->au32rtt[ u8bucket ]++;
+  if (u32rtt > entry->u32rttMax) entry->u32rttMax = u32rtt;
+}
+
+/**
+ * @brief
+ * @return number of (id, function) pairs in the table
+ * @ingroup stats
+ */
+uint8_t ModbusStats::getCount()
+{
+  return u8count;
+}
+
+/**
+ * @brief
+ * @param u8index  0..getCount()-1
+ * @return entry, NULL if out of range
+ * @ingroup stats
+ */
+const modbus_stats_t *ModbusStats::getEntry(uint8_t u8index)
+{
+  if (u8index >= u8count) return NULL;
+  return &aEntries[ u8index ];
+}
+
+/**
+ * @brief
+ * @return entry of a pair, NULL if it has never been seen
+ * @ingroup stats
+ */
+const modbus_stats_t *ModbusStats::find(uint8_t u8id, uint8_t u8fct)
+{
+  for (uint8_t i = 0; i < u8count; i++)
+  {
+    if ((aEntries[ i ].u8id == u8id) && (aEntries[ i ].u8fct == u8fct)) return &aEntries[ i ];
+  }
+  return NULL;
+}
+
+/**
+ * @brief
+ * @return events of pairs not tracked because the table was full
+ * @ingroup stats
+ */
+uint32_t ModbusStats::getUntracked()
+{
+  return u32untracked;
+}
+
+/**
+ * @brief
+ * Forgets all pairs and counters.
+ *
+ * @ingroup stats
+ */
+void ModbusStats::reset()
+{
+  memset(aEntries, 0, sizeof(aEntries));
+  u8count = 0;
+  u32untracked = 0;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Finds the entry of a pair, adding it if there is room.
+ * The entry is filled in before u8count makes it visible to readers.
+ */
+modbus_stats_t *ModbusStats::lookup(uint8_t u8id, uint8_t u8fct)
+{
+  modbus_stats_t *entry = (modbus_stats_t *)find(u8id, u8fct);
+  if ((entry != NULL) || (u8count >= MODBUS_STATS_MAX)) return entry;
+
+  entry = &aEntries[ u8count ];
+  entry->u8id = u8id;
+  entry->u8fct = u8fct;
+  u8count++;
+  return entry;
+}
+
+/* _____HELPERS_______________________________________________________________ */
+
+/**
+ * @brief
+ * Formats one entry as
+ *   {"id":20,"fc":3,"req":100,"rsp":97,"bad":1,"exc":0,"to":2,"rttMax":41250,"rtt":[0,0,...]}
+ * "rtt" lists the MODBUS_RTT_BUCKETS histogram buckets.
+ *
+ * @return length written, 0 if acBuf is too small
+ * @ingroup stats
+ */
+uint16_t modbusStatsFormat(const modbus_stats_t *entry, char *acBuf, uint16_t u16size)
+{
+  int iLen = snprintf(acBuf, u16size,
+                      "{\"id\":%u,\"fc\":%u,\"req\":%lu,\"rsp\":%lu,\"bad\":%lu,\"exc\":%lu,\"to\":%lu,\"rttMax\":%lu,\"rtt\":[",
+                      entry->u8id, entry->u8fct, (unsigned long)entry->u32requests, (unsigned long)entry->u32responses,
+                      (unsigned long)entry->u32badFrames, (unsigned long)entry->u32exceptions,
+                      (unsigned long)entry->u32timeouts, (unsigned long)entry->u32rttMax);
+  for (uint8_t i = 0; (i < MODBUS_RTT_BUCKETS) && (iLen >= 0) && (iLen < u16size); i++)
+  {
+    iLen += snprintf(acBuf + iLen, u16size - iLen, (i == 0) ? "%lu" : ",%lu", (unsigned long)entry->au32rtt[ i ]);
+  }
+  if ((iLen >= 0) && (iLen < u16size)) iLen += snprintf(acBuf + iLen, u16size - iLen, "]}");
+  if ((iLen < 0) || (iLen >= u16size)) return 0;
+  return iLen;
+}
+
+#endif // MODBUS_STATS_H
@@ -0,0 +1,125 @@
+/**
+ * @file ReportFilter.h
+ * @brief
+ * Report-by-exception change detection for one signal.
+ *
+ * A value is worth reporting when it has moved by more than its deadband
+ * since the last report and at least u32minInterval has passed, or when
+ * the last report is older than u32maxAge (heartbeat, so a silent signal
+ * is distinguishable from a dead node).
+ *
+ * The deadband is max(fAbs, fRel * |last reported value|): the relative
+ * part scales with large values, the absolute part keeps noise around
+ * zero from triggering. Both 0 report every change.
+ *
+ * @defgroup report Report by exception
+ */
+
+#ifndef REPORT_FILTER_H
+#define REPORT_FILTER_H
+
+#include <Arduino.h>
+
+/**
+ * @struct report_config_t
+ * @brief
+ * Deadband and timing of one signal.
+ */
+typedef struct
+{
+  float fAbs;                                 /*!< absolute deadband, signal units */
+  float fRel;                                 /*!< relative deadband, fraction of the last reported value */
+  uint32_t u32minInterval;                    /*!< ms, shortest time between two reports caused by a change */
+  uint32_t u32maxAge;                         /*!< ms, report at least this often; 0 = never force */
+}
+report_config_t;
+
+/**
+ * @class ReportFilter
+ * @brief
+ * Remembers the last reported value of a signal and decides when to report again.
+ */
+class ReportFilter
+{
+private:
+  report_config_t config;
+  float fLast;                                //!< last reported value
+  uint32_t u32lastReport;                     //!< millis() of the last report
+  boolean bReported;                          //!< false until the first report
+
+public:
+  ReportFilter();
+
+  void setConfig(const report_config_t &config);
+  boolean changed(float fValue, uint32_t u32now);   //!<moved out of the deadband and min interval elapsed
+  boolean stale(uint32_t u32now);                   //!<max age reached, or never reported
+  void reported(float fValue, uint32_t u32now);     //!<value has been sent
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+ReportFilter::ReportFilter()
+{
+  memset(&config, 0, sizeof(config));
+  fLast = 0;
+  u32lastReport = 0;
+  bReported = false;
+}
+
+/**
+ * @brief
+ * Sets deadband and timing. Takes effect on the next check.
+ *
+ * @ingroup report
+ */
+void ReportFilter::setConfig(const report_config_t &config)
+{
+  this->config = config;
+}
+
+/**
+ * @brief
+ * @param fValue  current value
+ * @param u32now  millis()
+ * @return true if fValue is outside the deadband around the last reported
+ * value and the minimum interval has elapsed
+ * @ingroup report
+ */
+boolean ReportFilter::changed(float fValue, uint32_t u32now)
+{
+  if (!bReported) return true;
+  if ((uint32_t)(u32now - u32lastReport) < config.u32minInterval) return false;
+
+  float fDelta = fabsf(fValue - fLast);
+  float fBand = config.fRel * fabsf(fLast);
+  if (fBand < config.fAbs) fBand = config.fAbs;
+  return fDelta > fBand;
+}
+
+/**
+ * @brief
+ * @param u32now  millis()
+ * @return true if the signal must be reported to refresh its age
+ * @ingroup report
+ */
+boolean ReportFilter::stale(uint32_t u32now)
+{
+  if (!bReported) return true;
+  if (config.u32maxAge == 0) return false;
+  return (uint32_t)(u32now - u32lastReport) >= config.u32maxAge;
+}
+
+/**
+ * @brief
+ * Records that fValue has been sent, whatever triggered the report.
+ *
+ * @ingroup report
+ */
+void ReportFilter::reported(float fValue, uint32_t u32now)
+{
+  fLast = fValue;
+  u32lastReport = u32now;
+  bReported = true;
+}
+
+#endif // REPORT_FILTER_H
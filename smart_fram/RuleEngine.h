@@ -0,0 +1,399 @@
+/**
+ * @file RuleEngine.h
+ * @brief
+ * Table-driven on/off control of output pins with hysteresis.
+ *
+ * A rule switches its pin on when a signal crosses fOn and off again only
+ * when it crosses back past fOff. With RULE_BELOW (e.g. a pump on dry soil)
+ * it turns on below fOn and off above fOff; with RULE_ABOVE (e.g. a fan on
+ * heat) it turns on above fOn and off below fOff. The gap between the two
+ * thresholds is the hysteresis. The minimum on and off times block short
+ * cycling. The only exception is leaving the schedule, which switches the
+ * rule off at once.
+ *
+ * Rules are plain structs in a fixed rule_table_t, so a whole table can be
+ * handed to the control task in one piece (e.g. through a Snapshot) and
+ * swapped in with load(). evaluate() is O(rules), uses no heap and writes
+ * a pin only when its level changes. Several rules on one pin are OR-ed.
+ * setOverride() forces outputs on or off regardless of the rules (manual
+ * operation); the rules keep running underneath and take over again when
+ * the override is cleared.
+ *
+ * Only pins registered with setOutputs() can be driven; load() rejects
+ * tables that name any other pin.
+ *
+ * Text form used by ruleTableParse(), rules separated by ';':
+ *   "<signal>,<cmp>,<on>,<off>,<min on s>,<min off s>,<schedule mask>,<pin>"
+ *   "moisture,<,20,25,30,60,1,32;lux,<,80,100,0,0,2,14"
+ * <signal> is a name from the list given to ruleTableParse() or its index,
+ * <cmp> is '<' (RULE_BELOW) or '>' (RULE_ABOVE), a schedule mask of 0 means
+ * always allowed. An empty text is an empty table: all outputs off.
+ *
+ * @defgroup rules Rule engine
+ */
+
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include <Arduino.h>
+
+#define RULES_MAX               8
+#define RULE_OUTPUTS_MAX        8
+
+enum RULE_COMPARATORS
+{
+  RULE_BELOW                   = 0,           //!< on when value < fOn, off when value > fOff (fOff >= fOn)
+  RULE_ABOVE                   = 1            //!< on when value > fOn, off when value < fOff (fOff <= fOn)
+};
+
+/**
+ * @struct control_rule_t
+ * @brief
+ * One rule. Plain data: copy it freely.
+ */
+typedef struct
+{
+  uint8_t u8signal;                           /*!< index into the signal array given to evaluate() */
+  uint8_t u8comparator;                       /*!< RULE_BELOW or RULE_ABOVE */
+  float fOn;                                  /*!< switch-on threshold */
+  float fOff;                                 /*!< switch-off threshold */
+  uint16_t u16minOn;                          /*!< s, shortest on time */
+  uint16_t u16minOff;                         /*!< s, shortest off time */
+  uint8_t u8scheduleMask;                     /*!< schedule channels that allow the rule, 0 = always */
+  uint8_t u8pin;                              /*!< output pin */
+}
+control_rule_t;
+
+/**
+ * @struct rule_table_t
+ * @brief
+ * A complete set of rules, replaced as a whole.
+ */
+typedef struct
+{
+  control_rule_t aRules[ RULES_MAX ];
+  uint8_t u8count;
+}
+rule_table_t;
+
+/**
+ * @class RuleEngine
+ * @brief
+ * Evaluates a rule_table_t and drives the output pins.
+ */
+class RuleEngine
+{
+private:
+  rule_table_t table;
+  boolean abOn[ RULES_MAX ];                  //!< rule output
+  uint32_t au32since[ RULES_MAX ];            //!< millis() of the last change of abOn
+  uint8_t au8pins[ RULE_OUTPUTS_MAX ];
+  uint8_t au8level[ RULE_OUTPUTS_MAX ];       //!< level last written to each pin
+  uint8_t u8outputs;
+  uint8_t u8signals;
+  uint8_t u8forceOn;                          //!< bit n = output n forced HIGH
+  uint8_t u8forceOff;                         //!< bit n = output n forced LOW, wins over u8forceOn
+
+  int8_t outputIndex(uint8_t u8pin);
+
+public:
+  RuleEngine();
+
+  void setOutputs(const uint8_t *au8pins, uint8_t u8count, uint8_t u8signals); //!<allowed pins, driven LOW
+  boolean check(const rule_table_t &table);   //!<true if load() would accept the table
+  boolean load(const rule_table_t &table);    //!<replace all rules, false if the table is invalid
+  void setOverride(uint8_t u8forceOn, uint8_t u8forceOff); //!<bit n = output n of setOutputs()
+  void evaluate(const float *afSignals, uint8_t u8scheduleMask, uint32_t u32now);
+  boolean isOn(uint8_t u8rule);
+  uint8_t getOutputs();                       //!<bit n = level of output n of setOutputs()
+  const control_rule_t *getRule(uint8_t u8rule);
+  uint8_t getCount();
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+RuleEngine::RuleEngine()
+{
+  memset(&table, 0, sizeof(table));
+  memset(abOn, 0, sizeof(abOn));
+  memset(au32since, 0, sizeof(au32since));
+  u8outputs = 0;
+  u8signals = 0;
+  u8forceOn = 0;
+  u8forceOff = 0;
+}
+
+/**
+ * @brief
+ * Registers the pins rules may drive, sets them as outputs and switches them off.
+ *
+ * @param au8pins    output pins
+ * @param u8count    up to RULE_OUTPUTS_MAX
+ * @param u8signals  number of signals evaluate() receives
+ * @ingroup rules
+ */
+void RuleEngine::setOutputs(const uint8_t *au8pins, uint8_t u8count, uint8_t u8signals)
+{
+  u8outputs = min(u8count, (uint8_t)RULE_OUTPUTS_MAX);
+  this->u8signals = u8signals;
+  for (uint8_t i = 0; i < u8outputs; i++)
+  {
+    this->au8pins[ i ] = au8pins[ i ];
+    au8level[ i ] = LOW;
+    pinMode(au8pins[ i ], OUTPUT);
+    digitalWrite(au8pins[ i ], LOW);
+  }
+}
+
+/**
+ * @brief
+ * Validates a table against the registered pins and signals. Reads only
+ * what setOutputs() set, so another task may call it to reject a table
+ * before handing it over.
+ *
+ * @return false if a rule names an unknown signal or pin, or has its
+ * thresholds in the wrong order
+ * @ingroup rules
+ */
+boolean RuleEngine::check(const rule_table_t &table)
+{
+  if (table.u8count > RULES_MAX) return false;
+  for (uint8_t i = 0; i < table.u8count; i++)
+  {
+    const control_rule_t *rule = &table.aRules[ i ];
+    if ((rule->u8signal >= u8signals) || (outputIndex(rule->u8pin) < 0)) return false;
+    if (rule->u8comparator > RULE_ABOVE) return false;
+    if ((rule->u8comparator == RULE_BELOW) && (rule->fOff < rule->fOn)) return false;
+    if ((rule->u8comparator == RULE_ABOVE) && (rule->fOff > rule->fOn)) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief
+ * Replaces the rule table. A rule that keeps its index, pin and signal
+ * keeps its state and timers, so reloading a table does not cycle outputs.
+ *
+ * @return false if check() fails; the old table stays in force then
+ * @ingroup rules
+ */
+boolean RuleEngine::load(const rule_table_t &table)
+{
+  if (!check(table)) return false;
+
+  for (uint8_t i = 0; i < RULES_MAX; i++)
+  {
+    boolean bSame = (i < table.u8count) && (i < this->table.u8count)
+                 && (table.aRules[ i ].u8pin == this->table.aRules[ i ].u8pin)
+                 && (table.aRules[ i ].u8signal == this->table.aRules[ i ].u8signal);
+    if (!bSame) abOn[ i ] = false;
+  }
+  this->table = table;
+  return true;
+}
+
+/**
+ * @brief
+ * Forces outputs regardless of the rules, from the next evaluate() on.
+ *
+ * @param u8forceOn   bit n set: output n HIGH
+ * @param u8forceOff  bit n set: output n LOW (wins if both are set)
+ * @ingroup rules
+ */
+void RuleEngine::setOverride(uint8_t u8forceOn, uint8_t u8forceOff)
+{
+  this->u8forceOn = u8forceOn;
+  this->u8forceOff = u8forceOff;
+}
+
+/**
+ * @brief
+ * Runs every rule once and updates the pins that changed level.
+ *
+ * @param afSignals       current signal values, indexed by u8signal
+ * @param u8scheduleMask  active schedule channels (Schedule::evaluate())
+ * @param u32now          millis()
+ * @ingroup rules
+ */
+void RuleEngine::evaluate(const float *afSignals, uint8_t u8scheduleMask, uint32_t u32now)
+{
+  uint8_t au8want[ RULE_OUTPUTS_MAX ] = { 0 };
+
+  for (uint8_t i = 0; i < table.u8count; i++)
+  {
+    const control_rule_t *rule = &table.aRules[ i ];
+    float fValue = afSignals[ rule->u8signal ];
+    boolean bAllowed = (rule->u8scheduleMask == 0) || (rule->u8scheduleMask & u8scheduleMask);
+    boolean bWant = abOn[ i ];
+
+    if (!bAllowed) bWant = false;
+    else if (rule->u8comparator == RULE_BELOW)
+    {
+      if (fValue < rule->fOn) bWant = true;
+      else if (fValue > rule->fOff) bWant = false;
+    }
+    else
+    {
+      if (fValue > rule->fOn) bWant = true;
+      else if (fValue < rule->fOff) bWant = false;
+    }
+
+    if (bWant != abOn[ i ])
+    {
+      uint32_t u32min = (abOn[ i ] ? rule->u16minOn : rule->u16minOff) * 1000UL;
+      if (!bAllowed || (au32since[ i ] == 0) || ((uint32_t)(u32now - au32since[ i ]) >= u32min))
+      {
+        abOn[ i ] = bWant;
+        au32since[ i ] = u32now | 1;          // 0 means never switched
+      }
+    }
+    if (abOn[ i ]) au8want[ outputIndex(rule->u8pin) ] = HIGH;
+  }
+
+  for (uint8_t o = 0; o < u8outputs; o++)
+  {
+    if (bitRead(u8forceOn, o)) au8want[ o ] = HIGH;
+    if (bitRead(u8forceOff, o)) au8want[ o ] = LOW;
+    if (au8want[ o ] == au8level[ o ]) continue;
+    digitalWrite(au8pins[ o ], au8want[ o ]);
+    au8level[ o ] = au8want[ o ];
+  }
+}
+
+/**
+ * @brief
+ * @return output of a rule after the last evaluate()
+ * @ingroup rules
+ */
+boolean RuleEngine::isOn(uint8_t u8rule)
+{
+  return (u8rule < table.u8count) && abOn[ u8rule ];
+}
+
+/**
+ * @brief
+ * @return levels written to the outputs, bit n = output n of setOutputs()
+ * @ingroup rules
+ */
+uint8_t RuleEngine::getOutputs()
+{
+  uint8_t u8mask = 0;
+  for (uint8_t o = 0; o < u8outputs; o++)
+  {
+    if (au8level[ o ] == HIGH) u8mask |= 1 << o;
+  }
+  return u8mask;
+}
+
+/**
+ * @brief
+ * @return rule in force, NULL past getCount()
+ * @ingroup rules
+ */
+const control_rule_t *RuleEngine::getRule(uint8_t u8rule)
+{
+  return (u8rule < table.u8count) ? &table.aRules[ u8rule ] : NULL;
+}
+
+/**
+ * @brief
+ * @return number of rules in force
+ * @ingroup rules
+ */
+uint8_t RuleEngine::getCount()
+{
+  return table.u8count;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+int8_t RuleEngine::outputIndex(uint8_t u8pin)
+{
+  for (uint8_t i = 0; i < u8outputs; i++)
+  {
+    if (au8pins[ i ] == u8pin) return i;
+  }
+  return -1;
+}
+
+/* _____HELPERS_______________________________________________________________ */
+
+/**
+ * @brief
+ * Parses one comma-terminated field as a float, in place.
+ */
+static boolean ruleParseFloat(const char *&acText, const char *acEnd, float &fValue)
+{
+  char acNumber[ 16 ];
+  uint8_t u8len = 0;
+  while ((acText < acEnd) && (*acText != ',') && (*acText != ';') && (u8len < sizeof(acNumber) - 1))
+  {
+    acNumber[ u8len++ ] = *acText++;
+  }
+  acNumber[ u8len ] = '\0';
+  char *acStop;
+  fValue = strtof(acNumber, &acStop);
+  return (u8len > 0) && (*acStop == '\0');
+}
+
+/**
+ * @brief
+ * Parses the text form of a rule table (see file header). Works on the
+ * given length, the text needs no terminator.
+ *
+ * @param acText        rules
+ * @param u16length     length of acText
+ * @param acNames       signal names, index = signal number
+ * @param u8signals     number of names
+ * @param table         result, only complete if true is returned
+ * @return false on a syntax error or too many rules
+ * @ingroup rules
+ */
+boolean ruleTableParse(const char *acText, uint16_t u16length, const char *const *acNames, uint8_t u8signals, rule_table_t *table)
+{
+  const char *acEnd = acText + u16length;
+  memset(table, 0, sizeof(rule_table_t));
+
+  while (acText < acEnd)
+  {
+    if (table->u8count >= RULES_MAX) return false;
+    control_rule_t *rule = &table->aRules[ table->u8count ];
+
+    // signal: name or index
+    const char *acField = acText;
+    while ((acText < acEnd) && (*acText != ',')) acText++;
+    uint8_t u8len = acText - acField;
+    rule->u8signal = 0xFF;
+    for (uint8_t i = 0; i < u8signals; i++)
+    {
+      if ((strlen(acNames[ i ]) == u8len) && (strncmp(acNames[ i ], acField, u8len) == 0)) rule->u8signal = i;
+    }
+    if ((rule->u8signal == 0xFF) && (u8len == 1) && (*acField >= '0') && (*acField <= '9')) rule->u8signal = *acField - '0';
+    if ((rule->u8signal >= u8signals) || (acText >= acEnd)) return false;
+    acText++;
+
+    if ((acText >= acEnd) || ((*acText != '<') && (*acText != '>'))) return false;
+    rule->u8comparator = (*acText++ == '<') ? RULE_BELOW : RULE_ABOVE;
+
+    float afField[ 6 ];
+    for (uint8_t f = 0; f < 6; f++)
+    {
+      if ((acText >= acEnd) || (*acText++ != ',')) return false;
+      if (!ruleParseFloat(acText, acEnd, afField[ f ])) return false;
+    }
+    if ((afField[ 2 ] < 0) || (afField[ 2 ] > 65535) || (afField[ 3 ] < 0) || (afField[ 3 ] > 65535)) return false;
+    if ((afField[ 4 ] < 0) || (afField[ 4 ] > 255) || (afField[ 5 ] < 0) || (afField[ 5 ] > 255)) return false;
+    rule->fOn = afField[ 0 ];
+    rule->fOff = afField[ 1 ];
+    rule->u16minOn = afField[ 2 ];
+    rule->u16minOff = afField[ 3 ];
+    rule->u8scheduleMask = afField[ 4 ];
+    rule->u8pin = afField[ 5 ];
+    table->u8count++;
+
+    if ((acText < acEnd) && (*acText++ != ';')) return false;
+  }
+  return true;
+}
+
+#endif // RULE_ENGINE_H
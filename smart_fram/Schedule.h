@@ -0,0 +1,271 @@
+/**
+ * @file Schedule.h
+ * @brief
+ * Weekly time-window schedule on integer local time.
+ *
+ * Each output channel has up to SCHEDULE_WINDOWS windows. A window has a
+ * weekday mask (bit 0 = Sunday .. bit 6 = Saturday) and start/end times in
+ * seconds since local midnight. A window whose end is not after its start
+ * runs past midnight and ends on the next day; the mask applies to the day
+ * it starts.
+ *
+ * evaluate() takes local unix seconds (e.g. NTPClient::getEpochTime(), which
+ * includes the UTC offset). When it recomputes, it also finds the next
+ * window boundary, so until then a call is one unsigned compare with no
+ * allocation. A clock that steps backwards (NTP correction) falls outside
+ * the cached span and forces a recompute as well.
+ *
+ * Text form used by parse() (e.g. from MQTT), windows separated by ';':
+ *   "<day mask>,<HH:MM[:SS]>-<HH:MM[:SS]>;..."
+ *   "127,06:00-22:00"             every day 06:00 to 22:00
+ *   "62,07:30-08:00;62,17:00-17:45" weekdays, two windows
+ *   ""                             no window: always off
+ *
+ * @defgroup schedule Schedule
+ */
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <Arduino.h>
+
+#define SCHEDULE_CHANNELS       4
+#define SCHEDULE_WINDOWS        4             //!< windows per channel
+#define SCHEDULE_DAY            86400UL       //!< seconds per day
+#define SCHEDULE_EVERY_DAY      0x7F
+
+/**
+ * @struct schedule_window_t
+ * @brief
+ * One on-window, repeated on the days of u8days.
+ */
+typedef struct
+{
+  uint8_t u8days;                             /*!< bit 0 = Sunday .. bit 6 = Saturday, 0 = unused */
+  uint32_t u32start;                          /*!< seconds since midnight, 0..86399 */
+  uint32_t u32end;                            /*!< seconds since midnight, <= u32start ends next day */
+}
+schedule_window_t;
+
+/**
+ * @class Schedule
+ * @brief
+ * Fixed tables of windows, evaluated to a bit mask of active channels.
+ */
+class Schedule
+{
+private:
+  schedule_window_t aWindows[ SCHEDULE_CHANNELS ][ SCHEDULE_WINDOWS ];
+  uint8_t u8active;                           //!< cached result, bit n = channel n
+  uint32_t u32from;                           //!< local time of the last recompute
+  uint32_t u32span;                           //!< seconds from u32from to the next boundary, 0 = stale
+
+  static uint8_t weekday(uint32_t u32day);
+  boolean windowActive(const schedule_window_t *window, uint32_t u32now);
+  uint32_t windowNext(const schedule_window_t *window, uint32_t u32now);
+  static boolean parseTime(const char *&acText, const char *acEnd, uint32_t &u32seconds);
+  static boolean parseNumber(const char *&acText, const char *acEnd, uint32_t u32max, uint32_t &u32value);
+
+public:
+  Schedule();
+
+  boolean setWindows(uint8_t u8channel, const schedule_window_t *windows, uint8_t u8count);
+  boolean parse(uint8_t u8channel, const char *acText, uint16_t u16length);  //!<text form, not '\0' terminated
+  uint8_t evaluate(uint32_t u32local);        //!<bit mask of active channels
+  uint32_t getNextTransition();               //!<local time of the next boundary, 0xFFFFFFFF if none
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+Schedule::Schedule()
+{
+  memset(aWindows, 0, sizeof(aWindows));
+  u8active = 0;
+  u32from = 0;
+  u32span = 0;
+}
+
+/**
+ * @brief
+ * Replaces the windows of a channel.
+ *
+ * @param u8channel  0..SCHEDULE_CHANNELS-1
+ * @param windows    new windows
+ * @param u8count    0..SCHEDULE_WINDOWS, 0 clears the channel
+ * @return false if an argument is out of range; nothing is changed then
+ * @ingroup schedule
+ */
+boolean Schedule::setWindows(uint8_t u8channel, const schedule_window_t *windows, uint8_t u8count)
+{
+  if ((u8channel >= SCHEDULE_CHANNELS) || (u8count > SCHEDULE_WINDOWS)) return false;
+  for (uint8_t i = 0; i < u8count; i++)
+  {
+    if ((windows[ i ].u32start >= SCHEDULE_DAY) || (windows[ i ].u32end >= SCHEDULE_DAY)) return false;
+  }
+
+  memset(aWindows[ u8channel ], 0, sizeof(aWindows[ u8channel ]));
+  memcpy(aWindows[ u8channel ], windows, u8count * sizeof(schedule_window_t));
+  u32span = 0;                                // recompute on the next evaluate()
+  return true;
+}
+
+/**
+ * @brief
+ * Replaces the windows of a channel from their text form (see file header).
+ *
+ * @return false on a syntax or range error; nothing is changed then
+ * @ingroup schedule
+ */
+boolean Schedule::parse(uint8_t u8channel, const char *acText, uint16_t u16length)
+{
+  schedule_window_t aParsed[ SCHEDULE_WINDOWS ];
+  uint8_t u8count = 0;
+  const char *acEnd = acText + u16length;
+
+  while (acText < acEnd)
+  {
+    uint32_t u32days;
+    if (u8count >= SCHEDULE_WINDOWS) return false;
+    if (!parseNumber(acText, acEnd, SCHEDULE_EVERY_DAY, u32days)) return false;
+    if ((acText >= acEnd) || (*acText++ != ',')) return false;
+    if (!parseTime(acText, acEnd, aParsed[ u8count ].u32start)) return false;
+    if ((acText >= acEnd) || (*acText++ != '-')) return false;
+    if (!parseTime(acText, acEnd, aParsed[ u8count ].u32end)) return false;
+    aParsed[ u8count ].u8days = u32days;
+    u8count++;
+    if ((acText < acEnd) && (*acText++ != ';')) return false;
+  }
+  return setWindows(u8channel, aParsed, u8count);
+}
+
+/**
+ * @brief
+ * Returns which channels are inside one of their windows.
+ *
+ * @param u32local  local unix seconds
+ * @return bit n set if channel n is active
+ * @ingroup schedule
+ */
+uint8_t Schedule::evaluate(uint32_t u32local)
+{
+  if ((uint32_t)(u32local - u32from) < u32span) return u8active;
+
+  uint32_t u32next = 0xFFFFFFFF;
+  u8active = 0;
+  for (uint8_t c = 0; c < SCHEDULE_CHANNELS; c++)
+  {
+    for (uint8_t w = 0; w < SCHEDULE_WINDOWS; w++)
+    {
+      const schedule_window_t *window = &aWindows[ c ][ w ];
+      if (window->u8days == 0) continue;
+      if (windowActive(window, u32local)) u8active |= 1 << c;
+      uint32_t u32boundary = windowNext(window, u32local);
+      if (u32boundary < u32next) u32next = u32boundary;
+    }
+  }
+  u32from = u32local;
+  u32span = u32next - u32local;
+  return u8active;
+}
+
+/**
+ * @brief
+ * @return local time at which evaluate() will next recompute
+ * @ingroup schedule
+ */
+uint32_t Schedule::getNextTransition()
+{
+  return u32from + u32span;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * @param u32day  days since 1970-01-01 (a Thursday)
+ * @return 0 = Sunday .. 6 = Saturday
+ */
+uint8_t Schedule::weekday(uint32_t u32day)
+{
+  return (u32day + 4) % 7;
+}
+
+/**
+ * @brief
+ * True if u32now lies in the occurrence of the window that started today
+ * or, for a window past midnight, yesterday.
+ */
+boolean Schedule::windowActive(const schedule_window_t *window, uint32_t u32now)
+{
+  uint32_t u32today = u32now / SCHEDULE_DAY;
+  for (uint8_t u8back = 0; (u8back <= 1) && (u8back <= u32today); u8back++)
+  {
+    uint32_t u32day = u32today - u8back;
+    if ((window->u8days & (1 << weekday(u32day))) == 0) continue;
+    uint32_t u32start = u32day * SCHEDULE_DAY + window->u32start;
+    uint32_t u32end = u32day * SCHEDULE_DAY + window->u32end;
+    if (window->u32end <= window->u32start) u32end += SCHEDULE_DAY;
+    if ((u32now >= u32start) && (u32now < u32end)) return true;
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * First start or end of the window strictly after u32now, looking one week
+ * ahead plus the occurrence still running from yesterday.
+ */
+uint32_t Schedule::windowNext(const schedule_window_t *window, uint32_t u32now)
+{
+  uint32_t u32today = u32now / SCHEDULE_DAY;
+  uint32_t u32next = 0xFFFFFFFF;
+  for (uint8_t u8offset = 0; u8offset <= 8; u8offset++)
+  {
+    if (u32today + u8offset < 1) continue;
+    uint32_t u32day = u32today + u8offset - 1;
+    if ((window->u8days & (1 << weekday(u32day))) == 0) continue;
+    uint32_t u32start = u32day * SCHEDULE_DAY + window->u32start;
+    uint32_t u32end = u32day * SCHEDULE_DAY + window->u32end;
+    if (window->u32end <= window->u32start) u32end += SCHEDULE_DAY;
+    if ((u32start > u32now) && (u32start < u32next)) u32next = u32start;
+    if ((u32end > u32now) && (u32end < u32next)) u32next = u32end;
+  }
+  return u32next;
+}
+
+/**
+ * @brief
+ * Parses HH:MM or HH:MM:SS into seconds since midnight.
+ */
+boolean Schedule::parseTime(const char *&acText, const char *acEnd, uint32_t &u32seconds)
+{
+  uint32_t u32h, u32m, u32s = 0;
+  if (!parseNumber(acText, acEnd, 23, u32h)) return false;
+  if ((acText >= acEnd) || (*acText++ != ':')) return false;
+  if (!parseNumber(acText, acEnd, 59, u32m)) return false;
+  if ((acText < acEnd) && (*acText == ':'))
+  {
+    acText++;
+    if (!parseNumber(acText, acEnd, 59, u32s)) return false;
+  }
+  u32seconds = u32h * 3600 + u32m * 60 + u32s;
+  return true;
+}
+
+/**
+ * @brief
+ * Parses an unsigned decimal number no larger than u32max.
+ */
+boolean Schedule::parseNumber(const char *&acText, const char *acEnd, uint32_t u32max, uint32_t &u32value)
+{
+  const char *acStart = acText;
+  u32value = 0;
+  while ((acText < acEnd) && (*acText >= '0') && (*acText <= '9'))
+  {
+    u32value = u32value * 10 + (*acText++ - '0');
+    if (u32value > u32max) return false;
+  }
+  return acText != acStart;
+}
+
+#endif // SCHEDULE_H
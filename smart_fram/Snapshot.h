@@ -0,0 +1,88 @@
+/**
+ * @file Snapshot.h
+ * @brief
+ * Lock-free single-producer / single-consumer latest-value buffer.
+ *
+ * A triple buffer: the producer fills its private slot and swaps it with
+ * the shared slot, the consumer swaps its private slot with the shared one
+ * when a fresh value is there. Neither side ever waits, and the consumer
+ * always sees a complete value, never a half-written one.
+ * Intermediate values are dropped if the producer is faster than the consumer.
+ *
+ * Exactly one task may write and exactly one task may read each Snapshot.
+ * A value that two tasks consume needs one Snapshot per consumer.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <Arduino.h>
+#include <atomic>
+
+template <typename T>
+class Snapshot
+{
+private:
+  static const uint8_t FRESH = 0x80;          //!< shared slot holds a value not yet taken
+  static const uint8_t INDEX = 0x03;
+
+  T aBuf[3];
+  std::atomic<uint8_t> u8shared;              //!< index of the shared slot | FRESH
+  uint8_t u8back;                             //!< producer's slot
+  uint8_t u8front;                            //!< consumer's slot
+
+public:
+  Snapshot() : aBuf(), u8shared(1), u8back(0), u8front(2) {}
+
+  /**
+   * @brief
+   * Producer: slot to fill before publish().
+   */
+  T *beginWrite()
+  {
+    return &aBuf[ u8back ];
+  }
+
+  /**
+   * @brief
+   * Producer: makes the slot returned by beginWrite() visible to the consumer.
+   */
+  void publish()
+  {
+    u8back = u8shared.exchange(u8back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  /**
+   * @brief
+   * Producer: copies value in and publishes it.
+   */
+  void write(const T &value)
+  {
+    aBuf[ u8back ] = value;
+    publish();
+  }
+
+  /**
+   * @brief
+   * Consumer: takes the latest published value, if any.
+   *
+   * @return true if read() now returns a newer value
+   */
+  boolean update()
+  {
+    if ((u8shared.load(std::memory_order_acquire) & FRESH) == 0) return false;
+    u8front = u8shared.exchange(u8front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  /**
+   * @brief
+   * Consumer: value taken by the last successful update().
+   */
+  const T &read() const
+  {
+    return aBuf[ u8front ];
+  }
+};
+
+#endif // SNAPSHOT_H
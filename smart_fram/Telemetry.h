@@ -0,0 +1,139 @@
+/**
+ * @file Telemetry.h
+ * @brief
+ * One-message telemetry frame replacing the per-signal MQTT publishes.
+ *
+ * A sample is serialized into a caller-owned static buffer, without heap
+ * allocation, in one of two formats:
+ *
+ * TELEMETRY_BINARY (20 bytes, little-endian):
+ * | off | size | field                                   |
+ * |-----|------|-----------------------------------------|
+ * |  0  |  1   | version (TELEMETRY_VERSION)             |
+ * |  1  |  1   | flags (TELEMETRY_FLAG_*)                |
+ * |  2  |  2   | sequence number, wraps at 65535         |
+ * |  4  |  4   | sample time, unix seconds (UTC)         |
+ * |  8  |  2   | soil moisture, percent (int16)          |
+ * | 10  |  4   | light, lux (float32)                    |
+ * | 14  |  2   | N, mg/kg                                |
+ * | 16  |  2   | P, mg/kg                                |
+ * | 18  |  2   | K, mg/kg                                |
+ *
+ * TELEMETRY_JSON:
+ *   {"v":1,"seq":12,"t":1735689600,"f":0,"m":45,"lux":123.45,"n":10,"p":20,"k":30}
+ *
+ * The binary frame never starts with '{', so a receiver can tell the two apart
+ * from the first byte. The decoder lives in raspberryPi/main.py.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+
+#define TELEMETRY_VERSION         1
+#define TELEMETRY_BINARY_SIZE     20          //!< bytes of a binary frame
+#define TELEMETRY_JSON_MAX        112         //!< worst-case length of a JSON frame incl. '\0'
+
+enum TELEMETRY_FORMATS
+{
+  TELEMETRY_BINARY             = 0,
+  TELEMETRY_JSON               = 1
+};
+
+enum TELEMETRY_FLAGS
+{
+  TELEMETRY_FLAG_NPK_STALE     = 0x01,        //!< no valid NPK answer since the last frame
+  TELEMETRY_FLAG_TIME_UNSET    = 0x02         //!< NTP not synchronised, time is seconds since boot
+};
+
+/**
+ * @struct telemetry_sample_t
+ * @brief
+ * One set of readings to send.
+ */
+typedef struct
+{
+  uint32_t u32time;                           /*!< unix seconds (UTC) */
+  uint8_t u8flags;                            /*!< TELEMETRY_FLAG_* */
+  int16_t i16moisture;                        /*!< soil moisture, percent */
+  float fLux;                                 /*!< light, lux */
+  uint16_t u16n, u16p, u16k;                  /*!< soil N, P, K */
+}
+telemetry_sample_t;
+
+/**
+ * @brief
+ * Serializes a sample as a TELEMETRY_BINARY frame.
+ *
+ * @param sample    readings
+ * @param u16seq    frame sequence number
+ * @param au8buf    output buffer
+ * @param u16size   size of au8buf
+ * @return frame length, 0 if au8buf is too small
+ */
+uint16_t telemetryPackBinary(const telemetry_sample_t *sample, uint16_t u16seq, uint8_t *au8buf, uint16_t u16size)
+{
+  if (u16size < TELEMETRY_BINARY_SIZE) return 0;
+
+  uint32_t u32lux;
+  memcpy(&u32lux, &sample->fLux, sizeof(u32lux));
+
+  au8buf[ 0 ]  = TELEMETRY_VERSION;
+  au8buf[ 1 ]  = sample->u8flags;
+  au8buf[ 2 ]  = lowByte(u16seq);
+  au8buf[ 3 ]  = highByte(u16seq);
+  au8buf[ 4 ]  = sample->u32time;
+  au8buf[ 5 ]  = sample->u32time >> 8;
+  au8buf[ 6 ]  = sample->u32time >> 16;
+  au8buf[ 7 ]  = sample->u32time >> 24;
+  au8buf[ 8 ]  = lowByte((uint16_t)sample->i16moisture);
+  au8buf[ 9 ]  = highByte((uint16_t)sample->i16moisture);
+  au8buf[ 10 ] = u32lux;
+  au8buf[ 11 ] = u32lux >> 8;
+  au8buf[ 12 ] = u32lux >> 16;
+  au8buf[ 13 ] = u32lux >> 24;
+  au8buf[ 14 ] = lowByte(sample->u16n);
+  au8buf[ 15 ] = highByte(sample->u16n);
+  au8buf[ 16 ] = lowByte(sample->u16p);
+  au8buf[ 17 ] = highByte(sample->u16p);
+  au8buf[ 18 ] = lowByte(sample->u16k);
+  au8buf[ 19 ] = highByte(sample->u16k);
+
+  return TELEMETRY_BINARY_SIZE;
+}
+
+/**
+ * @brief
+ * Serializes a sample as a TELEMETRY_JSON frame (not '\0'-terminated on the wire).
+ *
+ * @param sample    readings
+ * @param u16seq    frame sequence number
+ * @param au8buf    output buffer, TELEMETRY_JSON_MAX bytes is always enough
+ * @param u16size   size of au8buf
+ * @return frame length, 0 if au8buf is too small
+ */
+uint16_t telemetryPackJson(const telemetry_sample_t *sample, uint16_t u16seq, uint8_t *au8buf, uint16_t u16size)
+{
+  int iLen = snprintf((char *)au8buf, u16size,
+                      "{\"v\":%u,\"seq\":%u,\"t\":%lu,\"f\":%u,\"m\":%d,\"lux\":%.2f,\"n\":%u,\"p\":%u,\"k\":%u}",
+                      TELEMETRY_VERSION, u16seq, (unsigned long)sample->u32time, sample->u8flags,
+                      sample->i16moisture, sample->fLux, sample->u16n, sample->u16p, sample->u16k);
+  if ((iLen < 0) || (iLen >= u16size)) return 0;
+  return iLen;
+}
+
+/**
+ * @brief
+ * Serializes a sample in the requested format.
+ *
+ * @param u8format  TELEMETRY_BINARY or TELEMETRY_JSON
+ * @return frame length, 0 on error
+ */
+uint16_t telemetryPack(const telemetry_sample_t *sample, uint16_t u16seq, uint8_t u8format, uint8_t *au8buf, uint16_t u16size)
+{
+  if (u8format == TELEMETRY_JSON) return telemetryPackJson(sample, u16seq, au8buf, u16size);
+  return telemetryPackBinary(sample, u16seq, au8buf, u16size);
+}
+
+#endif // TELEMETRY_H
@@ -0,0 +1,277 @@
+/**
+ * @file TelemetryStore.h
+ * @brief
+ * Flash-backed store-and-forward ring for telemetry frames.
+ *
+ * Frames that cannot be published are appended to a preallocated file of
+ * fixed-size records and drained after the broker comes back.
+ *
+ * Record layout (STORE_RECORD_SIZE bytes):
+ * | off | size | field                                          |
+ * |-----|------|------------------------------------------------|
+ * |  0  |  4   | sequence number, little-endian, 1..0xFFFFFFFE  |
+ * |  4  |  20  | TELEMETRY_BINARY frame                         |
+ * | 24  |  2   | CRC16 (modbusCRC16) over bytes 0..23           |
+ * | 26  |  6   | 0xFF padding                                   |
+ *
+ * Record n lives in slot n % capacity, so appending is one seek and one
+ * write (O(1)) and successive appends walk the whole file, spreading wear
+ * evenly on top of LittleFS's own wear levelling. When the ring is full the
+ * oldest unsent record is overwritten.
+ *
+ * The sequence number of the last drained record is kept in "<path>.ack",
+ * written once per drained batch. At boot the file is scanned once to find
+ * the newest record; RAM use is one record whatever the capacity.
+ */
+
+#ifndef TELEMETRY_STORE_H
+#define TELEMETRY_STORE_H
+
+#include <FS.h>
+#include "ETT_ModbusRTU.h"
+#include "Telemetry.h"
+
+#define STORE_RECORD_SIZE     32
+#define STORE_FRAME_OFFSET    4
+#define STORE_CRC_OFFSET      (STORE_FRAME_OFFSET + TELEMETRY_BINARY_SIZE)
+#define STORE_PATH_MAX        32
+
+/**
+ * @class TelemetryStore
+ * @brief
+ * Persistent FIFO of TELEMETRY_BINARY frames.
+ */
+class TelemetryStore
+{
+private:
+  fs::FS *fs;
+  char acPath[ STORE_PATH_MAX ];
+  char acAckPath[ STORE_PATH_MAX + 4 ];
+  uint16_t u16capacity;
+  uint32_t u32head;                           //!< sequence number of the next record to write
+  uint32_t u32tail;                           //!< sequence number of the oldest unsent record
+  uint32_t u32acked;                          //!< last sequence number persisted in the ack file
+  uint16_t u16dropped;                        //!< records overwritten before they were sent
+  uint8_t au8record[ STORE_RECORD_SIZE ];
+  fs::File file;
+
+  boolean readRecord(uint32_t u32seq);
+  uint32_t recordSeq();
+
+public:
+  TelemetryStore(fs::FS &fs, const char *path, uint16_t u16capacity);
+
+  boolean begin();                            //!<open or create the ring, recover head and tail
+  boolean append(const uint8_t *au8frame);    //!<store one TELEMETRY_BINARY frame
+  uint16_t available();                       //!<records waiting to be sent
+  boolean peek(uint8_t *au8frame);            //!<oldest unsent frame
+  void pop();                                 //!<mark the frame returned by peek() as sent
+  void commit();                              //!<persist the drain position
+  uint16_t getDropped();                      //!<frames lost to overflow since boot
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param fs           mounted file system, e.g. LittleFS
+ * @param path         ring file, e.g. "/telemetry.bin"
+ * @param u16capacity  number of records
+ */
+TelemetryStore::TelemetryStore(fs::FS &fs, const char *path, uint16_t u16capacity)
+{
+  this->fs = &fs;
+  this->u16capacity = u16capacity;
+  strncpy(acPath, path, sizeof(acPath) - 1);
+  acPath[ sizeof(acPath) - 1 ] = '\0';
+  snprintf(acAckPath, sizeof(acAckPath), "%s.ack", acPath);
+  u32head = u32tail = 1;
+  u32acked = 0;
+  u16dropped = 0;
+}
+
+/**
+ * @brief
+ * Opens the ring file, creating it erased if missing or of the wrong size,
+ * and recovers the write and drain positions.
+ *
+ * @return false if the file system is not usable
+ */
+boolean TelemetryStore::begin()
+{
+  uint32_t u32size = (uint32_t)u16capacity * STORE_RECORD_SIZE;
+
+  file = fs->open(acPath, "r+");
+  if (!file || (file.size() != u32size))
+  {
+    if (file) file.close();
+    file = fs->open(acPath, "w+");
+    if (!file) return false;
+    memset(au8record, 0xFF, sizeof(au8record));
+    for (uint16_t i = 0; i < u16capacity; i++) file.write(au8record, sizeof(au8record));
+    file.flush();
+    fs->remove(acAckPath);
+  }
+
+  // newest record gives the write position
+  uint32_t u32newest = 0;
+  for (uint16_t i = 0; i < u16capacity; i++)
+  {
+    file.seek((uint32_t)i * STORE_RECORD_SIZE);
+    if (file.read(au8record, sizeof(au8record)) != sizeof(au8record)) break;
+    uint32_t u32seq = recordSeq();
+    if ((u32seq != 0) && (u32seq > u32newest)) u32newest = u32seq;
+  }
+  u32head = u32newest + 1;
+
+  fs::File ack = fs->open(acAckPath, "r");
+  if (ack)
+  {
+    uint8_t au8ack[ 4 ];
+    if (ack.read(au8ack, sizeof(au8ack)) == sizeof(au8ack))
+    {
+      u32acked = (uint32_t)au8ack[ 0 ] | ((uint32_t)au8ack[ 1 ] << 8)
+               | ((uint32_t)au8ack[ 2 ] << 16) | ((uint32_t)au8ack[ 3 ] << 24);
+    }
+    ack.close();
+  }
+  if (u32acked >= u32head) u32acked = u32head - 1;
+
+  u32tail = u32acked + 1;
+  if (u32head - u32tail > u16capacity) u32tail = u32head - u16capacity;
+  return true;
+}
+
+/**
+ * @brief
+ * Appends a frame, overwriting the oldest unsent one when the ring is full.
+ *
+ * @param au8frame  TELEMETRY_BINARY_SIZE bytes
+ * @return false on a write error
+ */
+boolean TelemetryStore::append(const uint8_t *au8frame)
+{
+  if (!file) return false;
+
+  au8record[ 0 ] = u32head;
+  au8record[ 1 ] = u32head >> 8;
+  au8record[ 2 ] = u32head >> 16;
+  au8record[ 3 ] = u32head >> 24;
+  memcpy(&au8record[ STORE_FRAME_OFFSET ], au8frame, TELEMETRY_BINARY_SIZE);
+  uint16_t u16crc = modbusCRC16(au8record, STORE_CRC_OFFSET);
+  au8record[ STORE_CRC_OFFSET ]     = lowByte(u16crc);
+  au8record[ STORE_CRC_OFFSET + 1 ] = highByte(u16crc);
+  memset(&au8record[ STORE_CRC_OFFSET + 2 ], 0xFF, STORE_RECORD_SIZE - STORE_CRC_OFFSET - 2);
+
+  file.seek((u32head % u16capacity) * STORE_RECORD_SIZE);
+  if (file.write(au8record, sizeof(au8record)) != sizeof(au8record)) return false;
+  file.flush();
+
+  u32head++;
+  if (u32head - u32tail > u16capacity)
+  {
+    u32tail = u32head - u16capacity;
+    u16dropped++;
+  }
+  return true;
+}
+
+/**
+ * @brief
+ * @return number of frames waiting to be sent
+ */
+uint16_t TelemetryStore::available()
+{
+  return u32head - u32tail;
+}
+
+/**
+ * @brief
+ * Copies the oldest unsent frame. Records that fail their CRC or were never
+ * written are skipped.
+ *
+ * @param au8frame  TELEMETRY_BINARY_SIZE bytes
+ * @return false if nothing is waiting
+ */
+boolean TelemetryStore::peek(uint8_t *au8frame)
+{
+  while (u32tail != u32head)
+  {
+    if (readRecord(u32tail))
+    {
+      memcpy(au8frame, &au8record[ STORE_FRAME_OFFSET ], TELEMETRY_BINARY_SIZE);
+      return true;
+    }
+    u32tail++;
+  }
+  return false;
+}
+
+/**
+ * @brief
+ * Marks the frame returned by peek() as sent. Call commit() after a batch.
+ */
+void TelemetryStore::pop()
+{
+  if (u32tail != u32head) u32tail++;
+}
+
+/**
+ * @brief
+ * Persists the drain position so sent frames are not replayed after a reboot.
+ * One small write per call: call it once per drained batch, not per frame.
+ */
+void TelemetryStore::commit()
+{
+  if (u32tail - 1 == u32acked) return;
+  u32acked = u32tail - 1;
+
+  uint8_t au8ack[ 4 ] = { (uint8_t)u32acked, (uint8_t)(u32acked >> 8),
+                          (uint8_t)(u32acked >> 16), (uint8_t)(u32acked >> 24) };
+  fs::File ack = fs->open(acAckPath, "w");
+  if (!ack) return;
+  ack.write(au8ack, sizeof(au8ack));
+  ack.close();
+}
+
+/**
+ * @brief
+ * @return frames overwritten before they could be sent, since boot
+ */
+uint16_t TelemetryStore::getDropped()
+{
+  return u16dropped;
+}
+
+/* _____PRIVATE FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Loads the slot of u32seq into au8record.
+ *
+ * @return true if the slot holds an intact copy of that record
+ */
+boolean TelemetryStore::readRecord(uint32_t u32seq)
+{
+  file.seek((u32seq % u16capacity) * STORE_RECORD_SIZE);
+  if (file.read(au8record, sizeof(au8record)) != sizeof(au8record)) return false;
+  return recordSeq() == u32seq;
+}
+
+/**
+ * @brief
+ * @return sequence number of au8record, 0 if it is erased or corrupt
+ */
+uint32_t TelemetryStore::recordSeq()
+{
+  uint16_t u16crc = word(au8record[ STORE_CRC_OFFSET + 1 ], au8record[ STORE_CRC_OFFSET ]);
+  if (modbusCRC16(au8record, STORE_CRC_OFFSET) != u16crc) return 0;
+
+  uint32_t u32seq = (uint32_t)au8record[ 0 ] | ((uint32_t)au8record[ 1 ] << 8)
+                  | ((uint32_t)au8record[ 2 ] << 16) | ((uint32_t)au8record[ 3 ] << 24);
+  return (u32seq == 0xFFFFFFFF) ? 0 : u32seq;
+}
+
+#endif // TELEMETRY_STORE_H
@@ -0,0 +1,278 @@
+/**
+ * @file TopicRouter.h
+ * @brief
+ * Allocation-free dispatch of inbound MQTT messages to handlers.
+ *
+ * Routes live in a const table whose hashes and lengths are computed by
+ * the compiler (TOPIC_EXACT / TOPIC_PREFIX). dispatch() walks the topic
+ * once, computing a running FNV-1a hash. A route is compared with
+ * memcmp() only when its length and hash match, either at the end of the
+ * topic (exact route) or at its own length (prefix route, the rest of the
+ * topic is passed to the handler as the suffix). The first match wins.
+ *
+ * The payload is never copied or terminated: PubSubClient hands out its
+ * receive buffer, and writing payload[length] would overrun it when the
+ * message fills the buffer. topicParseInt() and topicParseFloat() parse
+ * a bounded payload in place and check its range.
+ *
+ * @defgroup topics Topic router
+ */
+
+#ifndef TOPIC_ROUTER_H
+#define TOPIC_ROUTER_H
+
+#include <Arduino.h>
+
+#define TOPIC_HASH_SEED         2166136261UL  //!< FNV-1a offset basis
+#define TOPIC_HASH_PRIME        16777619UL
+#define TOPIC_NUMBER_MAX        16            //!< longest numeric payload accepted
+
+constexpr uint32_t topicHash(const char *acText, uint32_t u32hash = TOPIC_HASH_SEED)
+{
+  return *acText ? topicHash(acText + 1, (u32hash ^ (uint8_t)*acText) * TOPIC_HASH_PRIME) : u32hash;
+}
+
+constexpr uint8_t topicLength(const char *acText)
+{
+  return *acText ? 1 + topicLength(acText + 1) : 0;
+}
+
+/**
+ * @brief
+ * Handler of one route.
+ *
+ * @param acSuffix   rest of the topic after a prefix route ("" for exact routes), not terminated
+ * @param u8suffix   length of acSuffix
+ * @param au8payload message body, not terminated
+ * @param u16length  length of au8payload
+ */
+typedef void (*topic_handler_t)(const char *acSuffix, uint8_t u8suffix, const uint8_t *au8payload, uint16_t u16length);
+
+/**
+ * @struct topic_route_t
+ * @brief
+ * One entry of the route table; build it with TOPIC_EXACT or TOPIC_PREFIX.
+ */
+typedef struct
+{
+  const char *acTopic;                        /*!< topic, or prefix ending in '/' */
+  uint8_t u8length;                           /*!< strlen(acTopic) */
+  boolean bPrefix;                            /*!< match topics that start with acTopic */
+  uint32_t u32hash;                           /*!< topicHash(acTopic) */
+  topic_handler_t handler;
+}
+topic_route_t;
+
+#define TOPIC_EXACT(topic, handler)   { topic, topicLength(topic), false, topicHash(topic), handler }
+#define TOPIC_PREFIX(topic, handler)  { topic, topicLength(topic), true, topicHash(topic), handler }
+
+/**
+ * @class TopicRouter
+ * @brief
+ * Dispatches topics over a const route table.
+ */
+class TopicRouter
+{
+private:
+  const topic_route_t *aRoutes;
+  uint8_t u8routes;
+  uint8_t u8prefixMin;                        //!< shortest prefix route, 0xFF if none
+  uint8_t u8prefixMax;                        //!< longest prefix route
+  uint32_t u32unmatched;
+
+public:
+  TopicRouter(const topic_route_t *aRoutes, uint8_t u8routes);
+
+  boolean dispatch(const char *acTopic, const uint8_t *au8payload, uint16_t u16length); //!<false if no route matched
+  uint8_t getFilter(uint8_t u8route, char *acFilter, uint8_t u8size); //!<subscription filter of a route
+  uint8_t getCount();
+  uint32_t getUnmatched();
+};
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+
+/**
+ * @brief
+ * Constructor.
+ *
+ * @param aRoutes   route table, must outlive the router
+ * @param u8routes  number of entries
+ * @ingroup topics
+ */
+TopicRouter::TopicRouter(const topic_route_t *aRoutes, uint8_t u8routes)
+{
+  this->aRoutes = aRoutes;
+  this->u8routes = u8routes;
+  u8prefixMin = 0xFF;
+  u8prefixMax = 0;
+  u32unmatched = 0;
+  for (uint8_t i = 0; i < u8routes; i++)
+  {
+    if (!aRoutes[ i ].bPrefix) continue;
+    if (aRoutes[ i ].u8length < u8prefixMin) u8prefixMin = aRoutes[ i ].u8length;
+    if (aRoutes[ i ].u8length > u8prefixMax) u8prefixMax = aRoutes[ i ].u8length;
+  }
+}
+
+/**
+ * @brief
+ * Calls the handler of the first route matching the topic.
+ *
+ * @param acTopic     '\0' terminated topic
+ * @param au8payload  message body
+ * @param u16length   length of au8payload
+ * @return true if a handler was called
+ * @ingroup topics
+ */
+boolean TopicRouter::dispatch(const char *acTopic, const uint8_t *au8payload, uint16_t u16length)
+{
+  uint32_t u32hash = TOPIC_HASH_SEED;
+  uint8_t u8length = 0;
+
+  while (acTopic[ u8length ] != '\0')
+  {
+    if (u8length == 0xFF)
+    {
+      u32unmatched++;
+      return false;
+    }
+    u32hash = (u32hash ^ (uint8_t)acTopic[ u8length ]) * TOPIC_HASH_PRIME;
+    u8length++;
+
+    if ((u8length < u8prefixMin) || (u8length > u8prefixMax)) continue;
+    for (uint8_t i = 0; i < u8routes; i++)
+    {
+      const topic_route_t *route = &aRoutes[ i ];
+      if (!route->bPrefix || (route->u8length != u8length) || (route->u32hash != u32hash)) continue;
+      if (memcmp(route->acTopic, acTopic, u8length) != 0) continue;
+      const char *acSuffix = acTopic + u8length;
+      route->handler(acSuffix, strlen(acSuffix), au8payload, u16length);
+      return true;
+    }
+  }
+
+  for (uint8_t i = 0; i < u8routes; i++)
+  {
+    const topic_route_t *route = &aRoutes[ i ];
+    if (route->bPrefix || (route->u8length != u8length) || (route->u32hash != u32hash)) continue;
+    if (memcmp(route->acTopic, acTopic, u8length) != 0) continue;
+    route->handler("", 0, au8payload, u16length);
+    return true;
+  }
+  u32unmatched++;
+  return false;
+}
+
+/**
+ * @brief
+ * Writes the subscription filter of a route: the topic itself, or the
+ * prefix followed by '+'.
+ *
+ * @return length written, 0 if the route does not exist or acFilter is too small
+ * @ingroup topics
+ */
+uint8_t TopicRouter::getFilter(uint8_t u8route, char *acFilter, uint8_t u8size)
+{
+  if (u8route >= u8routes) return 0;
+  const topic_route_t *route = &aRoutes[ u8route ];
+  uint8_t u8length = route->u8length + (route->bPrefix ? 1 : 0);
+  if (u8length >= u8size) return 0;
+
+  memcpy(acFilter, route->acTopic, route->u8length);
+  if (route->bPrefix) acFilter[ route->u8length ] = '+';
+  acFilter[ u8length ] = '\0';
+  return u8length;
+}
+
+/**
+ * @brief
+ * @return number of routes
+ * @ingroup topics
+ */
+uint8_t TopicRouter::getCount()
+{
+  return u8routes;
+}
+
+/**
+ * @brief
+ * @return messages that matched no route
+ * @ingroup topics
+ */
+uint32_t TopicRouter::getUnmatched()
+{
+  return u32unmatched;
+}
+
+/* _____HELPERS_______________________________________________________________ */
+
+/**
+ * @brief
+ * Parses a signed decimal integer that fills the whole text.
+ *
+ * @return false on a syntax error or a value outside i32min..i32max
+ * @ingroup topics
+ */
+boolean topicParseInt(const char *acText, uint16_t u16length, int32_t i32min, int32_t i32max, int32_t &i32value)
+{
+  if ((u16length == 0) || (u16length > TOPIC_NUMBER_MAX)) return false;
+  const char *acEnd = acText + u16length;
+  boolean bNegative = (*acText == '-');
+  if (bNegative || (*acText == '+')) acText++;
+  if (acText >= acEnd) return false;
+
+  int64_t i64value = 0;
+  while (acText < acEnd)
+  {
+    if ((*acText < '0') || (*acText > '9')) return false;
+    i64value = i64value * 10 + (*acText++ - '0');
+    if (i64value > 0x80000000LL) return false;
+  }
+  if (bNegative) i64value = -i64value;
+  if ((i64value < i32min) || (i64value > i32max)) return false;
+  i32value = i64value;
+  return true;
+}
+
+/**
+ * @brief
+ * Parses a decimal number, optionally with a fraction ("12", "-3.5", ".25"),
+ * that fills the whole text. No exponent, no locale.
+ *
+ * @return false on a syntax error or a value outside fMin..fMax
+ * @ingroup topics
+ */
+boolean topicParseFloat(const char *acText, uint16_t u16length, float fMin, float fMax, float &fValue)
+{
+  if ((u16length == 0) || (u16length > TOPIC_NUMBER_MAX)) return false;
+  const char *acEnd = acText + u16length;
+  boolean bNegative = (*acText == '-');
+  if (bNegative || (*acText == '+')) acText++;
+
+  uint32_t u32mantissa = 0;
+  uint32_t u32scale = 1;
+  uint8_t u8digits = 0;
+  boolean bPoint = false;
+  while (acText < acEnd)
+  {
+    if ((*acText == '.') && !bPoint)
+    {
+      bPoint = true;
+      acText++;
+      continue;
+    }
+    if ((*acText < '0') || (*acText > '9')) return false;
+    if (++u8digits > 9) return false;         // keeps the mantissa and scale in 32 bits
+    u32mantissa = u32mantissa * 10 + (*acText++ - '0');
+    if (bPoint) u32scale *= 10;
+  }
+  if (u8digits == 0) return false;
+
+  float fParsed = (float)u32mantissa / u32scale;
+  if (bNegative) fParsed = -fParsed;
+  if ((fParsed < fMin) || (fParsed > fMax)) return false;
+  fValue = fParsed;
+  return true;
+}
+
+#endif // TOPIC_ROUTER_H
@@ -1,27 +1,263 @@
-void callback(char* topic, byte* payload, unsigned int length) {
-  payload[length] = '\0';
-  String topic_str = topic, payload_str = (char*)payload;
-  Serial.println("[" + topic_str + "]: " + payload_str);
-  if (topic_str == "esp32/moisture_percent") {
-    if (payload_str == "20") {
-      moistureValue_percent_compare = 20;
-    } else if (payload_str == "40") {
-      moistureValue_percent_compare = 40;
-    } else if (payload_str == "60") {
-      moistureValue_percent_compare = 60;
-    } else if (payload_str == "80") {
-      moistureValue_percent_compare = 80;
-    }
+// เลื่อน on threshold ของทุกกฎบนสัญญาณนี้ คงช่วง hysteresis ไว้
+void moveSetpoint(uint8_t signal, float value) {
+  for (uint8_t i = 0; i < ruleTable.u8count; i++) {
+    control_rule_t &rule = ruleTable.aRules[i];
+    if (rule.u8signal != signal) continue;
+    float width = rule.fOff - rule.fOn;
+    rule.fOn = value;
+    rule.fOff = value + width;
+  }
+  rulesToControl.write(ruleTable);
+}
+
+void onMoisturePercent(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  int32_t value;
+  if (!topicParseInt((const char *)payload, length, 0, 100, value)) {
+    Serial.println("Invalid moisture setpoint");
+    return;
+  }
+  moistureValue_percent_compare = value;
+  moveSetpoint(SIGNAL_MOISTURE, value);
+}
+
+void onSetpoint(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  float value;
+  for (uint8_t i = 0; i < SIGNAL_COUNT; i++) {
+    if (strlen(signalName[i]) != suffixLength || memcmp(signalName[i], suffix, suffixLength) != 0) continue;
+    if (!topicParseFloat((const char *)payload, length, -100000, 100000, value)) break;
+    if (i == SIGNAL_MOISTURE) moistureValue_percent_compare = constrain(value, 0, 100);
+    moveSetpoint(i, value);
+    return;
+  }
+  Serial.println("Invalid setpoint");
+}
+
+void onRules(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  rule_table_t parsed;
+  if (ruleTableParse((const char *)payload, length, signalName, SIGNAL_COUNT, &parsed) && rules.check(parsed)) {
+    ruleTable = parsed;
+    rulesToControl.write(ruleTable);  // controlTask เห็นทั้งชุดพร้อมกัน ไม่มีครึ่งตาราง
+  } else {
+    Serial.println("Invalid rules");
+  }
+}
+
+void onSchedule(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  int32_t relay;  // 1, 2
+  if (!topicParseInt(suffix, suffixLength, 1, SCHEDULE_CHANNELS, relay) || !schedule.parse(relay - 1, (const char *)payload, length)) {
+    Serial.println("Invalid schedule");
+  }
+}
+
+void onRelay(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  int32_t relay;  // 1, 2
+  if (!topicParseInt(suffix, suffixLength, 1, sizeof(relayPins), relay)) {
+    Serial.println("Invalid relay");
+    return;
+  }
+  uint8_t bit = 1 << (relay - 1);
+  if (length == 2 && memcmp(payload, "on", 2) == 0) {
+    relayOn |= bit;
+    relayOff &= ~bit;
+  } else if (length == 3 && memcmp(payload, "off", 3) == 0) {
+    relayOn &= ~bit;
+    relayOff |= bit;
+  } else if (length == 4 && memcmp(payload, "auto", 4) == 0) {
+    relayOn &= ~bit;
+    relayOff &= ~bit;
+  } else {
+    Serial.println("Invalid relay command");
   }
 }
 
+void onModbusStatsGet(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  modbusStatsRequested = true;  // ส่งจาก networkTask, ไม่ publish ใน callback
+}
+
+void onModbusScan(const char *suffix, uint8_t suffixLength, const uint8_t *payload, uint16_t length) {
+  modbusScanRequested = true;  // modbusTask เริ่มสแกนใหม่
+}
+
+// topic ที่รับ: hash และความยาวคำนวณตอน compile, เพิ่ม topic ใหม่ได้ที่นี่ที่เดียว (subscribe ให้อัตโนมัติ)
+const topic_route_t topicRoutes[] = {
+  TOPIC_EXACT("esp32/moisture_percent", onMoisturePercent),
+  TOPIC_PREFIX(SETPOINT_TOPIC, onSetpoint),
+  TOPIC_EXACT(RULES_TOPIC, onRules),
+  TOPIC_PREFIX(SCHEDULE_TOPIC, onSchedule),
+  TOPIC_PREFIX(RELAY_TOPIC, onRelay),
+  TOPIC_EXACT(MODBUS_STATS_GET, onModbusStatsGet),
+  TOPIC_EXACT(DEVICES_SCAN_TOPIC, onModbusScan),
+};
+TopicRouter topicRouter(topicRoutes, sizeof(topicRoutes) / sizeof(topicRoutes[0]));
+
+// payload ไม่มี '\0' ต่อท้าย และห้ามเขียนต่อท้าย (อาจเกิน Buffer ของ PubSubClient)
+void callback(char* topic, byte* payload, unsigned int length) {
+  Serial.printf("[%s]: %.*s\n", topic, (int)min(length, 64U), (const char *)payload);
+  if (!topicRouter.dispatch(topic, payload, length)) Serial.println("Unknown topic");
+}
+
 void moistureSensor() {
-  moistureValue = analogRead(MOISTURE_PIN);
-  moistureValue_percent = (moistureValue - 0) * (0 - 100) / (4095 - 0) + 100;
+  int32_t millivolts;
+  if (adc.isRunning()) {
+    adc.poll();  // ย้ายค่าที่ DMA เก็บไว้ผ่าน median/boxcar
+    moistureValue = adc.getRaw(moistureAdc);
+    millivolts = adc.getMilliVolts(moistureAdc);
+  } else {
+    moistureValue = analogRead(MOISTURE_PIN);
+    millivolts = adc.toMilliVolts(moistureValue);
+  }
+  moistureValue_percent = constrain((MOISTURE_DRY_MV - millivolts) * 100 / (MOISTURE_DRY_MV - MOISTURE_WET_MV), 0, 100);
   //  Serial.printf("Moisture: %d Percent: %d\n", moistureValue, moistureValue_percent);
 }
 
 void lightSensor() {
-  lightIntensity = lightMeter.readLightLevel(); // อ่านค่า Analog จากขา 34
+  if (lightMeter.poll()) lightIntensity = lightMeter.getLux();  // I2C เฉพาะตอนสั่งแปลงค่าและเมื่อแปลงเสร็จ
   //  Serial.printf("Light Intensity: %d\n", lightIntensity);
 }
+
+void mqttSubscribe() {
+  char filter[64];
+  for (uint8_t i = 0; i < topicRouter.getCount(); i++) {
+    if (topicRouter.getFilter(i, filter, sizeof(filter)) > 0) mqtt.subscribe(filter);
+  }
+}
+
+// Register map ของ Modbus Slave (FC3/FC4 อ่านชุดเดียวกัน, อ่านอย่างเดียว) ค่าล่าสุดจาก controlToModbus
+// 0x0000 ความชื้น %, 0x0001 ค่า ADC, 0x0002-0x0003 แสง lux (uint32, word สูงก่อน)
+// 0x0100 N, 0x0101 P, 0x0102 K
+// 0x0200 Relay (bit n = Relay n+1), 0x0201 ช่วงเวลา (bit n = channel n)
+// 0x0300 + 2*i กฎ i: on threshold x10, +1 off threshold x10 (int16)
+uint16_t slaveReadSensor(uint16_t offset) {
+  const node_status_t &status = controlToModbus.read();
+  uint32_t lux = status.sensor.lightIntensity;
+  switch (offset) {
+    case 0: return status.sensor.moistureValue_percent;
+    case 1: return status.sensor.moistureValue;
+    case 2: return lux >> 16;
+    default: return lux & 0xFFFF;
+  }
+}
+
+uint16_t slaveReadNpk(uint16_t offset) {
+  const npk_reading_t &npk = controlToModbus.read().npk;
+  return (offset == 0) ? npk.soil_n : (offset == 1) ? npk.soil_p : npk.soil_k;
+}
+
+uint16_t slaveReadOutputs(uint16_t offset) {
+  const node_status_t &status = controlToModbus.read();
+  return (offset == 0) ? status.relays : status.scheduleMask;
+}
+
+uint16_t slaveReadRules(uint16_t offset) {
+  const node_status_t &status = controlToModbus.read();
+  return (offset % 2 == 0) ? status.ruleOn[offset / 2] : status.ruleOff[offset / 2];
+}
+
+const modbus_register_t slaveRegisters[] = {  // เรียงตาม address
+  { 0x0000, 4, slaveReadSensor, NULL },
+  { 0x0100, 3, slaveReadNpk, NULL },
+  { 0x0200, 2, slaveReadOutputs, NULL },
+  { 0x0300, 2 * RULES_MAX, slaveReadRules, NULL },
+};
+
+void modbusRxEvent() {
+  master.rxEvent();  // ย้ายเฟรมตอบกลับเข้า Buffer ของ Telegram ทันทีที่สายว่าง
+}
+
+void modbusRxNotify() {
+  if (modbusTaskHandle != NULL) xTaskNotifyGive(modbusTaskHandle);
+}
+
+void modbusMonitor(uint8_t id, uint8_t fct, uint8_t event, uint32_t rtt) {
+  modbusStats.record(id, fct, event, rtt);
+}
+
+// แผนที่อุปกรณ์ใน NVS: ขนาดต้องตรงกับ discovery_map_t ของ Firmware นี้
+bool loadDeviceMap() {
+  if (preferences.getBytesLength(DEVICES_KEY) != sizeof(deviceMap)) return false;
+  if (preferences.getBytes(DEVICES_KEY, &deviceMap, sizeof(deviceMap)) != sizeof(deviceMap)) return false;
+  return deviceMap.u8count <= DISCOVERY_DEVICES_MAX;
+}
+
+void saveDeviceMap() {
+  preferences.putBytes(DEVICES_KEY, &deviceMap, sizeof(deviceMap));
+}
+
+// จุดที่อ่านเป็นรอบจากแผนที่อุปกรณ์: Slave แรกของแต่ละชนิด
+// false เมื่อมี Telegram รอคำตอบอยู่ (เรียกใหม่รอบถัดไป)
+bool planDevices() {
+  if (!scheduler.clear()) return false;
+  const discovery_probe_t &npk = deviceProbes[DEVICE_NPK];
+  uint8_t npkId = discoveryFind(deviceMap, DEVICE_NPK);
+  modbusPoints[POINT_NPK] = { npkId, npk.u8fct, npk.u16address, npk.u16count, au16dataSlave2, NPK_POLL_PERIOD, SCHED_NONE };
+  planner.plan(modbusPoints, (npkId != 0) ? POINT_COUNT : 0, 0);  // ไม่พบ NPK: ไม่มีจุดให้อ่าน
+  return true;
+}
+
+// {"devices":[{"id":20,"type":"npk"},{"id":21,"type":"unknown"}]}
+bool publishDevices() {
+  const discovery_map_t &map = devicesToNetwork.read();
+  int length = snprintf(devicesBuffer, sizeof(devicesBuffer), "{\"devices\":[");
+  for (uint8_t i = 0; i < map.u8count && length < (int)sizeof(devicesBuffer); i++) {
+    uint8_t type = map.aDevices[i].u8type;
+    length += snprintf(devicesBuffer + length, sizeof(devicesBuffer) - length, "%s{\"id\":%u,\"type\":\"%s\"}",
+                       (i == 0) ? "" : ",", map.aDevices[i].u8id, (type < DEVICE_TYPES) ? deviceName[type] : "unknown");
+  }
+  if (length < (int)sizeof(devicesBuffer)) length += snprintf(devicesBuffer + length, sizeof(devicesBuffer) - length, "]}");
+  if (length >= (int)sizeof(devicesBuffer)) return true;  // ไม่ควรเกิด: DEVICES_JSON_MAX รองรับแผนที่เต็ม
+  return mqtt.publish(DEVICES_TOPIC, (const uint8_t *)devicesBuffer, length, true);
+}
+
+void publishModbusStats() {
+  if (!connectivity.isOnline()) return;
+  for (uint8_t i = 0; i < modbusStats.getCount(); i++) {
+    uint16_t length = modbusStatsFormat(modbusStats.getEntry(i), modbusStatsBuffer, sizeof(modbusStatsBuffer));
+    if (length > 0) mqtt.publish(MODBUS_STATS_TOPIC, (const uint8_t *)modbusStatsBuffer, length);
+  }
+}
+
+// true เมื่อมีสัญญาณใดเปลี่ยนเกิน deadband (และพ้น minInterval) หรือไม่ได้ส่งนานเกิน maxAge
+bool reportDue(const float *signals, uint32_t now) {
+  for (uint8_t i = 0; i < SIGNAL_COUNT; i++) {
+    if (reportFilter[i].changed(signals[i], now) || reportFilter[i].stale(now)) return true;
+  }
+  return false;
+}
+
+// เฟรมมีทุกสัญญาณ: ทุกสัญญาณนับว่าส่งแล้ว
+void reportDone(const float *signals, uint32_t now) {
+  for (uint8_t i = 0; i < SIGNAL_COUNT; i++) reportFilter[i].reported(signals[i], now);
+}
+
+void publishControlInput() {
+  control_input_t input = { scheduleMask, relayOn, relayOff };
+  networkToControl.write(input);
+}
+
+// สรุปเวลาแต่ละขั้นตอนของรอบที่ผ่านมา: esp32/diagnostics/<stage> = {"n","p50","p99","max"} (us)
+// และ esp32/diagnostics = heap, jitter ของ controlTask, stack ที่เหลือน้อยสุดของแต่ละ Task (byte)
+void publishDiagnostics() {
+#if DIAG_ENABLED
+  char topic[40];
+  uint32_t jitter = 0;
+  for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+    stageLatency[i].swap();
+    if (i == STAGE_CONTROL_PERIOD) jitter = stageLatency[i].getMax() - stageLatency[i].getMin();
+    uint16_t length = diagFormat(stageLatency[i], diagBuffer, sizeof(diagBuffer));
+    if (length > 0 && connectivity.isOnline()) {
+      snprintf(topic, sizeof(topic), DIAG_TOPIC "/%s", stageName[i]);
+      mqtt.publish(topic, (const uint8_t *)diagBuffer, length);
+    }
+    stageLatency[i].clear();
+  }
+
+  int length = snprintf(diagBuffer, sizeof(diagBuffer),
+                        "{\"heap\":%lu,\"heapMin\":%lu,\"jitter\":%lu,\"stack\":[%u,%u,%u,%u]}",
+                        (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(), (unsigned long)jitter,
+                        uxTaskGetStackHighWaterMark(controlTaskHandle), uxTaskGetStackHighWaterMark(modbusTaskHandle),
+                        uxTaskGetStackHighWaterMark(sensorTaskHandle), uxTaskGetStackHighWaterMark(networkTaskHandle));
+  if (length > 0 && length < (int)sizeof(diagBuffer) && connectivity.isOnline()) {
+    mqtt.publish(DIAG_TOPIC, (const uint8_t *)diagBuffer, length);
+  }
+#endif
+}
@@ -2,189 +2,356 @@
 #include <PubSubClient.h>
 
 #include "ETT_ModbusRTU.h"
+#include "ModbusScheduler.h"
+#include "ModbusPlanner.h"
+#include "ModbusGateway.h"
+#include "ModbusDiscovery.h"
+#include "ModbusStats.h"
+#include "Snapshot.h"
+#include "Telemetry.h"
+#include "ReportFilter.h"
+#include "AdcSampler.h"
+#include "Schedule.h"
+#include "RuleEngine.h"
+#include "TopicRouter.h"
+#include "Connectivity.h"
+#include "TelemetryStore.h"
+#define DIAG_ENABLED 1  // 0 = ตัดการจับเวลาออกทั้งหมดตอนคอมไพล์
+#include "Diagnostics.h"
+#include <LittleFS.h>
+#include <Preferences.h>
 #include <HardwareSerial.h>
 
 #include <NTPClient.h>
 
-#include <BH1750.h>
 #include <Wire.h>
+#include "LightSensor.h"
 
 #define SerialRS485_RX_PIN    26  //RO
 #define SerialRS485_TX_PIN    27  //DI
 #define RS485_DIRECTION_PIN   25  //DE,RE
 #define RS485_RXD_SELECT      LOW
 #define RS485_TXD_SELECT      HIGH
+#define RS485_HW_DIRECTION    1   // 1 = ESP32 UART ขับขา DE/RE เอง (RS485 half-duplex), 0 = Modbus สลับขาแบบ TX_ASYNC
+#define RS485_BAUD            9600
+
+// Modbus Slave บน RS485 ช่องที่สอง (Serial1): PLC/SCADA อ่านค่าของ node นี้ได้โดยตรง ไม่ต้องผ่าน MQTT
+#define SLAVE_RX_PIN          16  //RO
+#define SLAVE_TX_PIN          17  //DI
+#define SLAVE_DIRECTION_PIN   4   //DE,RE (UART สลับทิศทางเอง)
+#define SLAVE_ID              1
+#define SLAVE_BAUD            9600
 
 #define WIFI_STA_NAME "Noppadon_host"
 #define WIFI_STA_PASS "88888888"
 #define MQTT_SERVER   "test.mosquitto.org"
 #define MQTT_PORT     1883
 #define MQTT_NAME     "ESP32"
+#define MQTT_BUFFER_SIZE 576  // ข้อความยาวสุดคือแผนที่อุปกรณ์ (DEVICES_JSON_MAX) และสถิติ Modbus (MODBUS_STATS_JSON_MAX)
+
+#define TELEMETRY_TOPIC       "esp32/telemetry"
+#define TELEMETRY_FORMAT      TELEMETRY_BINARY  // TELEMETRY_BINARY (20 byte) หรือ TELEMETRY_JSON
+#define TELEMETRY_CHECK       1000  // ms, ระยะห่างขั้นต่ำระหว่างสองเฟรม (ส่งเฉพาะเมื่อค่าเปลี่ยนหรือครบอายุ, ดู reportConfig)
+
+// เก็บ Telemetry ลง Flash ขณะ offline แล้วทยอยส่งเมื่อกลับมา online
+#define STORE_PATH            "/telemetry.bin"
+#define STORE_CAPACITY        2048  // record (~2.8 ชั่วโมงที่ 5 วินาที, 64 KB)
+#define BACKLOG_TOPIC         "esp32/telemetry/backlog"
+#define BACKLOG_PERIOD        1000  // ms ระหว่างแต่ละชุด
+#define BACKLOG_BATCH         10    // record ต่อชุด
 
 #define MOISTURE_PIN          33
+#define MOISTURE_ADC_CHANNEL  ADC_CHANNEL_5  // GPIO33 = ADC1_CH5
+#define MOISTURE_DRY_MV       3100  // mV เมื่อดินแห้ง (0 %)
+#define MOISTURE_WET_MV       0     // mV เมื่อดินชุ่มน้ำ (100 %)
+
+// ADC แบบต่อเนื่อง (DMA): 20 kHz, median 5 ตัวอย่าง แล้วเฉลี่ย 200 ค่า -> 20 ค่า/วินาที
+#define ADC_SAMPLE_RATE       20000
+#define ADC_MEDIAN            5
+#define ADC_BOXCAR            200
 
 #define RELAY_PIN_1           32
 #define RELAY_PIN_2           14
 
 #define LIGHT_PIN             34
 
+#define DIAG_TOPIC            "esp32/diagnostics"
+#define DIAG_PERIOD           60000 // ms, รอบส่งสรุปเวลาแต่ละขั้นตอน
+
+#define SCHEDULE_TOPIC        "esp32/schedule/"  // + หมายเลข Relay (1, 2): "<วัน>,<HH:MM>-<HH:MM>;..." ดู Schedule.h
+#define SCHEDULE_DEFAULT      "127,06:00-22:00"  // ทุกวัน 06:00-22:00
+
+#define SETPOINT_TOPIC        "esp32/setpoint/"  // + ชื่อสัญญาณ (moisture, lux, n, p, k): เลื่อน on threshold ของทุกกฎบนสัญญาณนั้น
+#define RELAY_TOPIC           "esp32/relay/"     // + หมายเลข Relay (1, 2): "on", "off" หรือ "auto" (ตามกฎ)
+#define RULES_TOPIC           "esp32/rules"  // ตารางกฎทั้งชุด: "<signal>,<|>,<on>,<off>,<minOn s>,<minOff s>,<schedule mask>,<pin>;..." ดู RuleEngine.h
+#define MOISTURE_HYSTERESIS   5   // % เหนือ setpoint ที่ปั๊มจะหยุด
+#define LIGHT_HYSTERESIS      20  // lux เหนือ setpoint ที่ไฟจะดับ
+
+#define MODBUS_STATS_TOPIC    "esp32/modbus/stats"      // หนึ่งข้อความต่อ (Slave ID, Function code)
+#define MODBUS_STATS_GET      "esp32/modbus/stats/get"  // ส่งข้อความใดก็ได้มาเพื่อขอสถิติ
+
+#define MODBUS_TCP_PORT       502   // Modbus TCP -> RTU gateway: HMI/SCADA อ่านและเขียน Slave บน RS485 ผ่าน WiFi
+
+// ค้นหา Slave บน RS485: แผนที่อุปกรณ์เก็บใน NVS, บูตครั้งถัดไปเริ่มอ่านจากแผนที่เดิมทันทีแล้วสแกนซ้ำเบื้องหลัง
+#define DEVICES_NVS           "modbus"   // namespace ของ Preferences
+#define DEVICES_KEY           "devices"
+#define DEVICES_EXPECTED      0          // จำนวน Slave ที่ติดตั้ง (สแกนจบเมื่อพบครบ), 0 = สแกนทุก ID
+#define DEVICES_TOPIC         "esp32/modbus/devices"  // แผนที่อุปกรณ์ (retained): {"devices":[{"id":20,"type":"npk"}]}
+#define DEVICES_SCAN_TOPIC    "esp32/modbus/scan"     // ส่งข้อความใดก็ได้เพื่อสแกนใหม่
+#define DEVICES_JSON_MAX      (16 + DISCOVERY_DEVICES_MAX * 30)  // {"id":247,"type":"unknown"},
+
+#define NPK_POLL_PERIOD       1000  // ms
+#define MODBUS_TASKS          4
+
+// FreeRTOS Task: core 0 = WiFi/MQTT, core 1 = งานควบคุม
+#define NETWORK_CORE          0
+#define APP_CORE              1
+#define CONTROL_TASK_PERIOD   20    // ms, รอบตัดสินใจ Relay
+#define SENSOR_TASK_PERIOD    50    // ms, รอบอ่านความชื้น/แสง
+#define MODBUS_TASK_TICK      5     // ms, รอบสูงสุดของ Modbus Task เมื่อไม่มีเฟรมเข้า
+#define NETWORK_TASK_TICK     10    // ms
+
+#if RS485_HW_DIRECTION
+Modbus master(0, Serial2);  // กำหนด Modbus RTU ผ่าน Serial2 (RS485), UART สลับทิศทางเอง
+#else
 Modbus master(0, Serial2, RS485_DIRECTION_PIN);  // กำหนด Modbus RTU ผ่าน Serial2 (RS485)
+#endif
+Modbus slave(SLAVE_ID, Serial1);  // Register map อยู่ใน function.ino (slaveRegisters)
 uint16_t au16dataSlave2[3];  // Buffer สำหรับเก็บข้อมูล SOIL NPK
-modbus_t telegram[1];        // กำหนด Modbus Telegram 1 ตัว
+modbus_task_t modbusTasks[MODBUS_TASKS];  // ตาราง Telegram ที่อ่านเป็นรอบ
+ModbusScheduler scheduler(master, modbusTasks, MODBUS_TASKS);
+ModbusPlanner planner(scheduler);  // รวมจุดที่อยู่ใกล้กันของ Slave เดียวกันเป็นคำขอเดียว
+ModbusGateway gateway(master);     // modbusTask: ส่งคำขอจาก Modbus TCP ออก RS485 เมื่อ Master ว่าง
+ModbusTcpServer<WiFiClient> modbusTcp(gateway);  // networkTask: รับ/ตอบเฟรม MBAP
+WiFiServer modbusTcpListener(MODBUS_TCP_PORT);
+bool modbusTcpStarted = false;
+
+// ชนิดอุปกรณ์ที่รู้จัก: Register ที่ระบุชนิดได้ (ตอบโดยไม่เป็น exception) เรียงจากเฉพาะเจาะจงที่สุด
+enum { DEVICE_NPK, DEVICE_TYPES };
+const discovery_probe_t deviceProbes[DEVICE_TYPES] = {
+  { MB_FC_READ_REGISTERS, 30, 3 },  // Soil NPK: N, P, K
+};
+const char *const deviceName[DEVICE_TYPES] = { "npk" };
+ModbusDiscovery discovery(master, deviceProbes, DEVICE_TYPES);  // modbusTask: สแกนเมื่อ Master ว่าง
+discovery_map_t deviceMap;  // modbusTask เท่านั้น (หลัง setup)
+Preferences preferences;
+char devicesBuffer[DEVICES_JSON_MAX];
+volatile bool modbusScanRequested = false;
+
+// จุดที่อ่านเป็นรอบ: Slave ID, Function code, Register, จำนวน, ปลายทาง, รอบ (ms) สร้างจากแผนที่อุปกรณ์ใน planDevices()
+// เพิ่มจุดของ Slave เดียวกันได้ (เช่น pH ที่ 6, ความชื้น/อุณหภูมิที่ 18..19) โดยไม่เพิ่มจำนวนคำขอบนสาย
+enum { POINT_NPK, POINT_COUNT };
+modbus_point_t modbusPoints[POINT_COUNT];
+ModbusStats modbusStats;  // สถิติแยกตาม Slave ID และ Function code
+char modbusStatsBuffer[MODBUS_STATS_JSON_MAX];
+volatile bool modbusStatsRequested = false;
+
+AdcSampler adc;
+int8_t moistureAdc = -1;
 
 int16_t moistureValue = 0;
 int16_t moistureValue_percent = 0;
 int16_t moistureValue_percent_compare = 20;
 
 float lightIntensity = 0;
-float lightIntensity_compare = 80;
 
 uint32_t time_send = 0;
 uint32_t time_print = 0;
 
-float soil_n, soil_p, soil_k;
+uint8_t telemetryBuffer[TELEMETRY_JSON_MAX];  // Buffer ข้อความ Telemetry (ไม่ใช้ heap)
+uint8_t backlogBuffer[TELEMETRY_BINARY_SIZE];
+uint16_t telemetrySeq = 0;
+
+// Report by exception: ส่ง Telemetry เมื่อค่าใดค่าหนึ่งเปลี่ยนเกิน deadband หรือไม่ได้ส่งนานเกิน maxAge
+enum { SIGNAL_MOISTURE, SIGNAL_LUX, SIGNAL_N, SIGNAL_P, SIGNAL_K, SIGNAL_COUNT };
+const report_config_t reportConfig[SIGNAL_COUNT] = {
+  // fAbs, fRel, minInterval (ms), maxAge (ms)
+  { 2,   0,    5000,  300000 },  // ความชื้น: 2 %
+  { 5,   0.10, 5000,  300000 },  // แสง: 10 % หรืออย่างน้อย 5 lux
+  { 2,   0.05, 60000, 900000 },  // N: เปลี่ยนช้าเป็นชั่วโมง
+  { 2,   0.05, 60000, 900000 },  // P
+  { 2,   0.05, 60000, 900000 },  // K
+};
+ReportFilter reportFilter[SIGNAL_COUNT];
+const char *const signalName[SIGNAL_COUNT] = { "moisture", "lux", "n", "p", "k" };  // ชื่อใน RULES_TOPIC
+
+// กฎควบคุม Relay: on/off threshold (hysteresis), เวลาเปิด/ปิดขั้นต่ำ และช่วงเวลา
+const uint8_t relayPins[] = { RELAY_PIN_1, RELAY_PIN_2 };  // ขาที่กฎสั่งได้
+const rule_table_t ruleDefault = { {
+  // signal, comparator, on, off, minOn (s), minOff (s), schedule mask, pin
+  { SIGNAL_MOISTURE, RULE_BELOW, 20, 20 + MOISTURE_HYSTERESIS, 10, 30, 0x01, RELAY_PIN_1 },  // ปั๊มน้ำเมื่อดินแห้ง
+  { SIGNAL_LUX,      RULE_BELOW, 80, 80 + LIGHT_HYSTERESIS,    0,  0,  0x02, RELAY_PIN_2 },  // ไฟเมื่อแสงน้อย
+}, 2 };
+RuleEngine rules;       // controlTask เท่านั้น
+rule_table_t ruleTable;  // networkTask เท่านั้น: ตารางที่แก้จาก MQTT แล้วส่งทั้งชุดผ่าน rulesToControl
+uint8_t relayOn = 0, relayOff = 0;  // networkTask เท่านั้น: สั่ง Relay ด้วยมือจาก RELAY_TOPIC
+uint32_t time_backlog = 0;
+
+TelemetryStore telemetryStore(LittleFS, STORE_PATH, STORE_CAPACITY);
+
+// ข้อมูลที่ส่งต่อระหว่าง Task (หนึ่ง Snapshot ต่อผู้เขียนหนึ่ง/ผู้อ่านหนึ่ง)
+typedef struct {
+  int16_t moistureValue;
+  int16_t moistureValue_percent;
+  float lightIntensity;
+} sensor_reading_t;
+
+typedef struct {
+  float soil_n, soil_p, soil_k;
+} npk_reading_t;
+
+typedef struct {
+  uint8_t scheduleMask;  // bit 0 = Relay 1, bit 1 = Relay 2 อยู่ในช่วงเวลาทำงาน
+  uint8_t relayOn;       // bit n = Relay n+1 สั่งเปิดด้วยมือ
+  uint8_t relayOff;      // bit n = Relay n+1 สั่งปิดด้วยมือ
+} control_input_t;
+
+Snapshot<sensor_reading_t> sensorToControl;   // sensorTask -> controlTask
+Snapshot<sensor_reading_t> sensorToNetwork;   // sensorTask -> networkTask
+Snapshot<npk_reading_t> npkToNetwork;         // modbusTask -> networkTask
+Snapshot<npk_reading_t> npkToControl;         // modbusTask -> controlTask
+Snapshot<control_input_t> networkToControl;   // networkTask -> controlTask (ช่วงเวลา)
+Snapshot<rule_table_t> rulesToControl;        // networkTask -> controlTask (ตารางกฎทั้งชุด)
+
+// สถานะที่ Modbus Slave ให้อ่าน: ค่าที่ controlTask ใช้ตัดสินใจรอบล่าสุด
+typedef struct {
+  sensor_reading_t sensor;
+  npk_reading_t npk;
+  uint8_t relays;        // bit n = Relay n+1 เปิดอยู่
+  uint8_t scheduleMask;
+  int16_t ruleOn[RULES_MAX];   // threshold x10, ว่าง = 0
+  int16_t ruleOff[RULES_MAX];
+} node_status_t;
+
+Snapshot<node_status_t> controlToModbus;      // controlTask -> modbusTask (Modbus Slave)
+Snapshot<discovery_map_t> devicesToNetwork;   // modbusTask -> networkTask (แผนที่อุปกรณ์ใหม่)
+
+TaskHandle_t modbusTaskHandle = NULL;
+TaskHandle_t controlTaskHandle = NULL;
+TaskHandle_t sensorTaskHandle = NULL;
+TaskHandle_t networkTaskHandle = NULL;
+
+#if DIAG_ENABLED
+// ขั้นตอนที่จับเวลา (us) หนึ่ง Histogram ต่อขั้นตอน เขียนจาก Task เดียว
+enum {
+  STAGE_MODBUS,          // scheduler.poll()
+  STAGE_MOISTURE,        // moistureSensor()
+  STAGE_LIGHT,           // lightSensor()
+  STAGE_RELAY,           // ตัดสินใจ Relay
+  STAGE_CONTROL_PERIOD,  // รอบจริงของ controlTask (jitter)
+  STAGE_NTP,             // timeClient.update()
+  STAGE_MQTT,            // connectivity.poll() รวม mqtt.loop()
+  STAGE_NETWORK,         // หนึ่งรอบของ networkTask
+  STAGE_COUNT
+};
+const char *const stageName[STAGE_COUNT] = { "modbus", "moisture", "light", "relay", "control_period", "ntp", "mqtt", "network" };
+LatencyHistogram stageLatency[STAGE_COUNT];
+char diagBuffer[DIAG_JSON_MAX];
+#endif
+uint32_t time_diag = 0;
 
 const char *ntpServer = "pool.ntp.org";
 const long  utcOffsetInSeconds = 25200;
 
-bool timeConditionMet = false;
+Schedule schedule;  // ช่วงเวลาทำงานของแต่ละ Relay (วินาทีนับจากเที่ยงคืน)
+uint8_t scheduleMask = 0;  // Relay ทั้งหมดปิดจนกว่า NTP จะ sync
 
-BH1750 lightMeter;
+LightSensor lightMeter(Wire);  // BH1750 แบบไม่ block: สั่งแปลงค่าแล้วอ่านเมื่อครบเวลาแปลง
 
 WiFiClient client;
 PubSubClient mqtt(client);
+Connectivity connectivity(mqtt, WIFI_STA_NAME, WIFI_STA_PASS, MQTT_NAME);
 
 WiFiUDP ntpUDP;
 NTPClient timeClient(ntpUDP, ntpServer, utcOffsetInSeconds);
 
 void setup() {
+  Serial.begin(9600);  // Serial Debug
+#if DIAG_ENABLED
+  diagBegin();  // อ่านความถี่ CPU ครั้งเดียวก่อนเริ่ม Task ที่จับเวลา
+#endif
   Serial.println();
   Serial.print("Connecting to ");
   Serial.println(WIFI_STA_NAME);
 
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_STA_NAME, WIFI_STA_PASS);
-
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
-
   mqtt.setServer(MQTT_SERVER, MQTT_PORT);
   mqtt.setCallback(callback);
+  mqtt.setBufferSize(MQTT_BUFFER_SIZE);
+  connectivity.setOnConnect(mqttSubscribe);
+  connectivity.begin();  // ไม่รอ WiFi, networkTask เชื่อมต่อต่อเอง
 
-  pinMode(RELAY_PIN_1, OUTPUT);
-  pinMode(RELAY_PIN_2, OUTPUT);
+  rules.setOutputs(relayPins, sizeof(relayPins), SIGNAL_COUNT);  // Relay ทั้งหมดปิด
   pinMode(LIGHT_PIN, INPUT);
 
+  moistureAdc = adc.addChannel(MOISTURE_ADC_CHANNEL);
+  if (!adc.begin(ADC_SAMPLE_RATE, ADC_MEDIAN, ADC_BOXCAR)) {
+    Serial.println("ADC DMA unavailable, using analogRead");
+  }
+
+  Serial2.begin(RS485_BAUD, SERIAL_8N1, SerialRS485_RX_PIN, SerialRS485_TX_PIN);
+  Serial2.setRxTimeout(1);  // UART idle-line: ส่งข้อมูลเข้า buffer หลังสายว่าง 1 symbol
+#if RS485_HW_DIRECTION
+  Serial2.setPins(-1, -1, -1, RS485_DIRECTION_PIN);  // RTS -> DE,RE
+  Serial2.setMode(UART_MODE_RS485_HALF_DUPLEX);
+#else
   pinMode(RS485_DIRECTION_PIN, OUTPUT);
   digitalWrite(RS485_DIRECTION_PIN, RS485_RXD_SELECT);
+#endif
 
-  Serial.begin(9600);  // Serial Debug
-  Serial2.begin(9600, SERIAL_8N1, SerialRS485_RX_PIN, SerialRS485_TX_PIN);
+  Serial1.begin(SLAVE_BAUD, SERIAL_8N1, SLAVE_RX_PIN, SLAVE_TX_PIN);
+  Serial1.setPins(-1, -1, -1, SLAVE_DIRECTION_PIN);  // RTS -> DE,RE
+  Serial1.setMode(UART_MODE_RS485_HALF_DUPLEX);
+  slave.begin(Serial1, SLAVE_BAUD);  // ตอบคำขอใน modbusTask
 
   Serial.println("SOIL NPK SENSOR SETUP...");
 
-  // ตั้งค่า Modbus Telegram
-  telegram[0].u8id = 20;              // Slave ID ของเซ็นเซอร์ SOIL NPK
-  telegram[0].u8fct = 3;              // Function code (Read Holding Registers)
-  telegram[0].u16RegAdd = 30;         // Start address ของข้อมูลในเซ็นเซอร์
-  telegram[0].u16CoilsNo = 3;         // จำนวน Register ที่จะอ่าน (N, P, K)
-  telegram[0].au16reg = au16dataSlave2;  // ชี้ไปยัง Buffer
-
-  master.begin(Serial2);  // เริ่มต้น Modbus Master
+  master.begin(Serial2, RS485_BAUD);  // เริ่มต้น Modbus Master
+#if !RS485_HW_DIRECTION
+  master.setTxMode(TX_ASYNC);          // query() ไม่รอส่งจบ, poll() ปล่อยขา DE/RE เอง
+#endif                                 // ถ้า UART สลับทิศทางเอง query() ไม่รออยู่แล้ว
+  master.setRxMode(RX_EVENT);          // รับเฟรมใน callback ของ UART แทนการวน available()
+  Serial2.onReceive(modbusRxEvent, true);  // เรียกเมื่อสายว่าง (RX timeout)
   master.setTimeOut(3000); // Timeout 3 วินาที
 
-  Wire.begin();
-  lightMeter.begin();
-
-  timeClient.begin();
-  timeClient.update();
-  String currentTime = timeClient.getFormattedTime();
-  if (currentTime >= "06:00:00" && currentTime <= "21:59:00") timeConditionMet = true;
-  if (currentTime >= "22:00:00" || currentTime <= "05:59:00") timeConditionMet = false;
-  Serial.println(timeConditionMet);
-}
+  master.setRxNotify(modbusRxNotify);  // ปลุก modbusTask เมื่อได้คำตอบ
+  master.setMonitor(modbusMonitor);    // นับคำขอ/คำตอบ/ผิดพลาด และ RTT ต่อ Slave
+  gateway.setNotify(modbusRxNotify);   // ปลุก modbusTask เมื่อมีคำขอจาก Modbus TCP
 
-void loop() {
-  static uint8_t u8state = 0;
-  static unsigned long u32wait;
-
-  switch (u8state) {
-    case 0:
-      master.query(telegram[0]);
-      u8state++;
-      break;
-
-    case 1:
-      if (master.poll()) {
-        soil_n = au16dataSlave2[0];  // ค่า Nitrogen
-        soil_p = au16dataSlave2[1];  // ค่า Phosphorus
-        soil_k = au16dataSlave2[2];  // ค่า Potassium
-
-        u8state = 0;
-        u32wait = millis() + 1000;
-      }
-      break;
-  }
+  preferences.begin(DEVICES_NVS, false);
+  if (!loadDeviceMap()) memset(&deviceMap, 0, sizeof(deviceMap));  // บูตครั้งแรก: รอผลสแกน
+  Serial.printf("Modbus devices: %u\n", deviceMap.u8count);
+  planDevices();                           // ตั้งค่า Modbus Telegram จากแผนที่เดิม
+  devicesToNetwork.write(deviceMap);
+  discovery.setExpected(DEVICES_EXPECTED);
+  discovery.start(&deviceMap);             // สแกนเบื้องหลัง, Slave ในแผนที่เดิมก่อน
 
-  if (millis() > u32wait && u8state == 0) {
-    u8state = 0;
+  Wire.begin();
+  if (!lightMeter.begin()) {
+    Serial.println("BH1750 not found");
   }
 
-  moistureSensor();
-  lightSensor();
+  timeClient.begin();
 
-  if (millis() - time_print >= 1000) {
-    Serial.printf("moistureValue_percent_compare: %d\n", moistureValue_percent_compare);
-    Serial.printf("Soil N: %.2f, P: %.2f, K: %.2f\n", soil_n, soil_p, soil_k);
-    Serial.printf("Moisture: %d Percent: %d\n", moistureValue, moistureValue_percent);
-    Serial.printf("Light Intensity: %.2f\n", lightIntensity);
-    time_print = millis();
+  if (!LittleFS.begin(true) || !telemetryStore.begin()) {
+    Serial.println("Telemetry store unavailable");
   }
 
-  timeClient.update();
-  String currentTime = timeClient.getFormattedTime();
-  //  Serial.println(timeClient.getFormattedTime());
-  if (currentTime == "06:00:00" && timeConditionMet == false) {
-    timeConditionMet = true;
-  }
-  else if (currentTime == "22:00:00" && timeConditionMet == true) {
-    timeConditionMet = false;
-  }
+  for (uint8_t i = 0; i < SIGNAL_COUNT; i++) reportFilter[i].setConfig(reportConfig[i]);
 
-  if (timeConditionMet) {
-    digitalWrite(RELAY_PIN_1, moistureValue_percent < moistureValue_percent_compare ? HIGH : LOW);
-    digitalWrite(RELAY_PIN_2, lightIntensity < lightIntensity_compare ? HIGH : LOW);
-  } else {
-    digitalWrite(RELAY_PIN_1, LOW);
-    digitalWrite(RELAY_PIN_2, LOW);
-  }
+  schedule.parse(0, SCHEDULE_DEFAULT, strlen(SCHEDULE_DEFAULT));
+  schedule.parse(1, SCHEDULE_DEFAULT, strlen(SCHEDULE_DEFAULT));
 
-  if (millis() - time_send >= 5000) {
-    mqtt.publish("esp32/moisture", String(moistureValue_percent).c_str());
-    mqtt.publish("esp32/lux_sensor", String(lightIntensity).c_str());
-    mqtt.publish("esp32/n", String(soil_n).c_str());
-    mqtt.publish("esp32/p", String(soil_p).c_str());
-    mqtt.publish("esp32/k", String(soil_k).c_str());
-    time_send = millis();
-  }
+  ruleTable = ruleDefault;
+  rulesToControl.write(ruleTable);
+  publishControlInput();
 
-  if (mqtt.connected() == false) {
-    Serial.print("MQTT connection... ");
-    if (mqtt.connect(MQTT_NAME)) {
-      Serial.println("connected");
-      mqtt.subscribe("esp32/moisture_percent");
-    } else {
-      Serial.println("failed");
-      delay(5000);
-    }
-  } else {
-    mqtt.loop();
-  }
+  xTaskCreatePinnedToCore(controlTask, "control", 2048, NULL, 4, &controlTaskHandle, APP_CORE);
+  xTaskCreatePinnedToCore(modbusTask, "modbus", 4096, NULL, 3, &modbusTaskHandle, APP_CORE);  // เขียน NVS
+  xTaskCreatePinnedToCore(sensorTask, "sensor", 3072, NULL, 2, &sensorTaskHandle, APP_CORE);
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, 1, &networkTaskHandle, NETWORK_CORE);
 }
+
+void loop() {
+  vTaskDelete(NULL);  // งานทั้งหมดอยู่ใน Task ของตัวเอง (tasks.ino)
+}
+
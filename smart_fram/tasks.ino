@@ -0,0 +1,189 @@
+// อ่านความชื้นและแสง แล้วส่งค่าให้ controlTask และ networkTask
+void sensorTask(void *pvParameters) {
+  TickType_t lastWake = xTaskGetTickCount();
+
+  for (;;) {
+    DIAG_BEGIN(t);
+    moistureSensor();
+    DIAG_END(stageLatency[STAGE_MOISTURE], t);
+    DIAG_BEGIN(t2);
+    lightSensor();
+    DIAG_END(stageLatency[STAGE_LIGHT], t2);
+
+    sensor_reading_t reading = { moistureValue, moistureValue_percent, lightIntensity };
+    sensorToControl.write(reading);
+    sensorToNetwork.write(reading);
+
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(SENSOR_TASK_PERIOD));
+  }
+}
+
+// Modbus Master: ตื่นเมื่อมีคำตอบ (modbusRxNotify) หรือทุก MODBUS_TASK_TICK เพื่อส่ง Telegram ที่ถึงรอบ
+// Modbus Slave: ตอบคำขอจาก PLC/SCADA ในรอบเดียวกัน
+// Modbus TCP gateway: ส่งคำขอที่ networkTask รับมาออก RS485 ระหว่าง Telegram ของ scheduler
+// Discovery: สแกน Slave ในเวลาที่สายว่าง เมื่อแผนที่อุปกรณ์เปลี่ยนจึงเก็บลง NVS และวางแผนจุดที่อ่านใหม่
+void modbusTask(void *pvParameters) {
+  bool devicesChanged = false;
+
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MODBUS_TASK_TICK));
+
+    DIAG_BEGIN(t);
+    controlToModbus.update();  // หนึ่งค่าต่อรอบ: ทุก register ในคำขอเดียวมาจากชุดเดียวกัน
+    slave.poll(slaveRegisters, sizeof(slaveRegisters) / sizeof(slaveRegisters[0]));
+    int8_t doneTask = scheduler.poll();
+    bool pointsUpdated = planner.complete(doneTask);  // กระจายคำตอบไปยังแต่ละจุด ก่อนรอบถัดไป
+    gateway.poll();  // คำขอจาก Modbus TCP ใช้สายเมื่อ scheduler ไม่ได้ใช้
+    if (modbusScanRequested) {
+      modbusScanRequested = false;
+      discovery.start(&deviceMap);
+    }
+    // Slave เดิมที่ไม่ตอบยังอยู่ในแผนที่ (และยังถูกอ่าน) จนพลาดครบ DISCOVERY_MISSES_MAX รอบสแกน
+    // ตัวนับ u8missed อยู่ในแผนที่ด้วย จึงบันทึกลง NVS ทุกครั้งที่เปลี่ยน
+    if (discovery.poll() && memcmp(&discovery.getMap(), &deviceMap, sizeof(deviceMap)) != 0) {
+      deviceMap = discovery.getMap();
+      saveDeviceMap();
+      devicesToNetwork.write(deviceMap);
+      devicesChanged = true;
+    }
+    if (devicesChanged && planDevices()) devicesChanged = false;
+    DIAG_END(stageLatency[STAGE_MODBUS], t);
+    if (pointsUpdated && doneTask == modbusPoints[POINT_NPK].i8task) {
+      npk_reading_t npk;
+      npk.soil_n = au16dataSlave2[0];  // ค่า Nitrogen
+      npk.soil_p = au16dataSlave2[1];  // ค่า Phosphorus
+      npk.soil_k = au16dataSlave2[2];  // ค่า Potassium
+      npkToNetwork.write(npk);
+      npkToControl.write(npk);
+    }
+  }
+}
+
+// ตัดสินใจ Relay ทุก CONTROL_TASK_PERIOD จากค่าล่าสุด ไม่รอ I2C, RS485 หรือ MQTT
+void controlTask(void *pvParameters) {
+  TickType_t lastWake = xTaskGetTickCount();
+  DIAG_BEGIN(lap);
+
+  for (;;) {
+    DIAG_LAP(stageLatency[STAGE_CONTROL_PERIOD], lap);
+    DIAG_BEGIN(t);
+    sensorToControl.update();
+    npkToControl.update();
+    networkToControl.update();
+    if (rulesToControl.update()) rules.load(rulesToControl.read());  // ตารางใหม่ทั้งชุด ตรวจแล้วใน callback
+    const sensor_reading_t &sensor = sensorToControl.read();
+    const npk_reading_t &npk = npkToControl.read();
+    const control_input_t &input = networkToControl.read();
+
+    float signals[SIGNAL_COUNT] = { (float)sensor.moistureValue_percent, sensor.lightIntensity, npk.soil_n, npk.soil_p, npk.soil_k };
+    rules.setOverride(input.relayOn, input.relayOff);
+    rules.evaluate(signals, input.scheduleMask, millis());
+
+    node_status_t status = { sensor, npk, rules.getOutputs(), input.scheduleMask };
+    for (uint8_t i = 0; i < rules.getCount(); i++) {
+      status.ruleOn[i] = lroundf(rules.getRule(i)->fOn * 10);
+      status.ruleOff[i] = lroundf(rules.getRule(i)->fOff * 10);
+    }
+    controlToModbus.write(status);
+    DIAG_END(stageLatency[STAGE_RELAY], t);
+
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(CONTROL_TASK_PERIOD));
+  }
+}
+
+// WiFi/MQTT/NTP: งานที่อาจค้างได้ทั้งหมดอยู่ที่นี่ (core 0)
+void networkTask(void *pvParameters) {
+  bool npkUpdated = false;
+  bool devicesPending = true;
+
+  for (;;) {
+    DIAG_BEGIN(t);
+    sensorToNetwork.update();
+    if (npkToNetwork.update()) npkUpdated = true;
+    const sensor_reading_t &sensor = sensorToNetwork.read();
+    const npk_reading_t &npk = npkToNetwork.read();
+
+    if (millis() - time_print >= 1000) {
+      Serial.printf("moistureValue_percent_compare: %d\n", moistureValue_percent_compare);
+      Serial.printf("Soil N: %.2f, P: %.2f, K: %.2f\n", npk.soil_n, npk.soil_p, npk.soil_k);
+      Serial.printf("Moisture: %d Percent: %d\n", sensor.moistureValue, sensor.moistureValue_percent);
+      Serial.printf("Light Intensity: %.2f\n", sensor.lightIntensity);
+      time_print = millis();
+    }
+
+    DIAG_BEGIN(tMqtt);
+    connectivity.poll();  // WiFi/MQTT แบบไม่ block, มี backoff
+    DIAG_END(stageLatency[STAGE_MQTT], tMqtt);
+
+    DIAG_BEGIN(tNtp);
+    if (connectivity.isWifiUp()) timeClient.update();
+    DIAG_END(stageLatency[STAGE_NTP], tNtp);
+    // ช่วงเวลาทำงาน: คำนวณใหม่เฉพาะเมื่อถึงจุดเปลี่ยนถัดไป (เวลาท้องถิ่น)
+    if (timeClient.isTimeSet()) scheduleMask = schedule.evaluate(timeClient.getEpochTime());
+
+    float signals[SIGNAL_COUNT] = { (float)sensor.moistureValue_percent, sensor.lightIntensity, npk.soil_n, npk.soil_p, npk.soil_k };
+    if (millis() - time_send >= TELEMETRY_CHECK && reportDue(signals, millis())) {
+      // ส่งค่าทั้งหมดในข้อความเดียว เฉพาะเมื่อมีค่าเปลี่ยนเกิน deadband หรือครบอายุ
+      telemetry_sample_t sample;
+      sample.u32time = timeClient.getEpochTime() - utcOffsetInSeconds;
+      sample.u8flags = (npkUpdated ? 0 : TELEMETRY_FLAG_NPK_STALE) | (timeClient.isTimeSet() ? 0 : TELEMETRY_FLAG_TIME_UNSET);
+      sample.i16moisture = sensor.moistureValue_percent;
+      sample.fLux = sensor.lightIntensity;
+      sample.u16n = npk.soil_n;
+      sample.u16p = npk.soil_p;
+      sample.u16k = npk.soil_k;
+      reportDone(signals, millis());
+
+      uint16_t length = telemetryPack(&sample, telemetrySeq, TELEMETRY_FORMAT, telemetryBuffer, sizeof(telemetryBuffer));
+      if (length == 0 || !connectivity.isOnline() || !mqtt.publish(TELEMETRY_TOPIC, telemetryBuffer, length)) {
+        // ส่งไม่ได้: เก็บลง Flash ในรูปแบบ binary
+        telemetryPackBinary(&sample, telemetrySeq, backlogBuffer, sizeof(backlogBuffer));
+        telemetryStore.append(backlogBuffer);
+      }
+      telemetrySeq++;
+      npkUpdated = false;
+      time_send = millis();
+    }
+
+    // ทยอยส่งข้อมูลที่ค้างใน Flash ทีละชุด หลังข้อมูลสดเสมอ
+    if (connectivity.isOnline() && telemetryStore.available() > 0 && millis() - time_backlog >= BACKLOG_PERIOD) {
+      for (uint8_t i = 0; i < BACKLOG_BATCH && telemetryStore.peek(backlogBuffer); i++) {
+        if (!mqtt.publish(BACKLOG_TOPIC, backlogBuffer, TELEMETRY_BINARY_SIZE)) break;
+        telemetryStore.pop();
+      }
+      telemetryStore.commit();
+      time_backlog = millis();
+    }
+
+    // Modbus TCP: รับการเชื่อมต่อใหม่ ส่งคำขอให้ modbusTask และส่งคำตอบที่เสร็จแล้วกลับ
+    if (connectivity.isWifiUp()) {
+      if (!modbusTcpStarted) {
+        modbusTcpListener.begin();
+        modbusTcpStarted = true;
+      }
+      WiFiClient incoming = modbusTcpListener.accept();
+      if (incoming) {
+        incoming.setNoDelay(true);
+        if (!modbusTcp.attach(incoming)) incoming.stop();  // เต็ม GATEWAY_CLIENTS
+      }
+    }
+    modbusTcp.poll();
+
+    if (devicesToNetwork.update()) devicesPending = true;
+    if (devicesPending && connectivity.isOnline()) devicesPending = !publishDevices();
+
+    if (modbusStatsRequested) {
+      publishModbusStats();
+      modbusStatsRequested = false;
+    }
+
+    if (millis() - time_diag >= DIAG_PERIOD) {
+      publishDiagnostics();
+      time_diag = millis();
+    }
+
+    publishControlInput();  // ช่วงเวลาและการสั่งด้วยมือ -> controlTask
+    DIAG_END(stageLatency[STAGE_NETWORK], t);
+    vTaskDelay(pdMS_TO_TICKS(NETWORK_TASK_TICK));
+  }
+}